@@ -0,0 +1,220 @@
+
+#include "capture.h"
+
+#include <limits.h>
+#include <time.h>
+
+void capture_init(CAPTURE *capture) {
+    capture->file = NULL;
+    capture->last = 0;
+    capture->nextConn = 0;
+    capture->records = 0;
+    pthread_mutex_init(&(capture->mutex), NULL);
+}
+
+void capture_destroy(CAPTURE *capture) {
+    capture_close(capture);
+    pthread_mutex_destroy(&(capture->mutex));
+}
+
+int capture_open(CAPTURE *capture, char *path) {
+    FILE *file = fopen(path, "wb");
+    if(file==NULL)
+        return -1;
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER);
+
+    // Header: wall clock of the start, records are relative to it
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t start = (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+    unsigned char header[13];
+    memcpy(header, CAPTURE_MAGIC, 4);
+    header[4] = CAPTURE_VERSION;
+    int i=0;
+    for(i=0; i<8; i++)
+        header[5+i] = (start >> (8*i)) & 0xFF;
+    if(fwrite(header, 1, sizeof(header), file)!=sizeof(header)) {
+        fclose(file);
+        return -1;
+    }
+
+    pthread_mutex_lock(&(capture->mutex));
+    capture->last = capture_nowNsec();
+    capture->records = 0;
+    capture->file = file;
+    pthread_mutex_unlock(&(capture->mutex));
+
+    return 1;
+}
+
+void capture_close(CAPTURE *capture) {
+    pthread_mutex_lock(&(capture->mutex));
+    if(capture->file!=NULL)
+        fclose(capture->file);
+    capture->file = NULL;
+    pthread_mutex_unlock(&(capture->mutex));
+}
+
+void capture_flush(CAPTURE *capture) {
+    if(capture->file==NULL)
+        return;
+    pthread_mutex_lock(&(capture->mutex));
+    if(capture->file!=NULL)
+        fflush(capture->file);
+    pthread_mutex_unlock(&(capture->mutex));
+}
+
+int capture_conn(CAPTURE *capture, char ip[]) {
+    // Id of a new connection in this capture (-1 = not capturing)
+    if(capture->file==NULL)
+        return -1;
+
+    pthread_mutex_lock(&(capture->mutex));
+    int conn = -1;
+    if(capture->file!=NULL) {
+        conn = (capture->nextConn)++;
+        int len = strlen(ip);
+        capture_record(capture, CAPTURE_OPEN, conn);
+        fputc(len, capture->file);
+        fwrite(ip, 1, len, capture->file);
+    }
+    pthread_mutex_unlock(&(capture->mutex));
+
+    return conn;
+}
+
+void capture_end(CAPTURE *capture, int conn) {
+    if(capture->file==NULL || conn==-1)
+        return;
+
+    pthread_mutex_lock(&(capture->mutex));
+    if(capture->file!=NULL)
+        capture_record(capture, CAPTURE_CLOSE, conn);
+    pthread_mutex_unlock(&(capture->mutex));
+}
+
+void capture_frame(CAPTURE *capture, int conn, int kind, char msgType, char *data, int size) {
+    // Unlocked check first: the common case is not capturing
+    if(capture->file==NULL || conn==-1)
+        return;
+
+    pthread_mutex_lock(&(capture->mutex));
+    if(capture->file!=NULL) {
+        capture_record(capture, kind, conn);
+        fputc((unsigned char)msgType, capture->file);
+        capture_putVarint(capture->file, size);
+        fwrite(data, 1, size, capture->file);
+    }
+    pthread_mutex_unlock(&(capture->mutex));
+}
+
+int capture_openReader(CAPTURE_READER *reader, char *path) {
+    // -1 (errno) if it can't be read, EINVAL if it is not a capture
+    reader->file = fopen(path, "rb");
+    if(reader->file==NULL)
+        return -1;
+
+    unsigned char header[13];
+    if(fread(header, 1, sizeof(header), reader->file)!=sizeof(header)
+            || memcmp(header, CAPTURE_MAGIC, 4)!=0 || header[4]!=CAPTURE_VERSION) {
+        fclose(reader->file);
+        reader->file = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+
+    reader->start = 0;
+    int i=0;
+    for(i=0; i<8; i++)
+        reader->start |= (uint64_t)header[5+i] << (8*i);
+    reader->time = 0;
+
+    return 1;
+}
+
+void capture_closeReader(CAPTURE_READER *reader) {
+    if(reader->file!=NULL)
+        fclose(reader->file);
+    reader->file = NULL;
+}
+
+int capture_read(CAPTURE_READER *reader, CAPTURE_RECORD *record, char data[], int max) {
+    // 1 = record, 0 = end of capture, -1 = truncated or corrupt. Data beyond max is skipped.
+    int kind = fgetc(reader->file);
+    if(kind==EOF)
+        return 0;
+
+    uint64_t conn = 0, delta = 0;
+    if(kind>CAPTURE_CLOSE || capture_getVarint(reader->file, &conn)==-1 || capture_getVarint(reader->file, &delta)==-1
+            || conn>INT_MAX)
+        return -1;
+    reader->time += delta;
+
+    record->kind = kind;
+    record->conn = (int)conn;
+    record->time = reader->time;
+    record->msgType = 0;
+    record->size = 0;
+    record->ip[0] = '\0';
+
+    if(kind==CAPTURE_IN || kind==CAPTURE_OUT) {
+        uint64_t size = 0;
+        int msgType = fgetc(reader->file);
+        if(msgType==EOF || capture_getVarint(reader->file, &size)==-1 || size>CAPTURE_MAX_FRAME)
+            return -1;
+        record->msgType = (char)msgType;
+        record->size = (int)size;
+
+        int keep = (record->size<max? record->size : max);
+        if(fread(data, 1, keep, reader->file)!=(size_t)keep || fseek(reader->file, record->size-keep, SEEK_CUR)==-1)
+            return -1;
+    } else if(kind==CAPTURE_OPEN) {
+        int len = fgetc(reader->file);
+        if(len==EOF || len>15 || fread(record->ip, 1, len, reader->file)!=(size_t)len)
+            return -1;
+        record->ip[len] = '\0';
+    }
+
+    return 1;
+}
+
+void capture_record(CAPTURE *capture, int kind, int conn) {
+    // Record head, with the lock: kind, connection and time since the previous record
+    uint64_t now = capture_nowNsec();
+    uint64_t delta = (now>capture->last? (now - capture->last)/1000 : 0);
+    capture->last += delta*1000; // keeps the sub-us remainder for the next one
+
+    fputc(kind, capture->file);
+    capture_putVarint(capture->file, conn);
+    capture_putVarint(capture->file, delta);
+    (capture->records)++;
+}
+
+void capture_putVarint(FILE *file, uint64_t value) {
+    // 7 bits per byte, low first, high bit = more
+    while(value>=0x80) {
+        fputc((value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    fputc(value, file);
+}
+
+int capture_getVarint(FILE *file, uint64_t *value) {
+    *value = 0;
+    int shift=0;
+    for(shift=0; shift<64; shift+=7) {
+        int c = fgetc(file);
+        if(c==EOF)
+            return -1;
+        *value |= (uint64_t)(c & 0x7F) << shift;
+        if((c & 0x80)==0)
+            return 1;
+    }
+    return -1;
+}
+
+uint64_t capture_nowNsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,68 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "global.h"
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC   "MCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER  (256*1024) // stdio buffer, records reach the disk in blocks
+#define CAPTURE_MAX_FRAME 0xFFFF // frame data never exceeds the 16-bit wire size: larger = corrupt
+
+#define CAPTURE_IN    0 // frame received: type, size, data
+#define CAPTURE_OUT   1 // frame sent: type, size, data
+#define CAPTURE_OPEN  2 // connection added: peer IP
+#define CAPTURE_CLOSE 3 // connection removed
+
+// File = header [magic:4][version:1][start, us since epoch:8 LE], then records
+// [kind:1][conn:varint][us since previous record:varint][payload], in time order.
+// Frame payload = [type:1][size:varint][data], open payload = [len:1][ip].
+typedef struct {
+    FILE *file; // NULL = not capturing
+    uint64_t last; // ns (CLOCK_MONOTONIC) of the last record
+    int nextConn;
+    long records;
+    pthread_mutex_t mutex;
+} CAPTURE;
+
+// One record read back
+typedef struct {
+    int kind;
+    int conn;
+    uint64_t time; // us since the capture started
+    char msgType;
+    int size; // data bytes (whole frame, even if more than the reader's buffer)
+    char ip[16]; // CAPTURE_OPEN
+} CAPTURE_RECORD;
+
+typedef struct {
+    FILE *file;
+    uint64_t start; // us since epoch
+    uint64_t time; // us since start, of the last record
+} CAPTURE_READER;
+
+// Capture manipulation
+void capture_init(CAPTURE *capture);
+void capture_destroy(CAPTURE *capture);
+int capture_open(CAPTURE *capture, char *path);
+void capture_close(CAPTURE *capture);
+void capture_flush(CAPTURE *capture);
+
+// Recording (no-ops when not capturing)
+int capture_conn(CAPTURE *capture, char ip[]);
+void capture_end(CAPTURE *capture, int conn);
+void capture_frame(CAPTURE *capture, int conn, int kind, char msgType, char *data, int size);
+
+// Reading
+int capture_openReader(CAPTURE_READER *reader, char *path);
+void capture_closeReader(CAPTURE_READER *reader);
+int capture_read(CAPTURE_READER *reader, CAPTURE_RECORD *record, char data[], int max);
+
+// Internal
+void capture_record(CAPTURE *capture, int kind, int conn);
+void capture_putVarint(FILE *file, uint64_t value);
+int capture_getVarint(FILE *file, uint64_t *value);
+uint64_t capture_nowNsec(void);
+
+#endif // CAPTURE_H
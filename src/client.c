@@ -1,6 +1,11 @@
 
 #include "client.h"
 
+#include <fcntl.h>
+#include <poll.h>
+
+#include "timer.h"
+
 int client_connect(char *ip, int port) {
 
     // Create socket for connection
@@ -30,3 +35,80 @@ int client_disconnect(int sock) {
         return -1;
     return close(sock);
 }
+
+int client_connectMany(char ips[][16], int num, int port, int socks[], int timeout) {
+    struct pollfd *fds = calloc(num, sizeof(struct pollfd));
+    short *done = calloc(num, sizeof(short)); // poll events once finished
+    int i=0;
+
+    // Start all connections at once (non-blocking)
+    for(i=0; i<num; i++) {
+        socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+        fds[i].fd = -1;
+        if(socks[i] == -1)
+            continue;
+
+        struct sockaddr_in serverConf;
+        serverConf.sin_addr.s_addr = inet_addr(ips[i]);
+        serverConf.sin_family = AF_INET;
+        serverConf.sin_port = htons(port);
+
+        fcntl(socks[i], F_SETFL, fcntl(socks[i], F_GETFL) | O_NONBLOCK);
+        if(connect(socks[i], (struct sockaddr*)&serverConf, sizeof(serverConf)) == -1 && errno != EINPROGRESS) {
+            close(socks[i]);
+            socks[i] = -1;
+            continue;
+        }
+
+        fds[i].fd = socks[i];
+        fds[i].events = POLLOUT;
+    }
+
+    // Wait until all finished or timeout (ms)
+    TIMER t;
+    timer_start(&t);
+    int pending = 0;
+    do {
+        pending = 0;
+        for(i=0; i<num; i++)
+            if(fds[i].fd!=-1)
+                pending++;
+        if(pending==0)
+            break;
+
+        timer_stop(&t);
+        int rest = timeout - (int)timer_timemsec(&t);
+        if(rest<=0 || poll(fds, num, rest)==-1)
+            break;
+
+        // Finished ones leave the poll set, a writable socket would wake every poll
+        for(i=0; i<num; i++) {
+            if(fds[i].fd!=-1 && fds[i].revents!=0) {
+                done[i] = fds[i].revents;
+                fds[i].fd = -1;
+            }
+        }
+    } while(1);
+
+    // Check results and go back to blocking mode
+    int connected = 0;
+    for(i=0; i<num; i++) {
+        if(socks[i] == -1)
+            continue;
+
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if(!(done[i] & POLLOUT) || getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &error, &len)==-1 || error!=0) {
+            close(socks[i]);
+            socks[i] = -1;
+            continue;
+        }
+
+        fcntl(socks[i], F_SETFL, fcntl(socks[i], F_GETFL) & ~O_NONBLOCK);
+        connected++;
+    }
+
+    free(fds);
+    free(done);
+    return connected;
+}
@@ -5,5 +5,6 @@
 
 int client_connect(char *ip, int port);
 int client_disconnect(int sock);
+int client_connectMany(char ips[][16], int num, int port, int socks[], int timeout);
 
 #endif // CLIENT_H
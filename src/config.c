@@ -0,0 +1,50 @@
+
+#include "config.h"
+
+void config_load(CONFIG *config) {
+    config->rateFrames = config_getInt("MESSENGER_RATE_FRAMES", MESSENGER_RATE_FRAMES);
+    config->burstFrames = config_getInt("MESSENGER_BURST_FRAMES", MESSENGER_BURST_FRAMES);
+    config->rateBytes = config_getInt("MESSENGER_RATE_BYTES", MESSENGER_RATE_BYTES);
+    config->burstBytes = config_getInt("MESSENGER_BURST_BYTES", MESSENGER_BURST_BYTES);
+    config->weightControl = config_getInt("MESSENGER_WEIGHT_CONTROL", MESSENGER_WEIGHT_CONTROL);
+    config->weightData = config_getInt("MESSENGER_WEIGHT_DATA", MESSENGER_WEIGHT_DATA);
+    config->udpEnabled = config_getInt("MESSENGER_UDP", MESSENGER_UDP);
+    config->shmEnabled = config_getInt("MESSENGER_SHM", MESSENGER_SHM);
+    config->inboxMessages = config_getInt("MESSENGER_INBOX_MESSAGES", MESSENGER_INBOX_MESSAGES);
+    config->inboxBytes = config_getInt("MESSENGER_INBOX_BYTES", MESSENGER_INBOX_BYTES);
+    config->trace = config_getInt("MESSENGER_TRACE", MESSENGER_TRACE);
+    config->traceSpans = config_getInt("MESSENGER_TRACE_SPANS", MESSENGER_TRACE_SPANS);
+    config->daemon = config_getInt("MESSENGER_DAEMON", MESSENGER_DAEMON);
+    config_getStr("MESSENGER_SOCKET", MESSENGER_SOCKET, config->socketPath, sizeof(config->socketPath));
+    config_getStr("MESSENGER_USERNAME", MESSENGER_USERNAME, config->username, sizeof(config->username));
+    config->filter = config_getInt("MESSENGER_FILTER", MESSENGER_FILTER);
+    config_getStr("MESSENGER_MUTE", MESSENGER_MUTE, config->mute, sizeof(config->mute));
+    config->lowLatency = config_getInt("MESSENGER_LOWLATENCY", MESSENGER_LOWLATENCY);
+    config->cpu = config_getInt("MESSENGER_CPU", MESSENGER_CPU);
+    config->eventLoop = config_getInt("MESSENGER_EVENTLOOP", MESSENGER_EVENTLOOP);
+    config_getStr("MESSENGER_CAPTURE", MESSENGER_CAPTURE, config->capture, sizeof(config->capture));
+}
+
+int config_getInt(char *name, int def) {
+    char *value = getenv(name);
+    if(value==NULL || value[0]=='\0')
+        return def;
+
+    // Ignore malformed values
+    char *end = NULL;
+    long retn = strtol(value, &end, 10);
+    if(*end!='\0' || retn<0)
+        return def;
+
+    return (int)retn;
+}
+
+void config_getStr(char *name, char *def, char dest[], int size) {
+    char *value = getenv(name);
+    if(value==NULL)
+        value = def;
+
+    // Truncate to size
+    strncpy(dest, value, size-1);
+    dest[size-1] = '\0';
+}
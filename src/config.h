@@ -0,0 +1,73 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "global.h"
+
+// Defaults, overridden by environment variables of the same name
+#define MESSENGER_RATE_FRAMES  200 // frames/s per peer (0 = unlimited)
+#define MESSENGER_BURST_FRAMES 400
+#define MESSENGER_RATE_BYTES   (256*1024) // bytes/s per peer (0 = unlimited)
+#define MESSENGER_BURST_BYTES  (512*1024)
+#define MESSENGER_WEIGHT_CONTROL 8 // control lane share per round
+#define MESSENGER_WEIGHT_DATA    1 // data lane share per round
+#define MESSENGER_UDP            0 // offer UDP transport to peers
+#define MESSENGER_SHM            1 // use shared memory with peers on the same host (over loopback)
+#define MESSENGER_INBOX_MESSAGES 1000 // unread messages kept in memory per contact (0 = unlimited)
+#define MESSENGER_INBOX_BYTES    (16*1024*1024) // unread bytes kept in memory in total, the largest inbox spills first (0 = unlimited)
+#define MESSENGER_TRACE          0 // record spans, dumped on SIGUSR1
+#define MESSENGER_TRACE_SPANS    1024 // newest spans kept per thread (24 bytes each)
+#define MESSENGER_DAEMON         0 // headless: commands on stdin and MESSENGER_SOCKET
+#define MESSENGER_SOCKET         "" // Unix socket path for daemon commands ("" = stdin only)
+#define MESSENGER_USERNAME       "" // username when not asked interactively
+#define MESSENGER_FILTER         1 // drop received messages that are not UTF-8 or hold control characters
+#define MESSENGER_MUTE           "" // comma separated keywords; received messages holding one are dropped
+#define MESSENGER_LOWLATENCY     0 // one I/O thread busy-polls every TCP peer (a whole core, always busy)
+#define MESSENGER_CPU            -1 // core the low-latency I/O thread is pinned to (-1 = not pinned)
+#define MESSENGER_EVENTLOOP      0 // one I/O thread sleeps in epoll for every TCP peer (no thread per peer)
+#define MESSENGER_CAPTURE        "" // file recording every frame sent and received, for bin/replay ("" = off)
+
+typedef struct {
+    // Per-peer receive rate limits
+    int rateFrames;
+    int burstFrames;
+    int rateBytes;
+    int burstBytes;
+
+    // Priority lane weights
+    int weightControl;
+    int weightData;
+
+    // Optional transports
+    int udpEnabled;
+    int shmEnabled;
+
+    // Unread messages beyond these limits go to disk
+    int inboxMessages;
+    int inboxBytes;
+
+    int trace;
+    int traceSpans;
+
+    // Headless mode
+    int daemon;
+    char socketPath[108];
+    char username[32];
+
+    // Receive-path filtering
+    int filter;
+    char mute[256];
+
+    // I/O thread: low-latency mode (spins), or event-loop mode (sleeps)
+    int lowLatency;
+    int cpu;
+    int eventLoop;
+
+    // Traffic capture
+    char capture[256];
+} CONFIG;
+
+void config_load(CONFIG *config);
+int config_getInt(char *name, int def);
+void config_getStr(char *name, char *def, char dest[], int size);
+
+#endif // CONFIG_H
@@ -1,24 +1,288 @@
 
 #include "connection.h"
+#include "trace.h"
+#include "timer.h"
+
+// In-memory inbox limits (0 = unlimited) and usage, over all connections
+static int inboxMaxMessages = 0; // per connection
+static long inboxMaxBytes = 0; // whole process
+static long inboxBytes = 0;
+
+// Inboxes with messages in memory, to spill the largest when over the process limit
+static CONNECTION *inboxList = NULL;
+static pthread_mutex_t inboxMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Connection pool: slabs are never returned, freed connections are reused first
+static CONNECTION *poolFree = NULL;
+static CONNECTION_POOL_STATS pool = { 0, 0 };
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+CONNECTION* connection_alloc(void) {
+    pthread_mutex_lock(&poolMutex);
+
+    // New slab, chained to the free list
+    if(poolFree==NULL) {
+        CONNECTION *slab = malloc(CONN_POOL_SLAB*sizeof(CONNECTION));
+        int i=0;
+        for(i=0; i<CONN_POOL_SLAB; i++)
+            slab[i].nextFree = (i+1<CONN_POOL_SLAB? &(slab[i+1]) : NULL);
+        poolFree = slab;
+        pool.slots += CONN_POOL_SLAB;
+    }
+
+    CONNECTION *conn = poolFree;
+    poolFree = conn->nextFree;
+    (pool.used)++;
+
+    pthread_mutex_unlock(&poolMutex);
+    return conn;
+}
+
+void connection_release(CONNECTION *conn) {
+    pthread_mutex_lock(&poolMutex);
+    conn->nextFree = poolFree;
+    poolFree = conn;
+    (pool.used)--;
+    pthread_mutex_unlock(&poolMutex);
+}
+
+void connection_poolStats(CONNECTION_POOL_STATS *stats) {
+    pthread_mutex_lock(&poolMutex);
+    *stats = pool;
+    pthread_mutex_unlock(&poolMutex);
+}
 
 CONNECTION* connection_new(int socket, char ip[16], char name[32]) {
-    CONNECTION *conn = malloc(sizeof(CONNECTION));
+    CONNECTION *conn = connection_alloc();
     conn->socket = socket;
     conn->numMessages = 0;
     conn->messages = NULL;
     conn->messagesTime = NULL;
+    conn->inboxBytes = 0;
+    conn->inboxPrev = conn->inboxNext = NULL;
+    spill_init(&(conn->spill));
     strcpy(conn->ip, ip);
     strcpy(conn->username, name);
 
+    // Unlimited until configured
+    tokenbucket_init(&(conn->frameBucket), 0, 0);
+    tokenbucket_init(&(conn->byteBucket), 0, 0);
+    stats_init(&(conn->stats));
+    conn->udpPeer = -1;
+    conn->syncPeer = 0;
+    conn->delivered = NULL;
+    conn->numDelivered = conn->maxDelivered = conn->numRestored = 0;
+    merkle_init(&(conn->syncTree));
+    conn->syncScanned = 0;
+    conn->captureId = -1;
+    shm_init(&(conn->shm));
+    conn->shmFullSince = 0;
+    conn->rxBuffer = NULL;
+    conn->rxSize = 0;
+    conn->rxSkip = 0;
+    conn->pausedUntil = 0;
+    conn->polled = 0;
+    conn->owner = NULL;
+    conn->nextFree = NULL;
+
+    // Outbound lanes
+    lanes_init(&(conn->outbox), 1, 1);
+    conn->flushing = 0;
+    pthread_mutex_init(&(conn->sendMutex), NULL);
+
+    pthread_mutex_init(&(conn->throttleMutex), NULL);
     pthread_mutex_init(&(conn->mutex), NULL);
     return conn;
 }
 
+void connection_destroy(CONNECTION *conn) {
+    // No longer a spill candidate (waits for a spill in progress)
+    if(conn->numMessages>0)
+        connection_inboxUnlink(conn);
+
+    // Free pending messages
+    int i=0;
+    for(i=0; i<conn->numMessages; i++) {
+        __sync_fetch_and_sub(&inboxBytes, strlen(conn->messages[i])+1);
+        free(conn->messages[i]);
+    }
+    free(conn->messages);
+    free(conn->messagesTime);
+    spill_destroy(&(conn->spill));
+    merkle_destroy(&(conn->syncTree));
+    free(conn->delivered);
+
+    // Drop unsent frames
+    lanes_destroy(&(conn->outbox));
+    shm_close(&(conn->shm));
+    free(conn->rxBuffer);
+    pthread_mutex_destroy(&(conn->sendMutex));
+
+    pthread_mutex_destroy(&(conn->throttleMutex));
+    pthread_mutex_destroy(&(conn->mutex));
+    connection_release(conn);
+}
+
+long connection_memory(CONNECTION *conn) {
+    // Bytes held for this peer: state, unread messages, unsent frames, partial frame and sync state
+    long bytes = sizeof(CONNECTION) + conn->rxSize + conn->syncTree.maxLeaves*sizeof(MERKLE_LEAF) + conn->maxDelivered*sizeof(uint64_t);
+
+    pthread_mutex_lock(&(conn->mutex));
+    bytes += conn->numMessages*(sizeof(char*)+sizeof(time_t));
+    int i=0;
+    for(i=0; i<conn->numMessages; i++)
+        bytes += strlen(conn->messages[i])+1;
+    pthread_mutex_unlock(&(conn->mutex));
+
+    pthread_mutex_lock(&(conn->sendMutex));
+    bytes += lanes_memory(&(conn->outbox));
+    pthread_mutex_unlock(&(conn->sendMutex));
+
+    // Mapped rings
+    if(conn->shm.rx!=NULL)
+        bytes += sizeof(SHM_RING);
+    if(conn->shm.tx!=NULL)
+        bytes += sizeof(SHM_RING);
+
+    return bytes;
+}
+
 void connection_setUsername(CONNECTION *conn, char *username) {
     strcpy(conn->username, username);
+
+    // Conversation is keyed by the name: rebuilt on the next sync
+    merkle_destroy(&(conn->syncTree));
+    conn->syncScanned = 0;
+}
+
+void connection_setRateLimit(CONNECTION *conn, int rateFrames, int burstFrames, int rateBytes, int burstBytes) {
+    pthread_mutex_lock(&(conn->throttleMutex));
+    tokenbucket_init(&(conn->frameBucket), rateFrames, burstFrames);
+    tokenbucket_init(&(conn->byteBucket), rateBytes, burstBytes);
+    pthread_mutex_unlock(&(conn->throttleMutex));
+}
+
+double connection_throttle(CONNECTION *conn, int size) {
+    // Charge one frame of 'size' bytes, return pause needed (ms). Any reader thread, with or without the messenger lock.
+    pthread_mutex_lock(&(conn->throttleMutex));
+    double waitFrames = tokenbucket_take(&(conn->frameBucket), 1);
+    double waitBytes = tokenbucket_take(&(conn->byteBucket), size);
+    pthread_mutex_unlock(&(conn->throttleMutex));
+    return (waitFrames > waitBytes? waitFrames : waitBytes);
+}
+
+int connection_compareHashes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x>y) - (x<y);
+}
+
+void connection_restoreDelivered(CONNECTION *conn, uint64_t *hashes, int num) {
+    // Delivered in earlier runs, looked up by connection_wasDelivered
+    free(conn->delivered);
+    conn->delivered = malloc((num>0? num : 1)*sizeof(uint64_t));
+    memcpy(conn->delivered, hashes, num*sizeof(uint64_t));
+    qsort(conn->delivered, num, sizeof(uint64_t), &connection_compareHashes);
+    conn->numDelivered = conn->maxDelivered = conn->numRestored = num;
+}
+
+void connection_addDelivered(CONNECTION *conn, uint64_t hash) {
+    // Grow list
+    if(conn->numDelivered==conn->maxDelivered) {
+        conn->maxDelivered = (conn->maxDelivered==0? 64 : conn->maxDelivered*2);
+        conn->delivered = realloc(conn->delivered, conn->maxDelivered*sizeof(uint64_t));
+    }
+    conn->delivered[(conn->numDelivered)++] = hash;
+}
+
+int connection_wasDelivered(CONNECTION *conn, uint64_t hash) {
+    // In an earlier run (this run's are found in history before anything is resent)
+    return (bsearch(&hash, conn->delivered, conn->numRestored, sizeof(uint64_t), &connection_compareHashes)!=NULL);
+}
+
+void connection_setLaneWeights(CONNECTION *conn, int controlWeight, int dataWeight) {
+    pthread_mutex_lock(&(conn->sendMutex));
+    conn->outbox.lanes[LANE_CONTROL].weight = (controlWeight>0? controlWeight : 1);
+    conn->outbox.lanes[LANE_DATA].weight = (dataWeight>0? dataWeight : 1);
+    pthread_mutex_unlock(&(conn->sendMutex));
+}
+
+void connection_queueFrame(CONNECTION *conn, int lane, char *frame, int size) {
+    pthread_mutex_lock(&(conn->sendMutex));
+    lanes_push(&(conn->outbox), lane, frame, size);
+    pthread_mutex_unlock(&(conn->sendMutex));
+}
+
+int connection_flush(CONNECTION *conn) {
+    pthread_mutex_lock(&(conn->sendMutex));
+
+    // Someone else is sending: it will pick our frames, in lane order
+    if(conn->flushing) {
+        pthread_mutex_unlock(&(conn->sendMutex));
+        return 0;
+    }
+    conn->flushing = 1;
+
+    int retn = 0;
+    uint64_t span = trace_begin();
+    LANE_FRAME *frame = NULL;
+    while((frame = lanes_pop(&(conn->outbox)))!=NULL) {
+        // Send without the lock, so other threads can queue meanwhile
+        pthread_mutex_unlock(&(conn->sendMutex));
+
+        // Shared memory once attached (in order: never back to the socket), else socket
+        int sent = 0;
+        if(conn->shm.tx!=NULL) {
+            if(shm_send(&(conn->shm), frame->data, frame->size)!=-1) {
+                sent = frame->size;
+                conn->shmFullSince = 0;
+            } else if(conn->shmFullSince==0 || timer_nowmsec() - conn->shmFullSince < SHM_SEND_TIMEOUT) {
+                // Ring full: the rest waits in the outbox, retried by the messenger (callers hold its lock)
+                if(conn->shmFullSince==0)
+                    conn->shmFullSince = timer_nowmsec();
+                pthread_mutex_lock(&(conn->sendMutex));
+                lanes_unpop(&(conn->outbox), frame);
+                break;
+            } else {
+                // Peer stopped reading: drop the connection, its reader cleans up
+                shutdown(conn->socket, SHUT_RDWR);
+                retn = -1;
+            }
+        }
+        while(retn!=-1 && sent < frame->size) {
+            int n = send(conn->socket, frame->data+sent, frame->size-sent, MSG_NOSIGNAL);
+            if(n==-1) {
+                retn = -1;
+                break;
+            }
+            sent += n;
+        }
+        free(frame);
+
+        pthread_mutex_lock(&(conn->sendMutex));
+    }
+
+    conn->flushing = 0;
+    pthread_mutex_unlock(&(conn->sendMutex));
+    trace_end("send", span);
+
+    return retn;
+}
+
+void connection_setInboxLimits(int maxMessages, long maxBytes) {
+    inboxMaxMessages = maxMessages;
+    inboxMaxBytes = maxBytes;
+}
+
+long connection_getInboxBytes(void) {
+    return __sync_fetch_and_add(&inboxBytes, 0);
 }
 
 void connection_pushMessage(CONNECTION *conn, char *msg) {
+    connection_pushMessageAt(conn, msg, time(NULL));
+}
+
+void connection_pushMessageAt(CONNECTION *conn, char *msg, time_t time) {
+    uint64_t span = trace_begin();
     pthread_mutex_lock(&(conn->mutex));
 
     const int newSize = conn->numMessages + 1;
@@ -32,31 +296,107 @@ void connection_pushMessage(CONNECTION *conn, char *msg) {
     conn->messages[pos] = calloc(strlen(msg)+1, sizeof(char));
     strcpy(conn->messages[pos], msg);
 
-    time_t currTime;
-    time(&currTime);
-    conn->messagesTime[pos] = currTime;
+    conn->messagesTime[pos] = time;
 
     // Inc counter
     (conn->numMessages)++;
+    conn->inboxBytes += strlen(msg)+1;
+    __sync_fetch_and_add(&inboxBytes, strlen(msg)+1);
+    if(conn->numMessages==1)
+        connection_inboxLink(conn);
+
+    // Over our limit: our oldest messages go to disk (on disk error, keep them)
+    while(inboxMaxMessages>0 && conn->numMessages>inboxMaxMessages) {
+        if(connection_spillOldest(conn)==-1)
+            break;
+    }
+
+    // Over the process limit: the largest inbox spills, whoever it is
+    while(inboxMaxBytes>0 && connection_getInboxBytes()>inboxMaxBytes) {
+        if(connection_spillLargest(conn)==-1)
+            break;
+    }
 
     pthread_mutex_unlock(&(conn->mutex));
+    trace_end("inbox push", span);
 }
 
-void connection_popMessage(CONNECTION *conn, char msg[], time_t *time) {
+int connection_popMessage(CONNECTION *conn, char msg[], int max, time_t *time) {
+    // Returns 1 if popped, -1 if none. Text is truncated to max-1.
     pthread_mutex_lock(&(conn->mutex));
 
+    // Oldest messages are on disk. A record that can't be read is lost with the rest of the segment:
+    // the next one can't be found without it.
+    if(conn->spill.numMessages>0) {
+        if(spill_pop(&(conn->spill), msg, max, time)!=-1) {
+            pthread_mutex_unlock(&(conn->mutex));
+            return 1;
+        }
+        spill_destroy(&(conn->spill));
+    }
+
     // Check if has messages
-    if(!connection_hasMessages(conn))
-        return;
+    if(conn->numMessages==0) {
+        pthread_mutex_unlock(&(conn->mutex));
+        return -1;
+    }
+
+    // Copy and free
+    strncpy(msg, conn->messages[0], max-1);
+    msg[max-1] = '\0';
+    *time = conn->messagesTime[0];
+    connection_dropOldest(conn);
+    if(conn->numMessages==0)
+        connection_inboxUnlink(conn);
 
+    pthread_mutex_unlock(&(conn->mutex));
+    return 1;
+}
+
+int connection_spillOldest(CONNECTION *conn) {
+    // Oldest in memory is newer than everything on disk: append keeps the order
+    if(spill_push(&(conn->spill), conn->messages[0], conn->messagesTime[0])==-1)
+        return -1;
+    connection_dropOldest(conn);
+    if(conn->numMessages==0)
+        connection_inboxUnlink(conn);
+    return 1;
+}
+
+int connection_spillLargest(CONNECTION *conn) {
+    // Called with conn locked, which is used when the largest is busy
+    pthread_mutex_lock(&inboxMutex);
+
+    CONNECTION *largest = conn, *c = NULL;
+    for(c=inboxList; c!=NULL; c=c->inboxNext)
+        if(c->inboxBytes > largest->inboxBytes)
+            largest = c;
+    if(largest!=conn && pthread_mutex_trylock(&(largest->mutex))!=0)
+        largest = conn;
+
+    // Oldest message of the largest inbox to disk (inboxMutex is held: unlink directly)
+    int retn = -1;
+    if(largest->numMessages>0 && (retn = spill_push(&(largest->spill), largest->messages[0], largest->messagesTime[0]))!=-1) {
+        connection_dropOldest(largest);
+        if(largest->numMessages==0)
+            connection_inboxRemove(largest);
+    }
+
+    if(largest!=conn)
+        pthread_mutex_unlock(&(largest->mutex));
+    pthread_mutex_unlock(&inboxMutex);
+
+    return retn;
+}
+
+void connection_dropOldest(CONNECTION *conn) {
     const int newSize = conn->numMessages - 1;
 
-    // Copy and free
-    strcpy(msg, conn->messages[0]);
+    // Free
+    conn->inboxBytes -= strlen(conn->messages[0])+1;
+    __sync_fetch_and_sub(&inboxBytes, strlen(conn->messages[0])+1);
     free(conn->messages[0]);
 
-    *time = conn->messagesTime[0];
-
     // Shift vector and realloc
     int i=0;
     for(i=0; i<conn->numMessages-1; i++) {
@@ -68,10 +408,38 @@ void connection_popMessage(CONNECTION *conn, char msg[], time_t *time) {
 
     // Dec counter
     (conn->numMessages)--;
-
-    pthread_mutex_unlock(&(conn->mutex));
 }
 
 int connection_hasMessages(CONNECTION *conn) {
-    return (conn->numMessages!=0);
+    return (connection_numMessages(conn)!=0);
+}
+
+int connection_numMessages(CONNECTION *conn) {
+    return conn->numMessages + conn->spill.numMessages;
+}
+
+void connection_inboxLink(CONNECTION *conn) {
+    pthread_mutex_lock(&inboxMutex);
+    conn->inboxPrev = NULL;
+    conn->inboxNext = inboxList;
+    if(inboxList!=NULL)
+        inboxList->inboxPrev = conn;
+    inboxList = conn;
+    pthread_mutex_unlock(&inboxMutex);
+}
+
+void connection_inboxUnlink(CONNECTION *conn) {
+    pthread_mutex_lock(&inboxMutex);
+    connection_inboxRemove(conn);
+    pthread_mutex_unlock(&inboxMutex);
+}
+
+void connection_inboxRemove(CONNECTION *conn) {
+    if(conn->inboxPrev!=NULL)
+        conn->inboxPrev->inboxNext = conn->inboxNext;
+    else
+        inboxList = conn->inboxNext;
+    if(conn->inboxNext!=NULL)
+        conn->inboxNext->inboxPrev = conn->inboxPrev;
+    conn->inboxPrev = conn->inboxNext = NULL;
 }
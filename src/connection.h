@@ -2,27 +2,109 @@
 #define CONNECTION_H
 
 #include "global.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "lane.h"
+#include "shm.h"
+#include "spill.h"
+#include "merkle.h"
 
-typedef struct {
-    pthread_t thread;
+#define CONN_POOL_SLAB 64 // connections per pool allocation
 
+// Fields by how often they are touched: a frame only pulls the first cache lines of an idle peer
+typedef struct CONNECTION {
+    // Hot: every frame in or out
     int socket; // socket
-    char ip[16]; // contact's IP address
-    char username[32]; // contact's username
+    int captureId; // connection id in the capture file (-1 = not captured)
+
+    // Receive rate limits
+    TOKEN_BUCKET frameBucket; // frames/s
+    TOKEN_BUCKET byteBucket; // bytes/s
+    pthread_mutex_t throttleMutex; // buckets are charged by the TCP, shm and UDP readers
+
+    STATS stats; // per-peer counters
 
-    int numMessages; // num of messages pending
+    // Read by the I/O thread: partial frame only, allocated while one is pending (NULL = none)
+    char *rxBuffer;
+    int rxSize;
+    int rxSkip; // bytes left of an oversized frame, dropped
+    double pausedUntil; // ms, over the rate limit: not read by the I/O thread until then (0 = read)
+
+    // Outbound frames by priority lane
+    LANES outbox;
+    int flushing; // a thread is sending the outbox
+    pthread_mutex_t sendMutex;
+
+    SHM_CHANNEL shm; // shared-memory rings, for peers on the same host
+    double shmFullSince; // ms, outbox waits for room in the peer's ring (0 = not full)
+    int udpPeer; // UDP transport peer id (-1 = TCP only)
+    int syncPeer; // peer stamps messages and reconciles history (offered "sync")
+    uint64_t *delivered; // hashes of their stamped messages delivered, kept in the snapshot (synced again = history only)
+    int numDelivered;
+    int maxDelivered;
+    int numRestored; // first ones, from the snapshot: sorted (this run's are in history, synced ones are never resent)
+    MERKLE_TREE syncTree; // our side of the conversation, kept up to date while the connection lasts
+    int syncScanned; // history entries already looked at for syncTree
+
+    // Warm: every chat message
+    pthread_mutex_t mutex; // mutex
+    int numMessages; // num of messages pending in memory
     char **messages; // pending messages
     time_t *messagesTime; // recv time
+    long inboxBytes; // size of messages pending in memory
+    struct CONNECTION *inboxPrev, *inboxNext; // list of every inbox with messages in memory
+    SPILL spill; // older pending messages, beyond the inbox limits
 
-    pthread_mutex_t mutex; // mutex
+    // Cold: setup, lookups and teardown
+    char ip[16]; // contact's IP address
+    char username[32]; // contact's username
+    pthread_t thread; // reader thread, unless polled
+    int polled; // read by the I/O thread instead of a thread of its own
+    void *owner; // MESSENGER it belongs to, when polled (a node's I/O thread serves all its tenants)
+    struct CONNECTION *nextFree; // pool free list
 } CONNECTION;
 
+// Pool usage, over all connections
+typedef struct {
+    int slots; // connections allocated
+    int used; // connections in use
+} CONNECTION_POOL_STATS;
+
 CONNECTION* connection_new(int socket, char ip[16], char name[32]);
+void connection_destroy(CONNECTION *conn);
+void connection_poolStats(CONNECTION_POOL_STATS *stats);
+long connection_memory(CONNECTION *conn);
 
 void connection_setUsername(CONNECTION *conn, char *username);
+void connection_setRateLimit(CONNECTION *conn, int rateFrames, int burstFrames, int rateBytes, int burstBytes);
+double connection_throttle(CONNECTION *conn, int size);
+
+void connection_restoreDelivered(CONNECTION *conn, uint64_t *hashes, int num);
+void connection_addDelivered(CONNECTION *conn, uint64_t hash);
+int connection_wasDelivered(CONNECTION *conn, uint64_t hash);
+
+void connection_setLaneWeights(CONNECTION *conn, int controlWeight, int dataWeight);
+void connection_queueFrame(CONNECTION *conn, int lane, char *frame, int size);
+int connection_flush(CONNECTION *conn);
+
+// Pool (internal)
+CONNECTION* connection_alloc(void);
+void connection_release(CONNECTION *conn);
+
+// Inbox limits, for every connection
+void connection_setInboxLimits(int maxMessages, long maxBytes);
+long connection_getInboxBytes(void);
 
 void connection_pushMessage(CONNECTION *conn, char *msg);
-void connection_popMessage(CONNECTION *conn, char msg[], time_t *time);
+void connection_pushMessageAt(CONNECTION *conn, char *msg, time_t time);
+int connection_popMessage(CONNECTION *conn, char msg[], int max, time_t *time);
 int connection_hasMessages(CONNECTION *conn);
+int connection_numMessages(CONNECTION *conn);
+int connection_spillOldest(CONNECTION *conn);
+int connection_spillLargest(CONNECTION *conn);
+void connection_dropOldest(CONNECTION *conn);
+void connection_inboxLink(CONNECTION *conn);
+void connection_inboxUnlink(CONNECTION *conn);
+void connection_inboxRemove(CONNECTION *conn);
 
 #endif // CONNECTION_H
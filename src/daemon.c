@@ -0,0 +1,615 @@
+
+#include "daemon.h"
+#include "index.h"
+#include "timer.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+void daemon_init(DAEMON *daemon, MESSENGER *messenger) {
+    daemon->messenger = messenger;
+    daemon->listener = -1;
+    daemon->socketPath[0] = '\0';
+    daemon->numClients = 0;
+    daemon->running = 0;
+
+    // Lets other threads interrupt poll
+    pipe(daemon->wakeup);
+    fcntl(daemon->wakeup[0], F_SETFL, fcntl(daemon->wakeup[0], F_GETFL) | O_NONBLOCK);
+    fcntl(daemon->wakeup[1], F_SETFL, fcntl(daemon->wakeup[1], F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_init(&(daemon->mutex), NULL);
+
+    // Inbound messages and contact changes
+    messenger_lock(messenger);
+    messenger->listener = (MESSENGER_LISTENER)&daemon_event;
+    messenger->listenerArg = daemon;
+    messenger_unlock(messenger);
+}
+
+void daemon_destroy(DAEMON *daemon) {
+    // No more events
+    messenger_lock(daemon->messenger);
+    daemon->messenger->listener = NULL;
+    daemon->messenger->listenerArg = NULL;
+    messenger_unlock(daemon->messenger);
+
+    while(daemon->numClients>0)
+        daemon_removeClient(daemon, 0);
+
+    if(daemon->listener!=-1) {
+        close(daemon->listener);
+        unlink(daemon->socketPath);
+    }
+
+    close(daemon->wakeup[0]);
+    close(daemon->wakeup[1]);
+    pthread_mutex_destroy(&(daemon->mutex));
+}
+
+int daemon_start(DAEMON *daemon, char *socketPath) {
+    // stdin only
+    if(socketPath==NULL || socketPath[0]=='\0')
+        return 1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path)-1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock==-1)
+        return -1;
+
+    // Stale socket from a previous run; only the owner may connect
+    unlink(addr.sun_path);
+    mode_t mask = umask(0077);
+    int retn = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if(retn==-1 || listen(sock, DAEMON_MAX_CLIENTS)==-1) {
+        close(sock);
+        return -1;
+    }
+
+    daemon->listener = sock;
+    strcpy(daemon->socketPath, addr.sun_path);
+    return 1;
+}
+
+void daemon_run(DAEMON *daemon) {
+    // Whatever the messenger printed goes before the replies
+    fflush(stdout);
+
+    daemon_addClient(daemon, 0, 1, 0);
+    daemon->running = 1;
+
+    while(daemon->running) {
+        // Wakeup pipe, listener, then input and output of every client
+        struct pollfd fds[2+2*DAEMON_MAX_CLIENTS];
+        fds[0].fd = daemon->wakeup[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = daemon->listener;
+        fds[1].events = POLLIN;
+
+        pthread_mutex_lock(&(daemon->mutex));
+        int numClients = daemon->numClients;
+        int i=0;
+        for(i=0; i<numClients; i++) {
+            DAEMON_CLIENT *client = daemon->clients[i];
+            fds[2+2*i].fd = client->fd;
+            fds[2+2*i].events = POLLIN;
+            fds[2+2*i+1].fd = (client->outSize>0? client->outFd : -1);
+            fds[2+2*i+1].events = POLLOUT;
+        }
+        pthread_mutex_unlock(&(daemon->mutex));
+
+        if(poll(fds, 2+2*numClients, -1)==-1) {
+            if(errno==EINTR)
+                continue;
+            break;
+        }
+
+        // Events were queued: output is polled again above
+        char junk[64];
+        while(read(daemon->wakeup[0], junk, sizeof(junk))>0);
+
+        // New client
+        if(fds[1].revents & POLLIN) {
+            int sock = accept(daemon->listener, NULL, NULL);
+            if(sock!=-1 && daemon_addClient(daemon, sock, sock, 1)==NULL)
+                close(sock);
+        }
+
+        // Clients (none added or removed by other threads)
+        int closed[DAEMON_MAX_CLIENTS];
+        for(i=0; i<numClients; i++) {
+            DAEMON_CLIENT *client = daemon->clients[i];
+            closed[i] = 0;
+
+            if(fds[2+2*i].revents & (POLLIN|POLLHUP|POLLERR)) {
+                if(daemon_read(daemon, client)==-1) {
+                    // stdout keeps streaming events; without a socket there is nobody else left
+                    if(client->isSocket) {
+                        closed[i] = 1;
+                    } else {
+                        client->fd = -1;
+                        if(daemon->listener==-1)
+                            daemon->running = 0;
+                    }
+                } else {
+                    daemon_parse(daemon, client);
+                }
+            }
+
+            if(fds[2+2*i+1].revents & (POLLOUT|POLLHUP|POLLERR))
+                if(daemon_write(daemon, client)==-1)
+                    closed[i] = 1;
+
+            // Not reading its output
+            if(client->outSize > DAEMON_OUT_MAX)
+                closed[i] = 1;
+        }
+        for(i=numClients-1; i>=0; i--)
+            if(closed[i])
+                daemon_removeClient(daemon, i);
+    }
+
+    // Last replies, then stop
+    int i=0;
+    for(i=0; i<daemon->numClients; i++) {
+        DAEMON_CLIENT *client = daemon->clients[i];
+        while(client->outSize>0) {
+            struct pollfd fd = { client->outFd, POLLOUT, 0 };
+            if(poll(&fd, 1, 1000)<=0 || daemon_write(daemon, client)==-1)
+                break;
+        }
+    }
+}
+
+int daemon_event(DAEMON *daemon, int event, CONNECTION *conn, char *text) {
+    // Called with the messenger lock
+    char prefix[128];
+    if(event==MESSENGER_EVENT_MSG)
+        sprintf(prefix, "event msg %s %s %ld ", conn->ip, conn->username, (long)time(NULL));
+    else if(event==MESSENGER_EVENT_CONNECTED)
+        sprintf(prefix, "event connected %s ", conn->ip);
+    else
+        sprintf(prefix, "event disconnected %s ", conn->ip);
+
+    int delivered = 0;
+    pthread_mutex_lock(&(daemon->mutex));
+    int i=0;
+    for(i=0; i<daemon->numClients; i++) {
+        DAEMON_CLIENT *client = daemon->clients[i];
+        if(!client->subscribed)
+            continue;
+        daemon_appendText(client, prefix, text);
+        delivered = 1;
+    }
+    pthread_mutex_unlock(&(daemon->mutex));
+
+    if(delivered)
+        write(daemon->wakeup[1], "", 1);
+
+    return delivered;
+}
+
+DAEMON_CLIENT* daemon_addClient(DAEMON *daemon, int fd, int outFd, int isSocket) {
+    if(daemon->numClients==DAEMON_MAX_CLIENTS)
+        return NULL;
+
+    DAEMON_CLIENT *client = malloc(sizeof(DAEMON_CLIENT));
+    client->fd = fd;
+    client->outFd = outFd;
+    client->isSocket = isSocket;
+    client->in = NULL;
+    client->inSize = 0;
+    client->frameLen = -1;
+    client->skipping = 0;
+    client->out = NULL;
+    client->outSize = 0;
+    client->subscribed = !isSocket;
+
+    pthread_mutex_lock(&(daemon->mutex));
+    daemon->clients[daemon->numClients] = client;
+    (daemon->numClients)++;
+    pthread_mutex_unlock(&(daemon->mutex));
+
+    return client;
+}
+
+void daemon_removeClient(DAEMON *daemon, int pos) {
+    pthread_mutex_lock(&(daemon->mutex));
+    DAEMON_CLIENT *client = daemon->clients[pos];
+
+    // Shift list
+    int i=0;
+    for(i=pos; i<daemon->numClients-1; i++)
+        daemon->clients[i] = daemon->clients[i+1];
+    (daemon->numClients)--;
+    pthread_mutex_unlock(&(daemon->mutex));
+
+    if(client->isSocket)
+        close(client->fd);
+    free(client->in);
+    free(client->out);
+    free(client);
+}
+
+int daemon_read(DAEMON *daemon, DAEMON_CLIENT *client) {
+    char buffer[DAEMON_CHUNK];
+    int n = read(client->fd, buffer, sizeof(buffer));
+    if(n==-1 && (errno==EINTR || errno==EAGAIN))
+        return 0;
+    if(n<=0)
+        return -1;
+
+    // Append (daemon_parse keeps it under DAEMON_IN_MAX + one chunk)
+    client->in = realloc(client->in, client->inSize+n+1);
+    memcpy(client->in+client->inSize, buffer, n);
+    client->inSize += n;
+    return n;
+}
+
+int daemon_write(DAEMON *daemon, DAEMON_CLIENT *client) {
+    // Other threads append: copy a chunk out, write it without the lock
+    char buffer[DAEMON_CHUNK];
+    pthread_mutex_lock(&(daemon->mutex));
+    int size = (client->outSize>DAEMON_CHUNK? DAEMON_CHUNK : client->outSize);
+    memcpy(buffer, client->out, size);
+    pthread_mutex_unlock(&(daemon->mutex));
+
+    int n = (client->isSocket? send(client->outFd, buffer, size, MSG_NOSIGNAL) : write(client->outFd, buffer, size));
+    if(n==-1)
+        return (errno==EINTR || errno==EAGAIN)? 0 : -1;
+
+    // Drop what was written
+    pthread_mutex_lock(&(daemon->mutex));
+    memmove(client->out, client->out+n, client->outSize-n);
+    client->outSize -= n;
+    pthread_mutex_unlock(&(daemon->mutex));
+
+    return n;
+}
+
+void daemon_parse(DAEMON *daemon, DAEMON_CLIENT *client) {
+    int pos = 0;
+
+    while(client->fd!=-1 && pos<client->inSize) {
+        char *start = client->in+pos;
+        int left = client->inSize-pos;
+
+        // Length-delimited: taken as is, newlines included
+        if(client->frameLen>=0) {
+            if(left < client->frameLen)
+                break;
+            char saved = start[client->frameLen];
+            start[client->frameLen] = '\0';
+            daemon_exec(daemon, client, start);
+            start[client->frameLen] = saved;
+            pos += client->frameLen;
+            client->frameLen = -1;
+            continue;
+        }
+
+        // Line
+        char *newline = memchr(start, '\n', left);
+        if(newline==NULL) {
+            if(left > DAEMON_IN_MAX) {
+                if(!client->skipping)
+                    daemon_reply(daemon, client, "error command too long\n");
+                client->skipping = 1;
+                pos = client->inSize;
+            }
+            break;
+        }
+        *newline = '\0';
+        if(newline>start && newline[-1]=='\r')
+            newline[-1] = '\0';
+        pos += newline-start+1;
+
+        // Tail of a line over the limit
+        if(client->skipping) {
+            client->skipping = 0;
+            continue;
+        }
+
+        // "@<len>": the next len bytes are one command
+        if(start[0]=='@') {
+            int len = atoi(start+1);
+            if(len<=0 || len>DAEMON_IN_MAX)
+                daemon_reply(daemon, client, "error invalid length\n");
+            else
+                client->frameLen = len;
+            continue;
+        }
+
+        if(start[0]!='\0')
+            daemon_exec(daemon, client, start);
+    }
+
+    // Keep what is left
+    memmove(client->in, client->in+pos, client->inSize-pos);
+    client->inSize -= pos;
+}
+
+void daemon_reply(DAEMON *daemon, DAEMON_CLIENT *client, const char *format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if(len>=(int)sizeof(line))
+        len = sizeof(line)-1;
+
+    pthread_mutex_lock(&(daemon->mutex));
+    client->out = realloc(client->out, client->outSize+len);
+    memcpy(client->out+client->outSize, line, len);
+    client->outSize += len;
+    pthread_mutex_unlock(&(daemon->mutex));
+}
+
+void daemon_replyText(DAEMON *daemon, DAEMON_CLIENT *client, char *prefix, char *text) {
+    pthread_mutex_lock(&(daemon->mutex));
+    daemon_appendText(client, prefix, text);
+    pthread_mutex_unlock(&(daemon->mutex));
+}
+
+void daemon_appendText(DAEMON_CLIENT *client, char *prefix, char *text) {
+    // One line: prefix, then text with '\' and newlines escaped
+    int prefixLen = strlen(prefix);
+    int textLen = strlen(text);
+
+    client->out = realloc(client->out, client->outSize+prefixLen+2*textLen+1);
+    char *dest = client->out+client->outSize;
+    memcpy(dest, prefix, prefixLen);
+    dest += prefixLen;
+    int i=0;
+    for(i=0; i<textLen; i++) {
+        if(text[i]=='\\' || text[i]=='\n' || text[i]=='\r') {
+            *(dest++) = '\\';
+            *(dest++) = (text[i]=='\\'? '\\' : (text[i]=='\n'? 'n' : 'r'));
+        } else {
+            *(dest++) = text[i];
+        }
+    }
+    *(dest++) = '\n';
+    client->outSize = dest-client->out;
+}
+
+void daemon_exec(DAEMON *daemon, DAEMON_CLIENT *client, char *cmd) {
+    MESSENGER *messenger = daemon->messenger;
+
+    // Command name, then arguments
+    char name[16] = "";
+    int n = 0;
+    sscanf(cmd, " %15s%n", name, &n);
+    char *args = cmd+n;
+    while(*args==' ')
+        args++;
+
+    if(strcmp(name, "ping")==0) {
+        daemon_reply(daemon, client, "ok pong\n");
+
+    } else if(strcmp(name, "quit")==0) {
+        daemon_reply(daemon, client, "ok bye\n");
+        daemon->running = 0;
+
+    } else if(strcmp(name, "subscribe")==0 || strcmp(name, "unsubscribe")==0) {
+        // Unsubscribed messages wait as unread, for drain
+        messenger_lock(messenger);
+        client->subscribed = (name[0]=='s');
+        messenger_unlock(messenger);
+        daemon_reply(daemon, client, "ok\n");
+
+    } else if(strcmp(name, "connect")==0) {
+        char addr[64];
+        if(sscanf(args, "%63s", addr)!=1) {
+            daemon_reply(daemon, client, "error usage: connect <ip|user@ip>\n");
+            return;
+        }
+
+        // Blocks this loop while dialing, the messenger keeps running
+        int retn = messenger_connect(messenger, addr, NULL);
+        if(retn==-1)
+            daemon_reply(daemon, client, "error %s\n", strerror(errno));
+        else
+            daemon_reply(daemon, client, retn==1? "ok connected %s\n" : "ok already connected %s\n", addr);
+
+    } else if(strcmp(name, "send")==0) {
+        char contact[64];
+        if(sscanf(args, "%63s%n", contact, &n)!=1 || args[n]!=' ' || args[n+1]=='\0') {
+            daemon_reply(daemon, client, "error usage: send <contact> <text>\n");
+            return;
+        }
+        char *text = args+n+1;
+        if(strlen(text)>MSG_MAX_SIZE) {
+            daemon_reply(daemon, client, "error message over %d bytes\n", MSG_MAX_SIZE);
+            return;
+        }
+
+        messenger_lock(messenger);
+        int pos = daemon_findContact(messenger, contact);
+        int retn = -1;
+        if(pos!=-1) {
+            retn = messenger_msg_send(messenger, messenger_conn_getConnByPos(messenger, pos), text);
+            messenger_msg_flush(messenger);
+        }
+        messenger_unlock(messenger);
+
+        if(pos==-1)
+            daemon_reply(daemon, client, "error no contact %s\n", contact);
+        else if(retn==-1)
+            daemon_reply(daemon, client, "error %s\n", strerror(errno));
+        else
+            daemon_reply(daemon, client, "ok\n");
+
+    } else if(strcmp(name, "group")==0) {
+        char contacts[256];
+        if(sscanf(args, "%255s%n", contacts, &n)!=1 || args[n]!=' ' || args[n+1]=='\0') {
+            daemon_reply(daemon, client, "error usage: group <c1,c2,...|*> <text>\n");
+            return;
+        }
+        char *text = args+n+1;
+        if(strlen(text)>MSG_MAX_SIZE) {
+            daemon_reply(daemon, client, "error message over %d bytes\n", MSG_MAX_SIZE);
+            return;
+        }
+
+        // Unknown contacts are skipped
+        messenger_lock(messenger);
+        int sent = 0;
+        if(strcmp(contacts, "*")==0) {
+            int i=0;
+            for(i=0; i<messenger->numConn; i++)
+                if(messenger_msg_send(messenger, messenger->conn[i], text)!=-1)
+                    sent++;
+        } else {
+            char *save = NULL;
+            char *contact = strtok_r(contacts, ",", &save);
+            while(contact!=NULL) {
+                int pos = daemon_findContact(messenger, contact);
+                if(pos!=-1 && messenger_msg_send(messenger, messenger->conn[pos], text)!=-1)
+                    sent++;
+                contact = strtok_r(NULL, ",", &save);
+            }
+        }
+        messenger_msg_flush(messenger);
+        messenger_unlock(messenger);
+
+        daemon_reply(daemon, client, "ok %d\n", sent);
+
+    } else if(strcmp(name, "drain")==0) {
+        char contact[64];
+        int only = -1;
+
+        messenger_lock(messenger);
+        if(sscanf(args, "%63s", contact)==1 && (only = daemon_findContact(messenger, contact))==-1) {
+            messenger_unlock(messenger);
+            daemon_reply(daemon, client, "error no contact %s\n", contact);
+            return;
+        }
+
+        // "msg <ip> <username> <time> <text>" per unread message
+        int count = 0;
+        int i=0;
+        for(i=0; i<messenger->numConn; i++) {
+            if(only!=-1 && i!=only)
+                continue;
+            CONNECTION *conn = messenger->conn[i];
+            while(connection_hasMessages(conn)) {
+                char msg[MSG_MAX_SIZE+1];
+                time_t time;
+                if(connection_popMessage(conn, msg, sizeof(msg), &time)==-1)
+                    break;
+
+                char prefix[128];
+                sprintf(prefix, "msg %s %s %ld ", conn->ip, conn->username, (long)time);
+                daemon_replyText(daemon, client, prefix, msg);
+                count++;
+            }
+        }
+        messenger_unlock(messenger);
+
+        daemon_reply(daemon, client, "ok %d\n", count);
+
+    } else if(strcmp(name, "list")==0) {
+        // "contact <pos> <ip> <username> <unread>" per contact
+        messenger_lock(messenger);
+        int i=0;
+        for(i=0; i<messenger->numConn; i++) {
+            CONNECTION *conn = messenger->conn[i];
+            daemon_reply(daemon, client, "contact %d %s %s %d\n", i+1, conn->ip, conn->username, connection_numMessages(conn));
+        }
+        int numConn = messenger->numConn;
+        messenger_unlock(messenger);
+
+        daemon_reply(daemon, client, "ok %d\n", numConn);
+
+    } else if(strcmp(name, "directory")==0) {
+        // "peer <user>@<ip> <online|offline> <version>" per identity heard of through gossip
+        messenger_lock(messenger);
+        GOSSIP *gossip = &(messenger->gossip);
+        const double now = timer_nowmsec();
+        int i=0;
+        for(i=0; i<gossip->numRecords; i++) {
+            GOSSIP_RECORD *record = &(gossip->records[i]);
+            daemon_reply(daemon, client, "peer %s@%s %s %u\n", record->username, record->ip, gossip_isOnline(record, now)? "online" : "offline", record->version);
+        }
+        int numRecords = gossip->numRecords;
+        messenger_unlock(messenger);
+
+        daemon_reply(daemon, client, "ok %d\n", numRecords);
+
+    } else if(strcmp(name, "delete")==0) {
+        char contact[64];
+        if(sscanf(args, "%63s", contact)!=1) {
+            daemon_reply(daemon, client, "error usage: delete <contact>\n");
+            return;
+        }
+
+        messenger_lock(messenger);
+        int pos = daemon_findContact(messenger, contact);
+        if(pos!=-1)
+            messenger_stopConn(messenger, pos);
+        messenger_unlock(messenger);
+
+        if(pos==-1)
+            daemon_reply(daemon, client, "error no contact %s\n", contact);
+        else
+            daemon_reply(daemon, client, "ok\n");
+
+    } else if(strcmp(name, "search")==0) {
+        if(args[0]=='\0') {
+            daemon_reply(daemon, client, "error usage: search <words>\n");
+            return;
+        }
+
+        // "result <time> <in|out> <ip> <username> <text>" per match, best first
+        messenger_lock(messenger);
+        INDEX_RESULT results[SEARCH_MAX_RESULTS];
+        int num = history_search(&(messenger->history), args, 0, time(NULL), results, SEARCH_MAX_RESULTS);
+        int i=0;
+        for(i=0; i<num; i++) {
+            HISTORY_ENTRY *entry = history_get(&(messenger->history), results[i].id);
+            char prefix[128];
+            sprintf(prefix, "result %ld %s %s %s ", (long)entry->time, entry->direction==HISTORY_OUT? "out" : "in", entry->ip, entry->username);
+            daemon_replyText(daemon, client, prefix, history_getText(&(messenger->history), results[i].id));
+        }
+        messenger_unlock(messenger);
+
+        daemon_reply(daemon, client, "ok %d\n", num);
+
+    } else if(strcmp(name, "stats")==0) {
+        messenger_lock(messenger);
+        STATS *stats = &(messenger->stats);
+        daemon_reply(daemon, client, "ok contacts %d history %d in %ld/%ld out %ld/%ld invalid %ld muted %ld synced %ld memory %ld\n", messenger->numConn, messenger->history.numEntries,
+                     stats->framesIn, stats->bytesIn, stats->framesOut, stats->bytesOut, stats->rejected, stats->muted, stats->synced, messenger_memory(messenger));
+        messenger_unlock(messenger);
+
+    } else {
+        daemon_reply(daemon, client, "error unknown command %s\n", name);
+    }
+}
+
+int daemon_findContact(MESSENGER *messenger, char *contact) {
+    // List position
+    char *end = NULL;
+    long pos = strtol(contact, &end, 10);
+    if(*end=='\0')
+        return (pos>=1 && pos<=messenger->numConn)? pos-1 : -1;
+
+    // IP address
+    if(strchr(contact, '.')!=NULL)
+        return messenger_conn_getConnPosByIP(messenger, contact);
+
+    // Username
+    int i=0;
+    for(i=0; i<messenger->numConn; i++)
+        if(strcmp(messenger->conn[i]->username, contact)==0)
+            return i;
+    return -1;
+}
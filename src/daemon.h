@@ -0,0 +1,77 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "global.h"
+#include "messenger.h"
+
+#define DAEMON_MAX_CLIENTS 16
+#define DAEMON_IN_MAX      (64*1024) // max command size
+#define DAEMON_OUT_MAX     (1024*1024) // pending output per client, then it is dropped
+#define DAEMON_CHUNK       4096 // bytes per write
+
+// Commands, one per line (or "@<len>" then len bytes):
+//   connect <ip|user@ip>          send <contact> <text>      group <c1,c2,...|*> <text>
+//   drain [contact]               list                       delete <contact>
+//   search <words>                stats                      subscribe | unsubscribe
+//   directory                     ping                       quit
+// <contact> is a list position, an IP address or a username.
+// Replies end with "ok [...]" or "error <reason>", events are "event <name> ...".
+// stdin is subscribed to events from the start, socket clients on "subscribe".
+typedef struct {
+    int fd; // -1 = closed
+    int outFd; // same as fd, except stdin (stdout)
+    int isSocket;
+
+    // Input not parsed yet
+    char *in;
+    int inSize;
+    int frameLen; // bytes of a "@<len>" command still expected (-1 = lines)
+    int skipping; // discarding the rest of a line over DAEMON_IN_MAX
+
+    // Output not written yet
+    char *out;
+    int outSize;
+
+    int subscribed;
+} DAEMON_CLIENT;
+
+typedef struct {
+    MESSENGER *messenger;
+
+    // Unix socket (-1 = stdin only)
+    int listener;
+    char socketPath[108];
+
+    int numClients;
+    DAEMON_CLIENT *clients[DAEMON_MAX_CLIENTS];
+
+    int wakeup[2]; // pipe, events queued from other threads
+    int running;
+
+    pthread_mutex_t mutex; // clients' output
+} DAEMON;
+
+// Daemon manipulation
+void daemon_init(DAEMON *daemon, MESSENGER *messenger);
+void daemon_destroy(DAEMON *daemon);
+int daemon_start(DAEMON *daemon, char *socketPath);
+void daemon_run(DAEMON *daemon);
+
+// Messenger listener
+int daemon_event(DAEMON *daemon, int event, CONNECTION *conn, char *text);
+
+// Clients
+DAEMON_CLIENT* daemon_addClient(DAEMON *daemon, int fd, int outFd, int isSocket);
+void daemon_removeClient(DAEMON *daemon, int pos);
+int daemon_read(DAEMON *daemon, DAEMON_CLIENT *client);
+int daemon_write(DAEMON *daemon, DAEMON_CLIENT *client);
+void daemon_parse(DAEMON *daemon, DAEMON_CLIENT *client);
+void daemon_reply(DAEMON *daemon, DAEMON_CLIENT *client, const char *format, ...);
+void daemon_replyText(DAEMON *daemon, DAEMON_CLIENT *client, char *prefix, char *text);
+void daemon_appendText(DAEMON_CLIENT *client, char *prefix, char *text); // with the lock
+
+// Commands
+void daemon_exec(DAEMON *daemon, DAEMON_CLIENT *client, char *cmd);
+int daemon_findContact(MESSENGER *messenger, char *contact);
+
+#endif // DAEMON_H
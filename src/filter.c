@@ -0,0 +1,495 @@
+
+#include "filter.h"
+
+#include <ctype.h>
+
+#ifdef FILTER_X86
+#include <immintrin.h>
+#define FILTER_TARGET_SSE2 __attribute__((target("sse2")))
+#define FILTER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// UTF-8 errors of a byte pair (previous byte, current byte), Keiser & Lemire lookup
+#define UTF8_TOO_SHORT      (1<<0) // lead byte not followed by continuation
+#define UTF8_TOO_LONG       (1<<1) // ASCII followed by continuation
+#define UTF8_OVERLONG_3     (1<<2) // E0 80..9F
+#define UTF8_TOO_LARGE      (1<<3) // F4 90..BF, F5..FF
+#define UTF8_SURROGATE      (1<<4) // ED A0..BF
+#define UTF8_OVERLONG_2     (1<<5) // C0, C1
+#define UTF8_TOO_LARGE_1000 (1<<6) // F5..FF 80..8F
+#define UTF8_OVERLONG_4     (1<<6) // F0 80..8F
+#define UTF8_TWO_CONTS      (1<<7) // continuation after continuation (fine in 3/4 byte sequences)
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// ASCII lower case, without the locale lookup of tolower
+#define FILTER_LOWER(c) (((c)>='A' && (c)<='Z')? (c)+0x20 : (c))
+
+void filter_init(FILTER *filter) {
+    memset(filter, 0, sizeof(FILTER));
+
+    // Best kernel the CPU runs
+    filter->kernel = FILTER_KERNEL_SCALAR;
+    filter_setKernel(filter, FILTER_KERNEL_AVX2);
+}
+
+int filter_setKernel(FILTER *filter, int kernel) {
+    // Falls back to the next one down if not supported
+#ifdef FILTER_X86
+    __builtin_cpu_init();
+    if(kernel==FILTER_KERNEL_AVX2 && !__builtin_cpu_supports("avx2"))
+        kernel = FILTER_KERNEL_SSE2;
+    if(kernel==FILTER_KERNEL_SSE2 && !__builtin_cpu_supports("sse2"))
+        kernel = FILTER_KERNEL_SCALAR;
+#else
+    kernel = FILTER_KERNEL_SCALAR;
+#endif
+    filter->kernel = kernel;
+    return kernel;
+}
+
+int filter_addKeyword(FILTER *filter, char *keyword) {
+    int len = strlen(keyword);
+    if(len==0 || len>=FILTER_KEYWORD_SIZE || filter->numKeywords==FILTER_MAX_KEYWORDS)
+        return -1;
+
+    const int k = filter->numKeywords;
+    int i=0;
+    for(i=0; i<len; i++)
+        filter->keywords[k][i] = tolower((unsigned char)keyword[i]);
+    filter->keywords[k][len] = '\0';
+    filter->lengths[k] = len;
+
+    // Round robin over buckets
+    const int bucket = k%FILTER_BUCKETS;
+    filter->buckets[bucket][filter->bucketSize[bucket]] = k;
+    (filter->bucketSize[bucket])++;
+
+    // Short keywords match any byte past their end
+    int j=0;
+    for(j=0; j<FILTER_PREFIX; j++) {
+        uint8_t c = filter->keywords[k][j] | 0x20;
+        memset(filter->prefix[k][j], (j<len? c : 0xFF), 16);
+
+        int n=0;
+        for(n=0; n<16; n++) {
+            if(j>=len || n==(c&0x0F)) {
+                filter->lo[j][n] |= 1 << bucket;
+                filter->lo[j][16+n] |= 1 << bucket; // vpshufb looks up each 128-bit lane on its own
+            }
+            if(j>=len || n==(c>>4)) {
+                filter->hi[j][n] |= 1 << bucket;
+                filter->hi[j][16+n] |= 1 << bucket;
+            }
+        }
+    }
+
+    (filter->numKeywords)++;
+    return k;
+}
+
+void filter_load(FILTER *filter, char *list) {
+    // Comma separated, surrounding spaces ignored
+    char *copy = strdup(list);
+    char *save = NULL;
+    char *keyword = strtok_r(copy, ",", &save);
+    while(keyword!=NULL) {
+        while(*keyword==' ')
+            keyword++;
+        int len = strlen(keyword);
+        while(len>0 && keyword[len-1]==' ')
+            keyword[--len] = '\0';
+        if(len>0 && filter_addKeyword(filter, keyword)==-1)
+            printf(">> Muted keyword '%s' ignored.\n", keyword);
+        keyword = strtok_r(NULL, ",", &save);
+    }
+    free(copy);
+}
+
+int filter_validate(FILTER *filter, char *data, int size) {
+    switch(filter->kernel) {
+#ifdef FILTER_X86
+        case FILTER_KERNEL_AVX2:
+            return filter_validate_avx2(data, size);
+        case FILTER_KERNEL_SSE2:
+            return filter_validate_sse2(data, size);
+#endif
+        default:
+            return filter_validate_scalar(data, size);
+    }
+}
+
+int filter_match(FILTER *filter, char *data, int size) {
+    if(filter->numKeywords==0)
+        return 0;
+
+    switch(filter->kernel) {
+#ifdef FILTER_X86
+        case FILTER_KERNEL_AVX2:
+            return filter_match_avx2(filter, data, size);
+        case FILTER_KERNEL_SSE2:
+            return filter_match_sse2(filter, data, size);
+#endif
+        default:
+            return filter_match_scalar(filter, data, size);
+    }
+}
+
+int filter_utf8Next(unsigned char *s, int size, int pos) {
+    // Position after the code point at pos, -1 if malformed or a control character
+    unsigned char c = s[pos];
+
+    // ASCII: C0 controls (but tab and newline), DEL
+    if(c<0x80) {
+        if((c<0x20 && c!='\t' && c!='\n') || c==0x7F)
+            return -1;
+        return pos+1;
+    }
+
+    // Continuation or overlong 2-byte lead
+    if(c<0xC2)
+        return -1;
+
+    int len = (c<0xE0? 2 : (c<0xF0? 3 : (c<0xF5? 4 : 0)));
+    if(len==0 || pos+len>size)
+        return -1;
+    int i=0;
+    for(i=1; i<len; i++)
+        if((s[pos+i]&0xC0)!=0x80)
+            return -1;
+
+    // C1 controls, overlongs, surrogates, above U+10FFFF
+    unsigned char c1 = s[pos+1];
+    if((c==0xC2 && c1<0xA0) || (c==0xE0 && c1<0xA0) || (c==0xED && c1>=0xA0) || (c==0xF0 && c1<0x90) || (c==0xF4 && c1>=0x90))
+        return -1;
+
+    return pos+len;
+}
+
+int filter_validate_scalar(char *data, int size) {
+    unsigned char *s = (unsigned char*)data;
+    int pos = 0;
+    while(pos<size) {
+        pos = filter_utf8Next(s, size, pos);
+        if(pos==-1)
+            return 0;
+    }
+    return 1;
+}
+
+int filter_matchAt(FILTER *filter, unsigned char *s, int size, int pos, int buckets) {
+    // Keywords of the given buckets starting at pos
+    while(buckets) {
+        const int bucket = __builtin_ctz(buckets);
+        buckets &= buckets-1;
+
+        int b=0;
+        for(b=0; b<filter->bucketSize[bucket]; b++) {
+            const int k = filter->buckets[bucket][b];
+            const int len = filter->lengths[k];
+            if(pos+len>size)
+                continue;
+            int i=0;
+            while(i<len && FILTER_LOWER(s[pos+i])==(unsigned char)filter->keywords[k][i])
+                i++;
+            if(i==len)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+int filter_match_scalar(FILTER *filter, char *data, int size) {
+    unsigned char *s = (unsigned char*)data;
+    int pos=0;
+    for(pos=0; pos<size; pos++)
+        if(filter_matchAt(filter, s, size, pos, 0xFF))
+            return 1;
+    return 0;
+}
+
+#ifdef FILTER_X86
+
+FILTER_TARGET_SSE2 int filter_validate_sse2(char *data, int size) {
+    unsigned char *s = (unsigned char*)data;
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i del = _mm_set1_epi8(0x7F);
+
+    int pos = 0;
+    while(pos+16<=size) {
+        __m128i x = _mm_loadu_si128((__m128i*)(s+pos));
+
+        // Signed compare: below 0x20, or 0x80 and up
+        __m128i slow = _mm_cmplt_epi8(x, space);
+        slow = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(x, tab), _mm_cmpeq_epi8(x, newline)), slow);
+        slow = _mm_or_si128(slow, _mm_cmpeq_epi8(x, del));
+
+        // Printable ASCII
+        if(_mm_movemask_epi8(slow)==0) {
+            pos += 16;
+            continue;
+        }
+
+        // Otherwise code point by code point, to the end of the block
+        const int end = pos+16;
+        while(pos<end) {
+            pos = filter_utf8Next(s, size, pos);
+            if(pos==-1)
+                return 0;
+        }
+    }
+
+    while(pos<size) {
+        pos = filter_utf8Next(s, size, pos);
+        if(pos==-1)
+            return 0;
+    }
+    return 1;
+}
+
+FILTER_TARGET_SSE2 int filter_match_sse2(FILTER *filter, char *data, int size) {
+    const __m128i fold = _mm_set1_epi8(0x20);
+    unsigned char tail[16+FILTER_PREFIX];
+
+    // Candidates: leading bytes of any keyword (FILTER_PREFIX compares each per block)
+    int pos = 0;
+    while(pos<size) {
+        // Last block zero padded, candidates past the end masked out
+        unsigned char *block = (unsigned char*)data+pos;
+        int valid = 0xFFFF;
+        if(pos+16+FILTER_PREFIX-1>size) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, block, size-pos);
+            block = tail;
+            valid = (1 << (size-pos)) - 1;
+        }
+
+        __m128i x[FILTER_PREFIX];
+        int j=0;
+        for(j=0; j<FILTER_PREFIX; j++)
+            x[j] = _mm_or_si128(_mm_loadu_si128((__m128i*)(block+j)), fold);
+
+        __m128i candidates = _mm_setzero_si128();
+        int k=0;
+        for(k=0; k<filter->numKeywords; k++) {
+            __m128i eq = _mm_cmpeq_epi8(x[0], _mm_loadu_si128((__m128i*)filter->prefix[k][0]));
+            for(j=1; j<FILTER_PREFIX && j<filter->lengths[k]; j++)
+                eq = _mm_and_si128(eq, _mm_cmpeq_epi8(x[j], _mm_loadu_si128((__m128i*)filter->prefix[k][j])));
+            candidates = _mm_or_si128(candidates, eq);
+        }
+
+        // Verify
+        int mask = _mm_movemask_epi8(candidates) & valid;
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+            if(filter_matchAt(filter, (unsigned char*)data, size, pos+bit, 0xFF))
+                return 1;
+            mask &= mask-1;
+        }
+        pos += 16;
+    }
+    return 0;
+}
+
+FILTER_TARGET_AVX2 int filter_validate_avx2(char *data, int size) {
+    // Keiser & Lemire: every error is visible in the (byte-1, byte) pair, except
+    // the length of 3 and 4 byte sequences, checked from bytes 2 and 3 back
+    const __m256i byte1High = _mm256_setr_epi8(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m256i byte1Low = _mm256_setr_epi8(
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY, UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY, UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m256i byte2High = _mm256_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+
+    // Block ends in the middle of a sequence: lead byte in the last 1, 2 or 3 positions
+    const __m256i maxValue = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xF0-1, 0xE0-1, 0xC0-1);
+
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i c0Max = _mm256_set1_epi8(0x1F);
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i c1Lead = _mm256_set1_epi8(0xC2);
+    const __m256i c1Mask = _mm256_set1_epi8(0xE0);
+    const __m256i c1Cont = _mm256_set1_epi8(0x80);
+
+    __m256i prevInput = _mm256_setzero_si256();
+    __m256i prevIncomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+
+    char tail[32];
+    int pos=0;
+    while(pos<size) {
+        // Last block padded with spaces (valid and printable)
+        __m256i input;
+        if(pos+32<=size) {
+            input = _mm256_loadu_si256((__m256i*)(data+pos));
+        } else {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, data+pos, size-pos);
+            input = _mm256_loadu_si256((__m256i*)tail);
+        }
+        pos += 32;
+
+        // Printable ASCII (signed compare: below 0x20, or 0x80 and up): only a sequence left open can be wrong
+        __m256i slow = _mm256_cmpgt_epi8(space, input);
+        slow = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(input, tab), _mm256_cmpeq_epi8(input, newline)), slow);
+        slow = _mm256_or_si256(slow, _mm256_cmpeq_epi8(input, del));
+        if(_mm256_testz_si256(slow, slow)) {
+            error = _mm256_or_si256(error, prevIncomplete);
+            prevIncomplete = _mm256_setzero_si256();
+            prevInput = input;
+            continue;
+        }
+
+        // Input shifted by 1 byte, carrying the end of the previous block
+        __m256i prevLanes = _mm256_permute2x128_si256(prevInput, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, prevLanes, 15);
+
+        // Control characters: C0 but tab and newline, DEL, C1 (C2 80..9F)
+        __m256i c0 = _mm256_cmpeq_epi8(_mm256_min_epu8(input, c0Max), input);
+        c0 = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(input, tab), _mm256_cmpeq_epi8(input, newline)), c0);
+        __m256i c1 = _mm256_and_si256(_mm256_cmpeq_epi8(prev1, c1Lead), _mm256_cmpeq_epi8(_mm256_and_si256(input, c1Mask), c1Cont));
+        error = _mm256_or_si256(error, _mm256_or_si256(c0, _mm256_or_si256(c1, _mm256_cmpeq_epi8(input, del))));
+
+        if(_mm256_movemask_epi8(input)==0) {
+            // ASCII, with control characters
+            error = _mm256_or_si256(error, prevIncomplete);
+            prevIncomplete = _mm256_setzero_si256();
+        } else {
+            __m256i prev2 = _mm256_alignr_epi8(input, prevLanes, 14);
+            __m256i prev3 = _mm256_alignr_epi8(input, prevLanes, 13);
+
+            __m256i special = _mm256_shuffle_epi8(byte1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+            special = _mm256_and_si256(special, _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, nibble)));
+            special = _mm256_and_si256(special, _mm256_shuffle_epi8(byte2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+            // Continuations required by a 3 or 4 byte lead cancel TWO_CONTS, anything else left is an error
+            __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0-0x80));
+            __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0-0x80));
+            __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), c1Cont);
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+
+            prevIncomplete = _mm256_subs_epu8(input, maxValue);
+        }
+        prevInput = input;
+    }
+
+    error = _mm256_or_si256(error, prevIncomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+FILTER_TARGET_AVX2 int filter_match_avx2(FILTER *filter, char *data, int size) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    unsigned char tail[32+FILTER_PREFIX];
+
+    __m256i lo[FILTER_PREFIX], hi[FILTER_PREFIX];
+    int j=0;
+    for(j=0; j<FILTER_PREFIX; j++) {
+        lo[j] = _mm256_loadu_si256((__m256i*)filter->lo[j]);
+        hi[j] = _mm256_loadu_si256((__m256i*)filter->hi[j]);
+    }
+
+    // Teddy: nibble lookups give the buckets whose keywords may start here, whatever their number
+    int pos = 0;
+    while(pos<size) {
+        // Last block zero padded, candidates past the end masked out
+        unsigned char *block = (unsigned char*)data+pos;
+        unsigned int valid = 0xFFFFFFFF;
+        if(pos+32+FILTER_PREFIX-1>size) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, block, size-pos);
+            block = tail;
+            valid = (size-pos<32? (1u << (size-pos)) - 1 : 0xFFFFFFFF);
+        }
+
+        __m256i buckets = _mm256_set1_epi8(-1);
+        for(j=0; j<FILTER_PREFIX; j++) {
+            __m256i x = _mm256_or_si256(_mm256_loadu_si256((__m256i*)(block+j)), fold);
+            __m256i m = _mm256_and_si256(_mm256_shuffle_epi8(lo[j], _mm256_and_si256(x, nibble)),
+                                         _mm256_shuffle_epi8(hi[j], _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+            buckets = _mm256_and_si256(buckets, m);
+        }
+
+        // Verify the keywords of each candidate's buckets
+        unsigned int mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(buckets, zero)) & valid;
+        if(mask) {
+            uint8_t bucketBytes[32];
+            _mm256_storeu_si256((__m256i*)bucketBytes, buckets);
+            while(mask) {
+                int bit = __builtin_ctz(mask);
+                if(filter_matchAt(filter, (unsigned char*)data, size, pos+bit, bucketBytes[bit]))
+                    return 1;
+                mask &= mask-1;
+            }
+        }
+        pos += 32;
+    }
+    return 0;
+}
+
+#else
+
+// Scalar only
+int filter_validate_sse2(char *data, int size) {
+    return filter_validate_scalar(data, size);
+}
+
+int filter_validate_avx2(char *data, int size) {
+    return filter_validate_scalar(data, size);
+}
+
+int filter_match_sse2(FILTER *filter, char *data, int size) {
+    return filter_match_scalar(filter, data, size);
+}
+
+int filter_match_avx2(FILTER *filter, char *data, int size) {
+    return filter_match_scalar(filter, data, size);
+}
+
+#endif
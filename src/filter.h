@@ -0,0 +1,65 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "global.h"
+
+#include <stdint.h>
+
+#define FILTER_MAX_KEYWORDS 64
+#define FILTER_KEYWORD_SIZE 32
+#define FILTER_BUCKETS      8 // keyword groups of the AVX2 prefilter
+#define FILTER_PREFIX       3 // leading keyword bytes compared by the SIMD prefilters
+
+#define FILTER_KERNEL_SCALAR 0
+#define FILTER_KERNEL_SSE2   1
+#define FILTER_KERNEL_AVX2   2
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FILTER_X86
+#endif
+
+// Receive-path checks: well-formed UTF-8 without control characters, and muted keywords
+typedef struct {
+    int kernel; // best supported by the CPU, unless set
+
+    // Muted keywords, ASCII lower case (matched case-insensitively)
+    int numKeywords;
+    char keywords[FILTER_MAX_KEYWORDS][FILTER_KEYWORD_SIZE];
+    int lengths[FILTER_MAX_KEYWORDS];
+
+    // Keywords by bucket, to verify candidates
+    int bucketSize[FILTER_BUCKETS];
+    uint8_t buckets[FILTER_BUCKETS][FILTER_MAX_KEYWORDS/FILTER_BUCKETS];
+
+    // Prefilters compare bytes OR 0x20 (folds case, and a few symbols too: verified anyway)
+    // SSE2: leading bytes of each keyword, 16 times (0xFF past the end matches anything)
+    uint8_t prefix[FILTER_MAX_KEYWORDS][FILTER_PREFIX][16];
+
+    // AVX2: bucket bits by low/high nibble of the leading bytes (16 entries, twice)
+    uint8_t lo[FILTER_PREFIX][32];
+    uint8_t hi[FILTER_PREFIX][32];
+} FILTER;
+
+// Filter manipulation
+void filter_init(FILTER *filter);
+int filter_setKernel(FILTER *filter, int kernel);
+int filter_addKeyword(FILTER *filter, char *keyword);
+void filter_load(FILTER *filter, char *list);
+
+// Checks, with the selected kernel
+int filter_validate(FILTER *filter, char *data, int size);
+int filter_match(FILTER *filter, char *data, int size);
+
+// Kernels
+int filter_validate_scalar(char *data, int size);
+int filter_validate_sse2(char *data, int size);
+int filter_validate_avx2(char *data, int size);
+int filter_match_scalar(FILTER *filter, char *data, int size);
+int filter_match_sse2(FILTER *filter, char *data, int size);
+int filter_match_avx2(FILTER *filter, char *data, int size);
+
+// Internal
+int filter_utf8Next(unsigned char *s, int size, int pos);
+int filter_matchAt(FILTER *filter, unsigned char *s, int size, int pos, int buckets);
+
+#endif // FILTER_H
@@ -7,3 +7,12 @@ void socket2ip(int socket, char retn[17]) {
 
     inet_ntop(AF_INET, &(client.sin_addr), retn, 17);
 }
+
+void socket2localIp(int socket, char retn[17]) {
+    // Our address, as the peer sees it
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    getsockname(socket, (struct sockaddr*)&local, &len);
+
+    inet_ntop(AF_INET, &(local.sin_addr), retn, 17);
+}
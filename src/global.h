@@ -13,5 +13,6 @@
 #include <arpa/inet.h>
 
 void socket2ip(int socket, char retn[17]);
+void socket2localIp(int socket, char retn[17]);
 
 #endif // GLOBAL_H
@@ -0,0 +1,283 @@
+
+#include "gossip.h"
+
+#include <stdarg.h>
+#include <time.h>
+
+#define GOSSIP_LINE_SIZE 128
+
+void gossip_init(GOSSIP *gossip) {
+    gossip->username[0] = '\0';
+
+    // Starts at the clock, so a restarted identity outranks its old records
+    gossip->version = (uint32_t)time(NULL);
+    gossip->online = 1;
+
+    gossip->numRecords = 0;
+    gossip->records = NULL;
+
+    gossip->round = 0;
+    gossip->cursor = 0;
+    gossip->markEpoch = 0;
+    gossip->lastRound = 0;
+    gossip->seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+
+    gossip->updates = 0;
+}
+
+void gossip_destroy(GOSSIP *gossip) {
+    free(gossip->records);
+    gossip->records = NULL;
+    gossip->numRecords = 0;
+}
+
+void gossip_setUsername(GOSSIP *gossip, char *username) {
+    strncpy(gossip->username, username, 31);
+    gossip->username[31] = '\0';
+}
+
+int gossip_tick(GOSSIP *gossip, double now) {
+    // Returns 1 when a round is due
+    if(now - gossip->lastRound < GOSSIP_INTERVAL)
+        return 0;
+    gossip->lastRound = now;
+    (gossip->round)++;
+
+    // Heartbeat: peers take us for gone once it stops growing
+    if(gossip->round%GOSSIP_HEARTBEAT==0)
+        (gossip->version)++;
+
+    return 1;
+}
+
+void gossip_leave(GOSSIP *gossip) {
+    // Goodbye, outranks every heartbeat sent so far
+    gossip->online = 0;
+    (gossip->version)++;
+}
+
+int gossip_random(GOSSIP *gossip, int n) {
+    // xorshift32, in [0, n)
+    uint32_t x = gossip->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gossip->seed = (x!=0? x : 1);
+    return (n>0? (int)(x%(uint32_t)n) : 0);
+}
+
+int gossip_syn(GOSSIP *gossip, char dest[], int max) {
+    int size = gossip_append(dest, 0, max, "syn\nself %u %d\n", gossip->version, gossip->online);
+    return gossip_appendEntries(gossip, dest, size, max, 0);
+}
+
+int gossip_handle(GOSSIP *gossip, char *username, char *ip, char *myIp, char *data, char reply[], int max, double now) {
+    // Returns the reply size (0 = none)
+    char line[GOSSIP_LINE_SIZE], key[64], user[32], addr[16];
+    unsigned int version = 0;
+    int online = 0;
+
+    // Kind
+    char *next = strchr(data, '\n');
+    if(next==NULL)
+        return 0;
+    int kind = 0;
+    if(next-data==3 && strncmp(data, "syn", 3)==0)
+        kind = 1;
+    else if(next-data==3 && strncmp(data, "ack", 3)==0)
+        kind = 2;
+    else if(next-data==4 && strncmp(data, "ack2", 4)==0)
+        kind = 3;
+    else
+        return 0;
+    char *body = next+1;
+
+    int size = 0;
+    if(kind==1)
+        size = gossip_append(reply, size, max, "ack\nself %u %d\n", gossip->version, gossip->online);
+    else if(kind==2)
+        size = gossip_append(reply, size, max, "ack2\n");
+    const int header = size;
+
+    // Records, and the newer ones for the digest (all of them, whatever fits)
+    const int epoch = ++(gossip->markEpoch);
+    int pass=0;
+    for(pass=0; pass<2; pass++) {
+        char *p = body;
+        while(*p!='\0') {
+            // One line, cut to GOSSIP_LINE_SIZE
+            next = strchr(p, '\n');
+            int len = (next!=NULL? next-p : strlen(p));
+            int copy = (len<GOSSIP_LINE_SIZE-1? len : GOSSIP_LINE_SIZE-1);
+            memcpy(line, p, copy);
+            line[copy] = '\0';
+            p += len + (next!=NULL);
+
+            // Sender's own record: it is the contact at the other end
+            if(sscanf(line, "self %u %d", &version, &online)==2) {
+                if(pass==0)
+                    gossip_update(gossip, username, ip, version, online, now);
+
+            } else if(sscanf(line, "r %63s %u %d", key, &version, &online)==3) {
+                if(pass!=0 || gossip_parseKey(key, user, addr)==-1)
+                    continue;
+                if(strcmp(user, gossip->username)==0 && strcmp(addr, myIp)==0) {
+                    // Ours, from a previous run: outrank it
+                    gossip_outrank(gossip, version);
+                } else {
+                    gossip_update(gossip, user, addr, version, online, now);
+                }
+
+            } else if(sscanf(line, "d %63s %u", key, &version)==2) {
+                if(kind!=1 || gossip_parseKey(key, user, addr)==-1)
+                    continue;
+                if(strcmp(user, gossip->username)==0 && strcmp(addr, myIp)==0) {
+                    if(pass==0)
+                        gossip_outrank(gossip, version);
+                    continue;
+                }
+                GOSSIP_RECORD *record = gossip_find(gossip, user, addr);
+                if(pass==0 && record!=NULL) {
+                    record->mark = epoch;
+                    if(record->version>version)
+                        size = gossip_append(reply, size, max, "r %s@%s %u %d\n", record->username, record->ip, record->version, record->online);
+                } else if(pass==1 && (record==NULL || record->version<version)) {
+                    size = gossip_append(reply, size, max, "w %s\n", key);
+                }
+
+            } else if(sscanf(line, "w %63s", key)==1) {
+                if(pass!=0 || kind!=2 || gossip_parseKey(key, user, addr)==-1)
+                    continue;
+                GOSSIP_RECORD *record = gossip_find(gossip, user, addr);
+                if(record!=NULL)
+                    size = gossip_append(reply, size, max, "r %s@%s %u %d\n", record->username, record->ip, record->version, record->online);
+            }
+        }
+    }
+
+    // Records the sender's digest did not name: it may not know them at all
+    if(kind==1)
+        size = gossip_appendEntries(gossip, reply, size, max, 1);
+
+    if(kind==3 || (kind==2 && size==header))
+        return 0;
+    return size;
+}
+
+int gossip_update(GOSSIP *gossip, char *username, char *ip, uint32_t version, int online, double now) {
+    // Returns 1 if it was news (versions from the future are forged: they would outrank every later one)
+    if(!gossip_versionValid(version))
+        return 0;
+    GOSSIP_RECORD *record = gossip_find(gossip, username, ip);
+    if(record!=NULL && version<=record->version)
+        return 0;
+
+    if(record==NULL) {
+        if(gossip->numRecords>=GOSSIP_MAX_RECORDS)
+            gossip_evict(gossip);
+
+        // Realloc list
+        gossip->records = realloc(gossip->records, (gossip->numRecords+1)*sizeof(GOSSIP_RECORD));
+
+        // Add element
+        record = &(gossip->records[gossip->numRecords]);
+        strncpy(record->username, username, 31);
+        record->username[31] = '\0';
+        strncpy(record->ip, ip, 15);
+        record->ip[15] = '\0';
+        record->mark = 0;
+
+        // Inc counter
+        (gossip->numRecords)++;
+    }
+
+    record->version = version;
+    record->online = online;
+    record->seenAt = now;
+    record->changedRound = gossip->round;
+    (gossip->updates)++;
+
+    return 1;
+}
+
+GOSSIP_RECORD* gossip_find(GOSSIP *gossip, char *username, char *ip) {
+    int i=0;
+    for(i=0; i<gossip->numRecords; i++)
+        if(strcmp(gossip->records[i].ip, ip)==0 && strcmp(gossip->records[i].username, username)==0)
+            return &(gossip->records[i]);
+    return NULL;
+}
+
+int gossip_isOnline(GOSSIP_RECORD *record, double now) {
+    return record->online && now - record->seenAt < GOSSIP_TIMEOUT;
+}
+
+int gossip_parseKey(char *key, char username[32], char ip[16]) {
+    // username@ip, as messenger_connect takes it
+    char *at = strrchr(key, '@');
+    if(at==NULL || at==key || at-key>31 || strlen(at+1)>15 || strlen(at+1)==0)
+        return -1;
+    memcpy(username, key, at-key);
+    username[at-key] = '\0';
+    strcpy(ip, at+1);
+    return 1;
+}
+
+int gossip_append(char dest[], int size, int max, const char *format, ...) {
+    // New size, unchanged if the line does not fit
+    char line[GOSSIP_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if(len<0 || len>=GOSSIP_LINE_SIZE || size+len>max)
+        return size;
+    memcpy(dest+size, line, len);
+    return size+len;
+}
+
+int gossip_appendEntries(GOSSIP *gossip, char dest[], int size, int max, int records) {
+    // Digest lines (or whole records not marked), recently changed first, then the rotating window
+    const int epoch = gossip->markEpoch;
+    int pass=0, i=0;
+    for(pass=0; pass<2; pass++) {
+        for(i=0; i<gossip->numRecords; i++) {
+            int pos = (pass==0? i : (gossip->cursor+i)%gossip->numRecords);
+            GOSSIP_RECORD *record = &(gossip->records[pos]);
+            int hot = (gossip->round - record->changedRound < GOSSIP_HOT);
+            if(hot!=(pass==0) || (records && record->mark==epoch))
+                continue;
+
+            int newSize = (records? gossip_append(dest, size, max, "r %s@%s %u %d\n", record->username, record->ip, record->version, record->online)
+                                  : gossip_append(dest, size, max, "d %s@%s %u\n", record->username, record->ip, record->version));
+            if(newSize==size)
+                return size; // full
+            size = newSize;
+            if(pass==1)
+                gossip->cursor = (pos+1)%gossip->numRecords;
+        }
+    }
+    return size;
+}
+
+void gossip_evict(GOSSIP *gossip) {
+    // Unchanged for longest, replaced by the last one
+    int oldest = 0, i=0;
+    for(i=1; i<gossip->numRecords; i++)
+        if(gossip->records[i].seenAt < gossip->records[oldest].seenAt)
+            oldest = i;
+    gossip->records[oldest] = gossip->records[gossip->numRecords-1];
+    (gossip->numRecords)--;
+}
+
+int gossip_versionValid(uint32_t version) {
+    return ((uint64_t)version <= (uint64_t)time(NULL) + GOSSIP_VERSION_SLACK);
+}
+
+void gossip_outrank(GOSSIP *gossip, uint32_t version) {
+    // A record of ours newer than what we announce: announce one past it (never wrapping to 0)
+    if(!gossip_versionValid(version) || version<=gossip->version)
+        return;
+    gossip->version = (version<UINT32_MAX? version+1 : version);
+}
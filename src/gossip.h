@@ -0,0 +1,75 @@
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#include "global.h"
+
+#include <stdint.h>
+
+#define GOSSIP_INTERVAL    1000 // ms per round
+#define GOSSIP_FANOUT      1 // contacts a round starts an exchange with
+#define GOSSIP_HEARTBEAT   5 // rounds between own version bumps
+#define GOSSIP_TIMEOUT     30000 // ms without a newer version, then offline
+#define GOSSIP_HOT         3 // rounds a changed record is sent before the others
+#define GOSSIP_MAX_RECORDS 4096 // then the record unchanged for longest is dropped
+#define GOSSIP_VERSION_SLACK 86400 // s a version may be ahead of our clock (versions start at the clock and grow slower)
+
+// Presence of one identity, as announced by itself
+typedef struct {
+    char username[32];
+    char ip[16];
+    uint32_t version; // owner's counter: higher wins
+    int online; // 0 once it said goodbye
+
+    double seenAt; // ms, when the version last grew here
+    int changedRound; // round it last changed here
+    int mark; // listed in the digest being answered
+} GOSSIP_RECORD;
+
+// Presence directory, spread by push-pull exchanges over existing connections:
+//   syn  = own record + digest (key, version) of hot records first, then a rotating window
+//   ack  = newer records for that digest, wants for older ones, then records the digest missed
+//   ack2 = records wanted
+// Each is one frame of at most 'max' bytes, so a round costs 3 frames per exchange.
+typedef struct {
+    char username[32]; // own identity
+    uint32_t version;
+    int online;
+
+    int numRecords;
+    GOSSIP_RECORD *records;
+
+    int round;
+    int cursor; // next record for the rotating window
+    int markEpoch;
+    double lastRound; // ms
+    uint32_t seed; // contact picks
+
+    long updates; // records learned or refreshed
+} GOSSIP;
+
+// Gossip manipulation
+void gossip_init(GOSSIP *gossip);
+void gossip_destroy(GOSSIP *gossip);
+void gossip_setUsername(GOSSIP *gossip, char *username);
+int gossip_tick(GOSSIP *gossip, double now);
+void gossip_leave(GOSSIP *gossip);
+int gossip_random(GOSSIP *gossip, int n);
+
+// Exchange (frames are text, one line per entry)
+int gossip_syn(GOSSIP *gossip, char dest[], int max);
+int gossip_handle(GOSSIP *gossip, char *username, char *ip, char *myIp, char *data, char reply[], int max, double now);
+
+// Directory
+int gossip_update(GOSSIP *gossip, char *username, char *ip, uint32_t version, int online, double now);
+GOSSIP_RECORD* gossip_find(GOSSIP *gossip, char *username, char *ip);
+int gossip_isOnline(GOSSIP_RECORD *record, double now);
+
+// Internal
+int gossip_parseKey(char *key, char username[32], char ip[16]);
+int gossip_append(char dest[], int size, int max, const char *format, ...);
+int gossip_appendEntries(GOSSIP *gossip, char dest[], int size, int max, int records);
+void gossip_evict(GOSSIP *gossip);
+int gossip_versionValid(uint32_t version);
+void gossip_outrank(GOSSIP *gossip, uint32_t version);
+
+#endif // GOSSIP_H
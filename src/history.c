@@ -0,0 +1,119 @@
+
+#include "history.h"
+#include "trace.h"
+
+void history_init(HISTORY *history) {
+    history->numEntries = 0;
+    history->maxEntries = 0;
+    history->entries = NULL;
+
+    history->textSize = 0;
+    history->maxText = 0;
+    history->text = NULL;
+
+    index_init(&(history->index));
+
+    pthread_mutex_init(&(history->mutex), NULL);
+}
+
+void history_destroy(HISTORY *history) {
+    free(history->entries);
+    history->entries = NULL;
+    history->numEntries = history->maxEntries = 0;
+
+    free(history->text);
+    history->text = NULL;
+    history->textSize = history->maxText = 0;
+
+    index_destroy(&(history->index));
+
+    pthread_mutex_destroy(&(history->mutex));
+}
+
+int history_add(HISTORY *history, char direction, char ip[], char username[], char *text, time_t time) {
+    return history_addSent(history, direction, ip, username, text, time, time, 0);
+}
+
+int history_addSent(HISTORY *history, char direction, char ip[], char username[], char *text, time_t time, time_t sent, uint64_t hash) {
+    uint64_t span = trace_begin();
+    pthread_mutex_lock(&(history->mutex));
+
+    const int id = history->numEntries;
+    const long len = strlen(text)+1;
+
+    // Grow lists
+    if(history->numEntries == history->maxEntries) {
+        history->maxEntries = (history->maxEntries==0? 64 : history->maxEntries*2);
+        history->entries = realloc(history->entries, history->maxEntries*sizeof(HISTORY_ENTRY));
+    }
+    while(history->textSize+len > history->maxText) {
+        history->maxText = (history->maxText==0? 4096 : history->maxText*2);
+        history->text = realloc(history->text, history->maxText);
+    }
+
+    // Add entry
+    HISTORY_ENTRY *entry = &(history->entries[id]);
+    entry->time = time;
+    entry->sent = sent;
+    entry->hash = hash;
+    entry->direction = direction;
+    strncpy(entry->ip, ip, 15);
+    entry->ip[15] = '\0';
+    strncpy(entry->username, username, 31);
+    entry->username[31] = '\0';
+    entry->text = history->textSize;
+
+    memcpy(history->text+history->textSize, text, len);
+    history->textSize += len;
+
+    (history->numEntries)++;
+
+    // Index it
+    index_add(&(history->index), id, text);
+
+    pthread_mutex_unlock(&(history->mutex));
+    trace_end("history add", span);
+
+    return id;
+}
+
+HISTORY_ENTRY* history_get(HISTORY *history, int id) {
+    if(id<0 || id>=history->numEntries)
+        return NULL;
+    return &(history->entries[id]);
+}
+
+char* history_getText(HISTORY *history, int id) {
+    if(id<0 || id>=history->numEntries)
+        return NULL;
+    return history->text + history->entries[id].text;
+}
+
+int history_lowerBound(HISTORY *history, time_t time) {
+    // First id with entry time >= time (entries are appended in time order)
+    int lo = 0, hi = history->numEntries;
+    while(lo<hi) {
+        int mid = (lo+hi)/2;
+        if(history->entries[mid].time < time)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int history_search(HISTORY *history, char *query, time_t from, time_t to, INDEX_RESULT *results, int max) {
+    pthread_mutex_lock(&(history->mutex));
+
+    // Time filter as id range
+    int minId = history_lowerBound(history, from);
+    int maxId = history_lowerBound(history, to+1) - 1;
+
+    int num = 0;
+    if(minId<=maxId)
+        num = index_search(&(history->index), query, minId, maxId, results, max);
+
+    pthread_mutex_unlock(&(history->mutex));
+
+    return num;
+}
@@ -0,0 +1,55 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "global.h"
+#include "index.h"
+
+#include <stdint.h>
+
+#define HISTORY_IN  0 // received message
+#define HISTORY_OUT 1 // sent message
+
+typedef struct {
+    time_t time; // send/recv time
+    time_t sent; // sender's clock (= time for our own messages)
+    uint64_t hash; // identity shared with the peer (0 = none)
+    char direction; // HISTORY_IN or HISTORY_OUT
+    char ip[16]; // contact's IP address
+    char username[32]; // contact's username
+    long text; // offset in text buffer
+} HISTORY_ENTRY;
+
+typedef struct {
+    // Messages, id = position
+    int numEntries;
+    int maxEntries;
+    HISTORY_ENTRY *entries;
+
+    // Message texts
+    long textSize;
+    long maxText;
+    char *text;
+
+    // Full-text index
+    INDEX index;
+
+    pthread_mutex_t mutex; // mutex
+} HISTORY;
+
+// History manipulation
+void history_init(HISTORY *history);
+void history_destroy(HISTORY *history);
+
+// Messages
+int history_add(HISTORY *history, char direction, char ip[], char username[], char *text, time_t time);
+int history_addSent(HISTORY *history, char direction, char ip[], char username[], char *text, time_t time, time_t sent, uint64_t hash);
+HISTORY_ENTRY* history_get(HISTORY *history, int id);
+char* history_getText(HISTORY *history, int id);
+
+// Ranked full-text search over messages in [from, to]
+int history_search(HISTORY *history, char *query, time_t from, time_t to, INDEX_RESULT *results, int max);
+
+// Internal
+int history_lowerBound(HISTORY *history, time_t time);
+
+#endif // HISTORY_H
@@ -0,0 +1,305 @@
+
+#include "index.h"
+
+#include <ctype.h>
+#include <math.h>
+
+typedef struct {
+    INDEX_POSTING *posting;
+    int pos; // position in posting data
+    int skip; // current skip block
+    int id; // current id
+    int tf; // current term frequency
+} INDEX_CURSOR;
+
+void index_init(INDEX *index) {
+    index->numDocs = 0;
+    index->numTerms = 0;
+    index->capacity = 1024;
+    index->table = calloc(index->capacity, sizeof(INDEX_POSTING*));
+}
+
+void index_destroy(INDEX *index) {
+    int i=0;
+    for(i=0; i<index->capacity; i++) {
+        INDEX_POSTING *posting = index->table[i];
+        if(posting==NULL)
+            continue;
+        free(posting->data);
+        free(posting->skips);
+        free(posting);
+    }
+    free(index->table);
+    index->table = NULL;
+    index->capacity = 0;
+    index->numTerms = 0;
+    index->numDocs = 0;
+}
+
+unsigned int index_hash(char *term) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while(*term) {
+        hash ^= (unsigned char)*term++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void index_grow(INDEX *index) {
+    const int oldCapacity = index->capacity;
+    INDEX_POSTING **oldTable = index->table;
+
+    index->capacity = oldCapacity*2;
+    index->table = calloc(index->capacity, sizeof(INDEX_POSTING*));
+
+    // Rehash
+    int i=0;
+    for(i=0; i<oldCapacity; i++) {
+        if(oldTable[i]==NULL)
+            continue;
+        unsigned int slot = index_hash(oldTable[i]->term) & (index->capacity-1);
+        while(index->table[slot]!=NULL)
+            slot = (slot+1) & (index->capacity-1);
+        index->table[slot] = oldTable[i];
+    }
+
+    free(oldTable);
+}
+
+INDEX_POSTING* index_getPosting(INDEX *index, char *term, int create) {
+    unsigned int slot = index_hash(term) & (index->capacity-1);
+
+    // Linear probing
+    while(index->table[slot]!=NULL) {
+        if(strcmp(index->table[slot]->term, term)==0)
+            return index->table[slot];
+        slot = (slot+1) & (index->capacity-1);
+    }
+
+    if(!create)
+        return NULL;
+
+    // Create posting list
+    INDEX_POSTING *posting = calloc(1, sizeof(INDEX_POSTING));
+    strcpy(posting->term, term);
+    posting->lastId = -1;
+    index->table[slot] = posting;
+    (index->numTerms)++;
+
+    // Keep load factor under 1/2
+    if(index->numTerms*2 > index->capacity)
+        index_grow(index);
+
+    return posting;
+}
+
+int index_tokenize(char *text, char tokens[][INDEX_TERM_SIZE], int max) {
+    int num = 0;
+    int len = 0;
+
+    // Tokens are runs of letters, digits and non-ASCII (UTF-8) bytes
+    while(num<max) {
+        unsigned char c = (unsigned char)*text;
+        if(c!='\0' && (isalnum(c) || c>=0x80)) {
+            if(len<INDEX_TERM_SIZE-1)
+                tokens[num][len++] = tolower(c);
+        } else if(len>0) {
+            tokens[num++][len] = '\0';
+            len = 0;
+        }
+
+        if(c=='\0')
+            break;
+        text++;
+    }
+
+    return num;
+}
+
+void index_putVarint(INDEX_POSTING *posting, unsigned int value) {
+    // Grow data
+    if(posting->size+5 > posting->capacity) {
+        posting->capacity = (posting->capacity==0? 16 : posting->capacity*2);
+        posting->data = realloc(posting->data, posting->capacity);
+    }
+
+    while(value>=0x80) {
+        posting->data[(posting->size)++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    posting->data[(posting->size)++] = value;
+}
+
+unsigned int index_getVarint(unsigned char *data, int *pos) {
+    unsigned int value = 0;
+    int shift = 0;
+    while(data[*pos] & 0x80) {
+        value |= (data[(*pos)++] & 0x7F) << shift;
+        shift += 7;
+    }
+    value |= data[(*pos)++] << shift;
+    return value;
+}
+
+int index_compareTerms(const void *a, const void *b) {
+    return strcmp((const char*)a, (const char*)b);
+}
+
+void index_add(INDEX *index, int id, char *text) {
+    char tokens[INDEX_MAX_TOKENS][INDEX_TERM_SIZE];
+    int num = index_tokenize(text, tokens, INDEX_MAX_TOKENS);
+
+    // Sort, so equal terms are grouped and counted once
+    qsort(tokens, num, INDEX_TERM_SIZE, &index_compareTerms);
+
+    int i=0;
+    while(i<num) {
+        int tf = 1;
+        while(i+tf<num && strcmp(tokens[i], tokens[i+tf])==0)
+            tf++;
+
+        INDEX_POSTING *posting = index_getPosting(index, tokens[i], 1);
+
+        // Ids must be increasing, as history is append-only
+        if(id > posting->lastId) {
+            // New skip block
+            if(posting->df%INDEX_SKIP_INTERVAL == 0) {
+                posting->skips = realloc(posting->skips, (posting->numSkips+1)*sizeof(INDEX_SKIP));
+                posting->skips[posting->numSkips].id = posting->lastId;
+                posting->skips[posting->numSkips].offset = posting->size;
+                (posting->numSkips)++;
+            }
+
+            // Append (delta, tf)
+            index_putVarint(posting, id - posting->lastId);
+            index_putVarint(posting, tf);
+            posting->lastId = id;
+            (posting->df)++;
+        }
+
+        i += tf;
+    }
+
+    (index->numDocs)++;
+}
+
+int index_cursor_next(INDEX_CURSOR *cursor) {
+    INDEX_POSTING *posting = cursor->posting;
+    if(cursor->pos >= posting->size)
+        return 0;
+
+    cursor->id += index_getVarint(posting->data, &(cursor->pos));
+    cursor->tf = index_getVarint(posting->data, &(cursor->pos));
+    return 1;
+}
+
+int index_cursor_seek(INDEX_CURSOR *cursor, int target) {
+    INDEX_POSTING *posting = cursor->posting;
+
+    // Already there
+    if(cursor->id >= target)
+        return 1;
+
+    // Jump over whole blocks whose ids are all below target
+    int skip = cursor->skip;
+    while(skip+1 < posting->numSkips && posting->skips[skip+1].id < target)
+        skip++;
+    if(skip!=cursor->skip && posting->skips[skip].offset > cursor->pos) {
+        cursor->skip = skip;
+        cursor->pos = posting->skips[skip].offset;
+        cursor->id = posting->skips[skip].id;
+    }
+
+    // Scan inside block
+    while(cursor->id < target)
+        if(!index_cursor_next(cursor))
+            return 0;
+    return 1;
+}
+
+int index_compareCursors(const void *a, const void *b) {
+    return ((INDEX_CURSOR*)a)->posting->df - ((INDEX_CURSOR*)b)->posting->df;
+}
+
+int index_search(INDEX *index, char *query, int minId, int maxId, INDEX_RESULT *results, int max) {
+    char tokens[INDEX_MAX_TOKENS][INDEX_TERM_SIZE];
+    int num = index_tokenize(query, tokens, INDEX_MAX_TOKENS);
+    if(num==0 || max<=0)
+        return 0;
+
+    // Open a cursor per distinct term; all terms must match
+    INDEX_CURSOR cursors[INDEX_MAX_TOKENS];
+    double idf[INDEX_MAX_TOKENS];
+    int numCursors = 0;
+    int i=0, j=0;
+    for(i=0; i<num; i++) {
+        INDEX_POSTING *posting = index_getPosting(index, tokens[i], 0);
+        if(posting==NULL)
+            return 0;
+
+        for(j=0; j<numCursors; j++)
+            if(cursors[j].posting==posting)
+                break;
+        if(j<numCursors)
+            continue;
+
+        cursors[numCursors].posting = posting;
+        cursors[numCursors].pos = 0;
+        cursors[numCursors].skip = 0;
+        cursors[numCursors].id = -1;
+        cursors[numCursors].tf = 0;
+        numCursors++;
+    }
+
+    // Rarest term leads the intersection
+    qsort(cursors, numCursors, sizeof(INDEX_CURSOR), &index_compareCursors);
+    for(i=0; i<numCursors; i++)
+        idf[i] = log(1.0 + (double)index->numDocs/cursors[i].posting->df);
+
+    int numResults = 0;
+    int target = minId;
+    while(1) {
+        // Align every cursor on the same id
+        if(!index_cursor_seek(&cursors[0], target))
+            break;
+        int candidate = cursors[0].id;
+        if(candidate > maxId)
+            break;
+
+        int matched = 1;
+        for(i=1; i<numCursors; i++) {
+            if(!index_cursor_seek(&cursors[i], candidate))
+                return numResults;
+            if(cursors[i].id != candidate) {
+                target = cursors[i].id;
+                matched = 0;
+                break;
+            }
+        }
+        if(!matched)
+            continue;
+
+        // Score: sum of tf-idf
+        double score = 0;
+        for(i=0; i<numCursors; i++)
+            score += (1.0 + log(cursors[i].tf)) * idf[i];
+
+        // Insert in top results (best score first, newest first on ties)
+        int pos = numResults;
+        while(pos>0 && results[pos-1].score <= score)
+            pos--;
+        if(pos<max) {
+            if(numResults<max)
+                numResults++;
+            for(i=numResults-1; i>pos; i--)
+                results[i] = results[i-1];
+            results[pos].id = candidate;
+            results[pos].score = score;
+        }
+
+        target = candidate+1;
+    }
+
+    return numResults;
+}
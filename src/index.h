@@ -0,0 +1,54 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "global.h"
+
+#define INDEX_TERM_SIZE     32
+#define INDEX_MAX_TOKENS    256 // tokens per indexed message
+#define INDEX_SKIP_INTERVAL 128 // postings per skip block
+
+typedef struct {
+    int id; // last id before the block
+    int offset; // block offset in posting data
+} INDEX_SKIP;
+
+typedef struct {
+    char term[INDEX_TERM_SIZE];
+    int df; // num of messages containing the term
+    int lastId; // last id appended (delta base)
+
+    // Posting list: varint (id delta, term frequency) pairs
+    unsigned char *data;
+    int size;
+    int capacity;
+
+    // Skip list, one entry per INDEX_SKIP_INTERVAL postings
+    int numSkips;
+    INDEX_SKIP *skips;
+} INDEX_POSTING;
+
+typedef struct {
+    int numDocs; // num of messages indexed
+    int numTerms; // num of distinct terms
+    int capacity; // hash table size (power of 2)
+    INDEX_POSTING **table;
+} INDEX;
+
+typedef struct {
+    int id;
+    double score;
+} INDEX_RESULT;
+
+// Index manipulation
+void index_init(INDEX *index);
+void index_destroy(INDEX *index);
+
+// Indexing and queries
+void index_add(INDEX *index, int id, char *text);
+int index_search(INDEX *index, char *query, int minId, int maxId, INDEX_RESULT *results, int max);
+
+// Internal
+int index_tokenize(char *text, char tokens[][INDEX_TERM_SIZE], int max);
+INDEX_POSTING* index_getPosting(INDEX *index, char *term, int create);
+
+#endif // INDEX_H
@@ -0,0 +1,104 @@
+
+#include "lane.h"
+
+void lanes_init(LANES *lanes, int controlWeight, int dataWeight) {
+    int i=0;
+    for(i=0; i<LANE_COUNT; i++) {
+        lanes->lanes[i].head = NULL;
+        lanes->lanes[i].tail = NULL;
+        lanes->lanes[i].numFrames = 0;
+        lanes->lanes[i].deficit = 0;
+    }
+    lanes->lanes[LANE_CONTROL].weight = (controlWeight>0? controlWeight : 1);
+    lanes->lanes[LANE_DATA].weight = (dataWeight>0? dataWeight : 1);
+
+    // Control lane starts each round
+    lanes->current = LANE_CONTROL;
+    lanes->lanes[LANE_CONTROL].deficit = lanes->lanes[LANE_CONTROL].weight*LANE_QUANTUM;
+    lanes->numFrames = 0;
+}
+
+void lanes_destroy(LANES *lanes) {
+    LANE_FRAME *frame = NULL;
+    while((frame = lanes_pop(lanes))!=NULL)
+        free(frame);
+}
+
+void lanes_push(LANES *lanes, int lane, char *data, int size) {
+    // Alloc and copy
+    LANE_FRAME *frame = malloc(sizeof(LANE_FRAME)+size);
+    frame->next = NULL;
+    frame->size = size;
+    memcpy(frame->data, data, size);
+
+    // Append to lane
+    LANE *l = &(lanes->lanes[lane]);
+    if(l->tail==NULL)
+        l->head = frame;
+    else
+        l->tail->next = frame;
+    l->tail = frame;
+
+    (l->numFrames)++;
+    (lanes->numFrames)++;
+}
+
+LANE_FRAME* lanes_pop(LANES *lanes) {
+    if(lanes_isEmpty(lanes))
+        return NULL;
+
+    // Deficit round robin: each lane sends up to weight*LANE_QUANTUM bytes per round
+    while(1) {
+        LANE *lane = &(lanes->lanes[lanes->current]);
+
+        if(lane->head!=NULL && lane->head->size <= lane->deficit) {
+            LANE_FRAME *frame = lane->head;
+            lane->head = frame->next;
+            if(lane->head==NULL)
+                lane->tail = NULL;
+            lane->deficit -= frame->size;
+
+            (lane->numFrames)--;
+            (lanes->numFrames)--;
+            return frame;
+        }
+
+        // Idle lanes do not save credit
+        if(lane->head==NULL)
+            lane->deficit = 0;
+
+        // Next lane
+        lanes->current = (lanes->current+1)%LANE_COUNT;
+        lane = &(lanes->lanes[lanes->current]);
+        lane->deficit += lane->weight*LANE_QUANTUM;
+    }
+}
+
+void lanes_unpop(LANES *lanes, LANE_FRAME *frame) {
+    // Frame just popped and not sent: first again in its lane (the current one), with its credit back
+    LANE *lane = &(lanes->lanes[lanes->current]);
+    frame->next = lane->head;
+    lane->head = frame;
+    if(lane->tail==NULL)
+        lane->tail = frame;
+    lane->deficit += frame->size;
+
+    (lane->numFrames)++;
+    (lanes->numFrames)++;
+}
+
+int lanes_isEmpty(LANES *lanes) {
+    return (lanes->numFrames==0);
+}
+
+long lanes_memory(LANES *lanes) {
+    // Bytes held by queued frames
+    long bytes = 0;
+    int i=0;
+    for(i=0; i<LANE_COUNT; i++) {
+        LANE_FRAME *frame = NULL;
+        for(frame=lanes->lanes[i].head; frame!=NULL; frame=frame->next)
+            bytes += sizeof(LANE_FRAME) + frame->size;
+    }
+    return bytes;
+}
@@ -0,0 +1,44 @@
+#ifndef LANE_H
+#define LANE_H
+
+#include "global.h"
+
+#define LANE_CONTROL 0 // handshakes, pings, acks
+#define LANE_DATA    1 // chat payloads
+#define LANE_COUNT   2
+
+#define LANE_QUANTUM 1500 // bytes per weight unit and round
+
+typedef struct LANE_FRAME {
+    struct LANE_FRAME *next;
+    int size;
+    char data[];
+} LANE_FRAME;
+
+typedef struct {
+    LANE_FRAME *head;
+    LANE_FRAME *tail;
+    int numFrames;
+
+    int weight; // share of each round
+    int deficit; // bytes this lane may still send in the round
+} LANE;
+
+typedef struct {
+    LANE lanes[LANE_COUNT];
+    int current; // lane being served
+    int numFrames; // frames in all lanes
+} LANES;
+
+// Lanes manipulation
+void lanes_init(LANES *lanes, int controlWeight, int dataWeight);
+void lanes_destroy(LANES *lanes);
+
+// Frames (popped frames must be freed by the caller)
+void lanes_push(LANES *lanes, int lane, char *data, int size);
+LANE_FRAME* lanes_pop(LANES *lanes);
+void lanes_unpop(LANES *lanes, LANE_FRAME *frame);
+int lanes_isEmpty(LANES *lanes);
+long lanes_memory(LANES *lanes);
+
+#endif // LANE_H
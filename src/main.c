@@ -2,9 +2,36 @@
 #include <stdlib.h>
 
 #include "messenger.h"
+#include "node.h"
 
 int main() {
 
+    // Many identities sharing one listener: MESSENGER_TENANTS=alice,bob,...
+    char *tenants = getenv("MESSENGER_TENANTS");
+    if(tenants!=NULL && tenants[0]!='\0') {
+        NODE node;
+        node_init(&node);
+        if(node_start(&node, MESSENGER_SERVER_PORT)==-1) {
+            printf(">> Failed to start Messenger.\n>> Error: %s.\n", strerror(errno));
+            node_destroy(&node);
+            return 1;
+        }
+
+        char *names = strdup(tenants);
+        char *name = strtok(names, ",");
+        while(name!=NULL) {
+            if(node_addTenant(&node, name)==NULL)
+                printf(">> Invalid or repeated identity '%s'.\n", name);
+            name = strtok(NULL, ",");
+        }
+        free(names);
+
+        node_menu(&node); // blocking call
+        node_destroy(&node);
+
+        return 0;
+    }
+
     MESSENGER messenger;
     messenger_init(&messenger);
     messenger_start(&messenger); // blocking call
@@ -12,4 +39,3 @@ int main() {
 
     return 0;
 }
-
@@ -0,0 +1,148 @@
+
+#include "merkle.h"
+
+#define MERKLE_FNV_BASIS 14695981039346656037ULL
+#define MERKLE_FNV_PRIME 1099511628211ULL
+
+void merkle_init(MERKLE_TREE *tree) {
+    tree->numLeaves = 0;
+    tree->maxLeaves = 0;
+    tree->leaves = NULL;
+}
+
+void merkle_destroy(MERKLE_TREE *tree) {
+    free(tree->leaves);
+    tree->leaves = NULL;
+    tree->numLeaves = tree->maxLeaves = 0;
+}
+
+void merkle_add(MERKLE_TREE *tree, uint64_t hash, time_t sent, int id) {
+    // Grow list
+    if(tree->numLeaves == tree->maxLeaves) {
+        tree->maxLeaves = (tree->maxLeaves==0? 64 : tree->maxLeaves*2);
+        tree->leaves = realloc(tree->leaves, tree->maxLeaves*sizeof(MERKLE_LEAF));
+    }
+
+    MERKLE_LEAF *leaf = &(tree->leaves[tree->numLeaves]);
+    leaf->bucket = (uint32_t)(sent<0? 0 : sent/MERKLE_BUCKET);
+    leaf->hash = hash;
+    leaf->id = id;
+    (tree->numLeaves)++;
+}
+
+void merkle_build(MERKLE_TREE *tree) {
+    // History is in receive order, buckets are in sender time: usually sorted already
+    int i=0;
+    for(i=1; i<tree->numLeaves; i++)
+        if(tree->leaves[i].bucket < tree->leaves[i-1].bucket)
+            break;
+    if(i<tree->numLeaves)
+        qsort(tree->leaves, tree->numLeaves, sizeof(MERKLE_LEAF), &merkle_compareLeaves);
+}
+
+uint64_t merkle_root(MERKLE_TREE *tree) {
+    return merkle_nodeHash(tree, MERKLE_LEVELS, 0);
+}
+
+uint64_t merkle_nodeHash(MERKLE_TREE *tree, int level, uint32_t prefix) {
+    // Empty subtrees are skipped without descending
+    const uint64_t first = (uint64_t)prefix << (4*level);
+    const uint64_t end = (uint64_t)(prefix+1) << (4*level);
+    int lo = merkle_lowerBound(tree, first);
+    if(lo==tree->numLeaves || tree->leaves[lo].bucket>=end)
+        return 0;
+
+    // Leaf: messages in any order hash the same
+    if(level==0) {
+        uint64_t sum = 0;
+        int i=0;
+        for(i=lo; i<tree->numLeaves && tree->leaves[i].bucket==prefix; i++)
+            sum += merkle_mix(tree->leaves[i].hash);
+        return merkle_mix(sum) | 1; // never 0 (= empty)
+    }
+
+    // Node: non-empty children, with their position
+    uint64_t children[MERKLE_FANOUT];
+    merkle_children(tree, level, prefix, children);
+    uint64_t hash = MERKLE_FNV_BASIS;
+    int c=0;
+    for(c=0; c<MERKLE_FANOUT; c++) {
+        if(children[c]==0)
+            continue;
+        hash = (hash ^ (uint64_t)c) * MERKLE_FNV_PRIME;
+        hash = (hash ^ children[c]) * MERKLE_FNV_PRIME;
+    }
+    return merkle_mix(hash) | 1;
+}
+
+void merkle_children(MERKLE_TREE *tree, int level, uint32_t prefix, uint64_t hashes[MERKLE_FANOUT]) {
+    int c=0;
+    for(c=0; c<MERKLE_FANOUT; c++)
+        hashes[c] = merkle_nodeHash(tree, level-1, prefix*MERKLE_FANOUT + c);
+}
+
+int merkle_bucket(MERKLE_TREE *tree, uint32_t bucket, int *first) {
+    // Messages in a bucket: count, and position of the first one
+    *first = merkle_lowerBound(tree, bucket);
+    int i=*first;
+    while(i<tree->numLeaves && tree->leaves[i].bucket==bucket)
+        i++;
+    return i - *first;
+}
+
+int merkle_find(MERKLE_TREE *tree, uint32_t bucket, uint64_t hash) {
+    // Leaf position, or -1
+    int first = 0;
+    int num = merkle_bucket(tree, bucket, &first);
+    int i=0;
+    for(i=first; i<first+num; i++)
+        if(tree->leaves[i].hash==hash)
+            return i;
+    return -1;
+}
+
+uint64_t merkle_messageHash(char *sender, time_t sent, char *text) {
+    // FNV-1a over "sender\0sent\0text"
+    char stamp[24];
+    sprintf(stamp, "%ld", (long)sent);
+    char *parts[3] = { sender, stamp, text };
+
+    uint64_t hash = MERKLE_FNV_BASIS;
+    int i=0;
+    for(i=0; i<3; i++) {
+        unsigned char *p = (unsigned char*)parts[i];
+        while(*p!='\0')
+            hash = (hash ^ *(p++)) * MERKLE_FNV_PRIME;
+        hash = hash * MERKLE_FNV_PRIME; // separator
+    }
+    return hash;
+}
+
+int merkle_lowerBound(MERKLE_TREE *tree, uint64_t bucket) {
+    // First leaf with bucket >= 'bucket'
+    int lo = 0, hi = tree->numLeaves;
+    while(lo<hi) {
+        int mid = (lo+hi)/2;
+        if(tree->leaves[mid].bucket < bucket)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int merkle_compareLeaves(const void *a, const void *b) {
+    // Order within a bucket does not matter (leaf hash is a sum)
+    const MERKLE_LEAF *x = a, *y = b;
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+uint64_t merkle_mix(uint64_t x) {
+    // splitmix64 finalizer: sums of mixed hashes don't cancel out like XOR
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
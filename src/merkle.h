@@ -0,0 +1,49 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "global.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define MERKLE_BUCKET 60 // s of sender time per leaf
+#define MERKLE_FANOUT 16 // children per node (4 bits of bucket number per level)
+#define MERKLE_LEVELS 7 // root covers 16^7 buckets (~500 years from 1970)
+
+// One message of a conversation
+typedef struct {
+    uint32_t bucket; // sent/MERKLE_BUCKET
+    uint64_t hash; // sender, sent time and text
+    int id; // caller's (history id)
+} MERKLE_LEAF;
+
+// Tree over a conversation, node (level, prefix) = buckets [prefix<<4*level, (prefix+1)<<4*level).
+// Sparse: only leaves are stored, node hashes are computed over them (empty = 0).
+typedef struct {
+    int numLeaves;
+    int maxLeaves;
+    MERKLE_LEAF *leaves; // by bucket once built
+} MERKLE_TREE;
+
+// Tree manipulation
+void merkle_init(MERKLE_TREE *tree);
+void merkle_destroy(MERKLE_TREE *tree);
+void merkle_add(MERKLE_TREE *tree, uint64_t hash, time_t sent, int id);
+void merkle_build(MERKLE_TREE *tree);
+
+// Queries (built tree)
+uint64_t merkle_root(MERKLE_TREE *tree);
+uint64_t merkle_nodeHash(MERKLE_TREE *tree, int level, uint32_t prefix);
+void merkle_children(MERKLE_TREE *tree, int level, uint32_t prefix, uint64_t hashes[MERKLE_FANOUT]);
+int merkle_bucket(MERKLE_TREE *tree, uint32_t bucket, int *first);
+int merkle_find(MERKLE_TREE *tree, uint32_t bucket, uint64_t hash);
+
+// Message identity, the same on both ends
+uint64_t merkle_messageHash(char *sender, time_t sent, char *text);
+
+// Internal
+int merkle_lowerBound(MERKLE_TREE *tree, uint64_t bucket);
+int merkle_compareLeaves(const void *a, const void *b);
+uint64_t merkle_mix(uint64_t x);
+
+#endif // MERKLE_H
@@ -2,24 +2,84 @@
 #include "messenger.h"
 #include "timer.h"
 #include "client.h"
+#include "trace.h"
+#include "daemon.h"
+
+#include <sys/ioctl.h>
 
 void messenger_init(MESSENGER *messenger) {
     messenger->numConn = 0;
     messenger->conn = NULL;
 
+    // Settings and counters
+    config_load(&(messenger->config));
+    stats_init(&(messenger->stats));
+    connection_setInboxLimits(messenger->config.inboxMessages, messenger->config.inboxBytes);
+    if(messenger->config.trace)
+        trace_enable(messenger->config.traceSpans);
+
+    // UDP transport (started on demand)
+    udp_init(&(messenger->udp), (UDP_CALLBACK)&messenger_udp_receive, (UDP_CALLBACK)&messenger_udp_failure, messenger);
+
+    // Shared memory is only offered if we know which host we are on
+    if(!messenger->config.shmEnabled || shm_hostId(messenger->hostId)==-1)
+        messenger->hostId[0] = '\0';
+
+    // Receive-path text checks
+    filter_init(&(messenger->filter));
+    filter_load(&(messenger->filter), messenger->config.mute);
+
+    // Low-latency I/O thread (started on demand)
+    poller_init(&(messenger->poller), (POLLER_CALLBACK)&messenger_poll_readable, (POLLER_SPIN)&messenger_poll_spin, messenger);
+    messenger->io = &(messenger->poller);
+    messenger->numPaused = 0;
+    lanes_init(&(messenger->pollInbox), messenger->config.weightControl, messenger->config.weightData);
+
+    // Presence directory (named on start)
+    gossip_init(&(messenger->gossip));
+
+    // Traffic capture (opened on start)
+    capture_init(&(messenger->capture));
+
     // Server init
     server_init(&(messenger->server));
 
+    // Message history
+    history_init(&(messenger->history));
+
+    // State from last run (loaded on start)
+    snapshot_init(&(messenger->restore));
+    strcpy(messenger->snapshotFile, SNAPSHOT_FILE);
+    messenger->username[0] = '\0';
+    messenger->hosted = 0;
+
+    // No subscriber until the daemon sets one
+    messenger->listener = NULL;
+    messenger->listenerArg = NULL;
+
     // Mutex for thread-safe
     pthread_mutex_init(&(messenger->mutex), NULL);
 }
 
 void messenger_start(MESSENGER *messenger) {
-    // Get user name
-    printf(">> Welcome to Messenger!\n");
-    printf(">> How should I call you? ");
-    fgets(messenger->username, 32, stdin);
-    messenger->username[strlen(messenger->username)-1] = '\0'; // remove \n
+    // Restore state from last run
+    if(snapshot_load(&(messenger->restore), messenger->snapshotFile)!=-1)
+        strcpy(messenger->username, messenger->restore.username);
+
+    // Headless: name from the environment, never asked
+    if(messenger->username[0]=='\0' && (messenger->config.username[0]!='\0' || messenger->config.daemon)) {
+        strcpy(messenger->username, messenger->config.username[0]!='\0'? messenger->config.username : "anonymous");
+        printf(">> Welcome to Messenger, %s!\n", messenger->username);
+    } else if(messenger->username[0]=='\0') { // Get user name
+        printf(">> Welcome to Messenger!\n");
+        printf(">> How should I call you? ");
+        fgets(messenger->username, 32, stdin);
+        messenger->username[strlen(messenger->username)-1] = '\0'; // remove \n
+    } else {
+        printf(">> Welcome back to Messenger, %s!\n", messenger->username);
+    }
+    gossip_setUsername(&(messenger->gossip), messenger->username);
+    messenger_capture_start(messenger);
 
     // Start server for receiving connections
     if(server_start(&(messenger->server), MESSENGER_SERVER_PORT)==-1) {
@@ -27,47 +87,86 @@ void messenger_start(MESSENGER *messenger) {
         return;
     }
 
+    // Optional UDP transport, on the same port number
+    if(messenger->config.udpEnabled && udp_start(&(messenger->udp), MESSENGER_SERVER_PORT)==-1)
+        printf(">> UDP transport disabled.\n>> Error: %s.\n", strerror(errno));
+
+    messenger_poll_start(messenger);
+
+    // Reconnect to contacts from last run
+    pthread_mutex_lock(&(messenger->mutex));
+    messenger_snapshot_redial(messenger);
+    pthread_mutex_unlock(&(messenger->mutex));
+
     // Start connection handler thread
     pthread_create(&(messenger->thread), NULL, (void*)&messenger_run, (void*)messenger);
 
-    // Start menu
-    messenger_menu(messenger);
+    // Start menu, or serve commands
+    if(messenger->config.daemon) {
+        DAEMON daemon;
+        daemon_init(&daemon, messenger);
+        if(daemon_start(&daemon, messenger->config.socketPath)==-1)
+            printf(">> Failed to open %s (%s), using stdin only.\n", messenger->config.socketPath, strerror(errno));
+        daemon_run(&daemon); // blocking call
+        daemon_destroy(&daemon);
+
+        messenger_lock(messenger);
+        messenger_stop(messenger);
+        messenger_unlock(messenger);
+    } else {
+        messenger_menu(messenger);
+    }
+}
+
+void messenger_host(MESSENGER *messenger, char *username) {
+    // Tenant of a NODE: the node accepts connections and saves snapshots
+    messenger->hosted = 1;
+    strncpy(messenger->username, username, 31);
+    messenger->username[31] = '\0';
+
+    // Own snapshot, reconnect to contacts from last run
+    sprintf(messenger->snapshotFile, "messenger-%s.snap", messenger->username);
+    gossip_setUsername(&(messenger->gossip), messenger->username);
+    snapshot_load(&(messenger->restore), messenger->snapshotFile);
+    messenger_capture_start(messenger);
+    messenger_poll_start(messenger);
+
+    messenger_lock(messenger);
+    messenger_snapshot_redial(messenger);
+    messenger_unlock(messenger);
 }
 
 void messenger_run(MESSENGER *messenger) {
-    TIMER t;
+    TIMER t, snapshotTimer;
+    timer_start(&snapshotTimer);
+    trace_threadName("messenger");
 
     // Messenger handler loop
     while(1) {
         timer_start(&t);
 
-        // Check new incoming connections
-        int socks[8];
-        int n = server_getNewConnections(&(messenger->server), socks, 8);
-
-        // Handle new connections
-        pthread_mutex_lock(&(messenger->mutex));
-        int i=0;
-        for(i=0; i<n; i++) {
-            const int sock = socks[i];
-
-            // Get IP address
-            char ip[16];
-            socket2ip(sock, ip);
+        // Check new incoming connections (low-latency and event-loop modes: on every I/O thread spin)
+        if(!messenger->io->running)
+            messenger_acceptPending(messenger);
+
+        // Periodic snapshot
+        messenger_lock(messenger);
+        timer_stop(&snapshotTimer);
+        if(timer_timemsec(&snapshotTimer) >= SNAPSHOT_INTERVAL) {
+            messenger_snapshot_save(messenger);
+            capture_flush(&(messenger->capture));
+            timer_start(&snapshotTimer);
+        }
 
-            // Create connection and add to list
-            CONNECTION *newConn = connection_new(socks[i], ip, "Unknown contact");
-            messenger_conn_add(messenger, newConn);
+        // Presence round, and outboxes waiting on a full shm ring
+        if(gossip_tick(&(messenger->gossip), timer_nowmsec()))
+            messenger_gossip_round(messenger);
+        messenger_shm_retry(messenger);
+        messenger_unlock(messenger);
 
-            // Start thread
-            CONNECTION *conn = messenger_conn_getConnByIP(messenger, ip);
-
-            PTHREAD_CONN_ARG args;
-            args.messenger = messenger;
-            args.conn = conn;
-            pthread_create(&(conn->thread), NULL, (void*)messenger_conn_run, (void*)&args);
-        }
-        pthread_mutex_unlock(&(messenger->mutex));
+        // kill -USR1
+        if(trace_dumpRequested())
+            trace_dump(TRACE_FILE);
 
         timer_stop(&t);
 
@@ -78,99 +177,684 @@ void messenger_run(MESSENGER *messenger) {
     }
 }
 
+void messenger_acceptPending(MESSENGER *messenger) {
+    // Called without the lock: all of them (a reconnect storm is thousands), a batch per lock
+    int socks[8];
+    int n = 0;
+    while((n = server_getNewConnections(&(messenger->server), socks, 8))>0) {
+        // Handle new connections
+        messenger_lock(messenger);
+        int i=0;
+        for(i=0; i<n; i++) {
+            uint64_t span = trace_begin();
+            CONNECTION *newConn = messenger_conn_accept(messenger, socks[i]);
+            messenger_conn_start(messenger, newConn);
+            trace_end("accept", span);
+        }
+        messenger_unlock(messenger);
+    }
+}
+
+int messenger_startThread(pthread_t *thread, void *run, void *args) {
+    // Readers mostly wait in recv with a few KB of frames: a small stack keeps many peers cheap
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONN_STACK_SIZE);
+    int retn = pthread_create(thread, &attr, run, args);
+    pthread_attr_destroy(&attr);
+    return retn;
+}
+
 void messenger_conn_run(PTHREAD_CONN_ARG *args) {
     // Parse args
     MESSENGER *messenger = args->messenger;
     CONNECTION *conn = args->conn;
+    free(args);
 
-    // Buffer
-    char recvBuffer[1024];
+    // Buffer (type + data + '\0')
+    char recvBuffer[MSG_MAX_SIZE+2];
     int retn=0;
 
+    // Received frames by priority lane
+    LANES inbox;
+    lanes_init(&inbox, messenger->config.weightControl, messenger->config.weightData);
+    trace_threadName("conn");
+
     // Connection handler thread
     while(1) {
-        memset(recvBuffer, 0, 1024); // clear buffer
-
-        // Recv messages
-        retn = recv(conn->socket, recvBuffer, 1024, 0);
-
-        pthread_mutex_lock(&(messenger->mutex));
+        // Recv one frame (blocking, not traced: mostly idle), then whatever is already buffered
+        retn = messenger_conn_recv(messenger, conn, &inbox, recvBuffer);
+        uint64_t span = trace_begin();
+        while(retn>0 && inbox.numFrames<RECV_BATCH && messenger_msg_pending(conn->socket))
+            retn = messenger_conn_recv(messenger, conn, &inbox, recvBuffer);
+        trace_end("recv", span);
+
+        messenger_lock(messenger);
+
+        // Handle messages, control frames first
+        LANE_FRAME *frame = NULL;
+        while((frame = lanes_pop(&inbox))!=NULL) {
+            span = trace_begin();
+            messenger_conn_dispatch(messenger, conn, frame->data[0], frame->data+1, frame->size-2);
+            trace_end("dispatch", span);
+            free(frame);
+        }
 
         // Check errors
         if(retn==-1) {
             printf(">> MESSENGER: Failed to receive message (%s)!\n", strerror(errno));
-
-            pthread_mutex_unlock(&(messenger->mutex));
-            continue;
         } else if(retn==0) { // Disconnected: remove from contact list and end thread
-            client_disconnect(conn->socket);
-            int pos = messenger_conn_getConnPosByIP(messenger, conn->ip);
-            messenger_conn_remove(messenger, pos);
-
-            pthread_mutex_unlock(&(messenger->mutex));
+            // Not in list: being stopped by messenger_stopConn
+            int pos = messenger_conn_getConnPos(messenger, conn);
+            if(pos!=-1) {
+                messenger_notify(messenger, MESSENGER_EVENT_DISCONNECTED, conn, conn->username);
+                client_disconnect(conn->socket);
+                messenger_conn_remove(messenger, pos);
+            }
+
+            messenger_unlock(messenger);
             break;
         }
 
-        // Handle message
-        char msgType = recvBuffer[0];
-        char *data = recvBuffer+1;
-        switch(msgType) {
-            case MSGTYPE_USERNAME: {
-                // Update contact username
-                char username[32];
-                sscanf(data, "%s", username);
+        messenger_unlock(messenger);
+    }
+
+}
+
+int messenger_conn_recv(MESSENGER *messenger, CONNECTION *conn, LANES *inbox, char *buffer) {
+    // Frame is kept as type + data + '\0'
+    char msgType = 0;
+    int retn = messenger_msg_recv(conn->socket, &msgType, buffer+1, MSG_MAX_SIZE);
+    if(retn<=0)
+        return retn;
+    buffer[0] = msgType;
+
+    // Over the rate limit: stop reading this peer (backpressure), no lock is held
+    double wait = messenger_conn_account(messenger, conn, retn);
+    if(wait>0)
+        msleep(wait);
+    capture_frame(&(messenger->capture), conn->captureId, CAPTURE_IN, msgType, buffer+1, retn-1);
+
+    lanes_push(inbox, messenger_msg_lane(msgType), buffer, retn+1);
+    return retn;
+}
+
+double messenger_conn_account(MESSENGER *messenger, CONNECTION *conn, int size) {
+    // Rate limit: returns the pause (ms) before reading this peer again, callers never sleep holding the lock
+    double wait = connection_throttle(conn, size);
+    if(wait>0) {
+        stats_add(&(conn->stats.throttleEvents), 1);
+        stats_add(&(conn->stats.throttleTime), (long)(wait*1000));
+        stats_add(&(messenger->stats.throttleEvents), 1);
+        stats_add(&(messenger->stats.throttleTime), (long)(wait*1000));
+    }
+
+    // Stats (frame size counts the type byte)
+    stats_add(&(conn->stats.framesIn), 1);
+    stats_add(&(conn->stats.bytesIn), size-1);
+    stats_add(&(messenger->stats.framesIn), 1);
+    stats_add(&(messenger->stats.bytesIn), size-1);
+    return wait;
+}
+
+void messenger_conn_dispatch(MESSENGER *messenger, CONNECTION *conn, char msgType, char *data, int size) {
+    switch(msgType) {
+        case MSGTYPE_USERNAME: {
+            // Update contact username
+            char username[32];
+            if(sscanf(data, "%31s", username)==1)
                 connection_setUsername(conn, username);
+            messenger_notify(messenger, MESSENGER_EVENT_CONNECTED, conn, conn->username);
 
-                // Send back my username
-                char sendBuffer[33];
-                int msgSize = messenger_msg_encode(MSGTYPE_USERNAME_ANSWER, messenger->username, strlen(messenger->username), sendBuffer);
-                send(conn->socket, sendBuffer, msgSize, 0);
-            } break;
+            // Send back my username and transports
+            messenger_msg_sendFrame(messenger, conn, MSGTYPE_USERNAME_ANSWER, messenger->username, strlen(messenger->username));
+            messenger_conn_offerTransports(messenger, conn);
+        } break;
 
-            case MSGTYPE_USERNAME_ANSWER: {
-                // Update contact username
-                char username[32];
-                sscanf(data, "%s", username);
+        case MSGTYPE_USERNAME_ANSWER: {
+            // Update contact username
+            char username[32];
+            if(sscanf(data, "%31s", username)==1)
                 connection_setUsername(conn, username);
-            } break;
+            messenger_notify(messenger, MESSENGER_EVENT_CONNECTED, conn, conn->username);
+        } break;
+
+        case MSGTYPE_MSG: {
+            messenger_msg_receive(messenger, conn, data, size, time(NULL), 0);
+        } break;
+
+        case MSGTYPE_MSG_SENT: {
+            // "<time> <text>"
+            char *text = NULL;
+            long sent = strtol(data, &text, 10);
+            if(text==data || *text!=' ' || sent<0)
+                break;
+            text++;
+            messenger_msg_receive(messenger, conn, text, size-(text-data), (time_t)sent, 0);
+        } break;
+
+        case MSGTYPE_SYNC: {
+            messenger_sync_handle(messenger, conn, data);
+        } break;
+
+        case MSGTYPE_GOSSIP: {
+            // Records are keyed by the sender's name: wait for it
+            if(strcmp(conn->username, "Unknown contact")==0)
+                break;
+
+            char myIp[17], reply[MSG_MAX_SIZE];
+            socket2localIp(conn->socket, myIp);
+            int replySize = gossip_handle(&(messenger->gossip), conn->username, conn->ip, myIp, data, reply, MSG_MAX_SIZE, timer_nowmsec());
+            if(replySize>0)
+                messenger_msg_sendFrame(messenger, conn, MSGTYPE_GOSSIP, reply, replySize);
+        } break;
+
+        case MSGTYPE_TARGET: {
+            // Only meaningful to a NODE, which reads it before we get the connection
+        } break;
+
+        case MSGTYPE_TRANSPORT: {
+            int port = 0, pid = 0, fd = 0;
+            char hostId[40];
+
+            // Peer accepts UDP: use it if we run it too
+            if(messenger->udp.running && conn->udpPeer==-1 && sscanf(data, "udp %d", &port)==1 && port>0)
+                conn->udpPeer = udp_addPeer(&(messenger->udp), conn->ip, port);
+
+            // Peer on the same host: create our ring and tell where it is
+            // (boot id and ring path are the peer's word, only taken over loopback)
+            int local = (messenger->hostId[0]!='\0' && shm_isLocalPeer(conn->socket));
+            if(local && conn->shm.rx==NULL && sscanf(data, "host %39s", hostId)==1
+                    && strcmp(hostId, messenger->hostId)==0)
+                messenger_shm_start(messenger, conn);
+
+            // Peer's ring: send through it from now on (TCP if it can't be opened)
+            if(local && conn->shm.tx==NULL && sscanf(data, "shm %d %d", &pid, &fd)==2)
+                shm_attach(&(conn->shm), pid, fd);
+
+            // Peer stamps messages and keeps history: reconcile what either side missed
+            if(!conn->syncPeer && strcmp(data, "sync 1")==0) {
+                conn->syncPeer = 1;
+                messenger_sync_start(messenger, conn);
+            }
+        } break;
+    }
+}
+
+void messenger_conn_hello(MESSENGER *messenger, CONNECTION *conn, char *target) {
+    // Identity we want to reach (if the peer hosts many), username, then transports
+    if(target!=NULL && target[0]!='\0')
+        messenger_msg_sendFrame(messenger, conn, MSGTYPE_TARGET, target, strlen(target));
+    messenger_msg_sendFrame(messenger, conn, MSGTYPE_USERNAME, messenger->username, strlen(messenger->username));
+    messenger_conn_offerTransports(messenger, conn);
+}
+
+void messenger_conn_offerTransports(MESSENGER *messenger, CONNECTION *conn) {
+    // Peers that don't support a transport ignore it and keep using TCP
+    char offer[64];
+    if(messenger->udp.running) {
+        sprintf(offer, "udp %d", udp_getPort(&(messenger->udp)));
+        messenger_msg_sendFrame(messenger, conn, MSGTYPE_TRANSPORT, offer, strlen(offer));
+    }
+    if(messenger->hostId[0]!='\0' && shm_isLocalPeer(conn->socket)) {
+        sprintf(offer, "host %s", messenger->hostId);
+        messenger_msg_sendFrame(messenger, conn, MSGTYPE_TRANSPORT, offer, strlen(offer));
+    }
+    messenger_msg_sendFrame(messenger, conn, MSGTYPE_TRANSPORT, "sync 1", 6);
+}
+
+void messenger_poll_readable(MESSENGER *messenger, CONNECTION *conn) {
+    messenger_lock(messenger);
+
+    // Stopped or paused since epoll reported it
+    if(messenger_conn_getConnPos(messenger, conn)!=-1 && conn->pausedUntil==0)
+        messenger_poll_handle(messenger, conn);
+
+    messenger_unlock(messenger);
+}
+
+void messenger_poll_handle(MESSENGER *messenger, CONNECTION *conn) {
+    // Called with the lock, conn in the list
+    uint64_t span = trace_begin();
+    int retn = messenger_poll_recv(messenger, conn, &(messenger->pollInbox));
+    trace_end("recv", span);
+
+    // Handle messages, control frames first
+    LANE_FRAME *frame = NULL;
+    while((frame = lanes_pop(&(messenger->pollInbox)))!=NULL) {
+        span = trace_begin();
+        messenger_conn_dispatch(messenger, conn, frame->data[0], frame->data+1, frame->size-2);
+        trace_end("dispatch", span);
+        free(frame);
+    }
+
+    // Disconnected, or failed (would be reported again on every spin)
+    if(retn<=0) {
+        if(retn==-1)
+            printf(">> MESSENGER: Failed to receive message (%s)!\n", strerror(errno));
+        int pos = messenger_conn_getConnPos(messenger, conn);
+        if(pos!=-1) {
+            messenger_notify(messenger, MESSENGER_EVENT_DISCONNECTED, conn, conn->username);
+            poller_remove(messenger->io, conn->socket);
+            client_disconnect(conn->socket);
+            messenger_conn_remove(messenger, pos);
+        }
+    }
+}
+
+void messenger_poll_start(MESSENGER *messenger) {
+    // I/O thread up before the first connection: spinning (low latency) or sleeping in epoll (event loop)
+    CONFIG *config = &(messenger->config);
+    if(!config->lowLatency && !config->eventLoop)
+        return;
+
+    // Tenant of a node: its I/O thread is shared
+    if(messenger->io!=&(messenger->poller))
+        return;
+
+    poller_prefault(messenger->pollBuffer, POLL_RX_SIZE);
+    int retn = poller_start(&(messenger->poller), (config->lowLatency? config->cpu : -1), (config->lowLatency? 0 : POLLER_WAIT));
+    if(retn==-1)
+        printf(">> %s mode disabled.\n>> Error: %s.\n", (config->lowLatency? "Low-latency" : "Event-loop"), strerror(errno));
+    else if(retn==0)
+        printf(">> Low-latency I/O thread not pinned to CPU %d.\n>> Error: %s.\n", config->cpu, strerror(errno));
+}
+
+void messenger_poll_spin(MESSENGER *messenger) {
+    // New connections are registered as soon as the server accepts them
+    if(server_hasNewConnections(&(messenger->server)))
+        messenger_acceptPending(messenger);
+
+    // Peers over the rate limit, back once their buckets refill
+    if(__sync_fetch_and_add(&(messenger->numPaused), 0)>0)
+        messenger_poll_resume(messenger);
+}
+
+void messenger_poll_pause(MESSENGER *messenger, CONNECTION *conn, double wait) {
+    // Called with the lock: out of epoll, what it sends waits in the socket (backpressure)
+    if(conn->pausedUntil>0)
+        return;
+    poller_remove(messenger->io, conn->socket);
+    conn->pausedUntil = timer_nowmsec() + wait;
+    __sync_fetch_and_add(&(messenger->numPaused), 1);
+}
+
+void messenger_poll_resume(MESSENGER *messenger) {
+    messenger_lock(messenger);
+
+    // Backwards: handling may remove the connection
+    double now = timer_nowmsec();
+    int i=0;
+    for(i=messenger->numConn-1; i>=0; i--) {
+        if(i>=messenger->numConn)
+            continue;
+        CONNECTION *conn = messenger->conn[i];
+        if(conn->pausedUntil==0 || now < conn->pausedUntil)
+            continue;
+        conn->pausedUntil = 0;
+        __sync_fetch_and_sub(&(messenger->numPaused), 1);
+        poller_add(messenger->io, conn->socket, conn);
+
+        // Frames it kept: epoll only reports new data
+        if(conn->rxSize>0)
+            messenger_poll_handle(messenger, conn);
+    }
+
+    messenger_unlock(messenger);
+}
+
+int messenger_poll_recv(MESSENGER *messenger, CONNECTION *conn, LANES *inbox) {
+    // Frames kept by the connection, then what the socket holds, never waiting (the socket itself stays blocking for senders)
+    char *buffer = messenger->pollBuffer;
+    if(conn->rxSize>0)
+        memcpy(buffer, conn->rxBuffer, conn->rxSize);
+    int retn = 0;
+    if(conn->rxSize<POLL_RX_SIZE) {
+        retn = recv(conn->socket, buffer+conn->rxSize, POLL_RX_SIZE-conn->rxSize, MSG_DONTWAIT);
+        if(retn==0)
+            return 0;
+        if(retn==-1 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)
+            return -1;
+        if(retn==-1)
+            retn = 0;
+        else if(messenger->config.lowLatency)
+            poller_quickAck(conn->socket);
+    }
+
+    // Whole frames, kept as type + data + '\0'
+    char frame[MSG_MAX_SIZE+2];
+    unsigned char *p = (unsigned char*)buffer;
+    int left = conn->rxSize + retn;
+    double wait = 0;
+    while(1) {
+        // Rest of an oversized frame
+        if(conn->rxSkip>0) {
+            int skip = (conn->rxSkip<left? conn->rxSkip : left);
+            p += skip;
+            left -= skip;
+            conn->rxSkip -= skip;
+            if(conn->rxSkip>0)
+                break;
+        }
+
+        if(left<MSG_HEADER_SIZE)
+            break;
+        int size = (p[1] << 8) | p[2];
+        int keep = (size>MSG_MAX_SIZE? MSG_MAX_SIZE : size); // what does not fit is dropped
+        if(left<MSG_HEADER_SIZE+keep)
+            break;
+
+        frame[0] = p[0];
+        memcpy(frame+1, p+MSG_HEADER_SIZE, keep);
+        frame[keep+1] = '\0';
+        wait = messenger_conn_account(messenger, conn, keep+1);
+        capture_frame(&(messenger->capture), conn->captureId, CAPTURE_IN, frame[0], frame+1, keep);
+        lanes_push(inbox, messenger_msg_lane(frame[0]), frame, keep+2);
+
+        p += MSG_HEADER_SIZE+keep;
+        left -= MSG_HEADER_SIZE+keep;
+        conn->rxSkip = size-keep;
+
+        // Over the rate limit: the rest waits with the connection
+        if(wait>0)
+            break;
+    }
+
+    // Partial frame, or frames over the rate limit, kept at their size: idle peers hold no buffer
+    if(left==0) {
+        free(conn->rxBuffer);
+        conn->rxBuffer = NULL;
+    } else {
+        conn->rxBuffer = realloc(conn->rxBuffer, left);
+        memcpy(conn->rxBuffer, p, left);
+    }
+    conn->rxSize = left;
+
+    // Over the rate limit: the I/O thread serves everybody, so it stops reading this peer instead of sleeping
+    if(wait>0 && conn->polled)
+        messenger_poll_pause(messenger, conn, wait);
 
-            case MSGTYPE_MSG: {
-                connection_pushMessage(conn, data);
-            } break;
+    return 1;
+}
+
+void messenger_udp_receive(MESSENGER *messenger, int peerId, char *data, int size) {
+    // Datagram holds one encoded frame
+    if(size<MSG_HEADER_SIZE) {
+        stats_add(&(messenger->stats.udpMalformed), 1);
+        return;
+    }
+    int dataSize = (((unsigned char)data[1]) << 8) | (unsigned char)data[2];
+    if(dataSize > size-MSG_HEADER_SIZE || dataSize > MSG_MAX_SIZE) {
+        stats_add(&(messenger->stats.udpMalformed), 1);
+        return;
+    }
+
+    char frame[MSG_MAX_SIZE+1];
+    memcpy(frame, data+MSG_HEADER_SIZE, dataSize);
+    frame[dataSize] = '\0';
+
+    messenger_lock(messenger);
+
+    CONNECTION *conn = messenger_conn_getConnByUdpPeer(messenger, peerId);
+    if(conn!=NULL) {
+        // Same buckets as TCP; over budget the peer's next datagrams are refused, not slept on
+        double wait = messenger_conn_account(messenger, conn, dataSize+1);
+        if(wait>0)
+            udp_pause(&(messenger->udp), peerId, wait);
+        capture_frame(&(messenger->capture), conn->captureId, CAPTURE_IN, data[0], frame, dataSize);
+        uint64_t span = trace_begin();
+        messenger_conn_dispatch(messenger, conn, data[0], frame, dataSize);
+        trace_end("dispatch", span);
+    }
+
+    messenger_unlock(messenger);
+}
+
+void messenger_udp_failure(MESSENGER *messenger, int peerId, char *data, int size) {
+    messenger_lock(messenger);
+
+    // Not acked after all retries: fall back to TCP. Delivery is at-least-once,
+    // if only the acks were lost the peer gets this frame twice
+    CONNECTION *conn = messenger_conn_getConnByUdpPeer(messenger, peerId);
+    if(conn!=NULL) {
+        stats_add(&(messenger->stats.udpFallbacks), 1);
+        connection_queueFrame(conn, messenger_msg_lane(data[0]), data, size);
+        connection_flush(conn);
+    }
+
+    messenger_unlock(messenger);
+}
+
+void messenger_shm_start(MESSENGER *messenger, CONNECTION *conn) {
+    if(shm_create(&(conn->shm))==-1)
+        return;
+
+    // Args are freed by the reader thread
+    PTHREAD_CONN_ARG *args = malloc(sizeof(PTHREAD_CONN_ARG));
+    args->messenger = messenger;
+    args->conn = conn;
+    messenger_startThread(&(conn->shm.thread), (void*)messenger_shm_run, (void*)args);
+
+    // Peer opens our ring through /proc
+    char offer[64];
+    sprintf(offer, "shm %d %d", getpid(), conn->shm.rxFd);
+    messenger_msg_sendFrame(messenger, conn, MSGTYPE_TRANSPORT, offer, strlen(offer));
+}
+
+void messenger_shm_run(PTHREAD_CONN_ARG *args) {
+    // Parse args
+    MESSENGER *messenger = args->messenger;
+    CONNECTION *conn = args->conn;
+    free(args);
+
+    // Buffer (type + data + '\0')
+    char recvBuffer[MSG_MAX_SIZE+2];
+
+    // Received frames by priority lane
+    LANES inbox;
+    lanes_init(&inbox, messenger->config.weightControl, messenger->config.weightData);
+
+    trace_threadName("shm");
+
+    // Reader thread, stopped by messenger_shm_stop (TCP still tells when the peer leaves)
+    while(1) {
+        shm_wait(&(conn->shm), SHM_WAIT_TIME);
+        pthread_testcancel();
+
+        uint64_t span = trace_begin();
+        int retn = 0;
+        while(inbox.numFrames<RECV_BATCH && (retn = messenger_shm_recv(messenger, conn, &inbox, recvBuffer))>0);
+        if(inbox.numFrames==0 && retn!=-1) // woke up by timeout
+            continue;
+        trace_end("recv", span);
+
+        messenger_lock(messenger);
+
+        // Handle messages, control frames first
+        LANE_FRAME *frame = NULL;
+        while((frame = lanes_pop(&inbox))!=NULL) {
+            span = trace_begin();
+            messenger_conn_dispatch(messenger, conn, frame->data[0], frame->data+1, frame->size-2);
+            trace_end("dispatch", span);
+            free(frame);
         }
 
-        pthread_mutex_unlock(&(messenger->mutex));
+        messenger_unlock(messenger);
+
+        // Corrupt record: the ring can't be read past it, drop the connection (its reader cleans up)
+        if(retn==-1) {
+            shutdown(conn->socket, SHUT_RDWR);
+            break;
+        }
     }
+}
+
+int messenger_shm_recv(MESSENGER *messenger, CONNECTION *conn, LANES *inbox, char *buffer) {
+    // Record holds one encoded frame
+    char record[MSG_HEADER_SIZE+MSG_MAX_SIZE];
+    int size = shm_recv(&(conn->shm), record, sizeof(record));
+    if(size<MSG_HEADER_SIZE)
+        return (size<=0? size : -1);
+    int dataSize = (((unsigned char)record[1]) << 8) | (unsigned char)record[2];
+    if(dataSize > size-MSG_HEADER_SIZE)
+        return -1;
+
+    // Frame is kept as type + data + '\0'
+    buffer[0] = record[0];
+    memcpy(buffer+1, record+MSG_HEADER_SIZE, dataSize);
+    buffer[dataSize+1] = '\0';
+
+    // Over the rate limit: the reader thread holds no lock, the ring fills up (backpressure)
+    double wait = messenger_conn_account(messenger, conn, dataSize+1);
+    if(wait>0)
+        msleep(wait);
+    capture_frame(&(messenger->capture), conn->captureId, CAPTURE_IN, record[0], buffer+1, dataSize);
+
+    lanes_push(inbox, messenger_msg_lane(record[0]), buffer, dataSize+2);
+    return dataSize+1;
+}
+
+void messenger_shm_stop(MESSENGER *messenger, CONNECTION *conn) {
+    // Reader wakes up at least every SHM_WAIT_TIME to be cancelled
+    if(conn->shm.rx!=NULL)
+        messenger_joinThread(messenger, conn->shm.thread);
+    shm_close(&(conn->shm));
+}
 
+void messenger_shm_retry(MESSENGER *messenger) {
+    // Outboxes waiting for room in a peer's ring (with the lock, every loop)
+    int i=0;
+    for(i=0; i<messenger->numConn; i++) {
+        CONNECTION *conn = messenger_conn_getConnByPos(messenger, i);
+        if(conn->shmFullSince>0)
+            connection_flush(conn);
+    }
 }
 
 void messenger_stop(MESSENGER *messenger) {
-    // Stop messenger thread
-    pthread_cancel(messenger->thread);
-    pthread_join(messenger->thread, NULL);
+    // Stop messenger thread (tenants have none)
+    if(!messenger->hosted)
+        messenger_joinThread(messenger, messenger->thread);
+
+    // Save state for next run
+    if(messenger_snapshot_save(messenger)==-1)
+        printf(">> Failed to save Messenger state (%s)!\n", strerror(errno));
 
     // Stop server
-    server_stop(&(messenger->server));
+    if(!messenger->hosted)
+        server_stop(&(messenger->server));
 
-    // Stop connections
-    int i=0;
-    for(i=0; i<messenger->numConn; i++)
-        messenger_stopConn(messenger, i);
+    // Stop UDP transport and I/O thread (they may be waiting for the lock)
+    pthread_mutex_unlock(&(messenger->mutex));
+    udp_stop(&(messenger->udp));
+    poller_stop(&(messenger->poller));
+    pthread_mutex_lock(&(messenger->mutex));
+
+    // Say goodbye, then stop connections
+    messenger_gossip_leave(messenger);
+    while(messenger->numConn>0)
+        messenger_stopConn(messenger, messenger->numConn-1); // last first: nothing to shift
+
+    capture_close(&(messenger->capture));
+}
+
+int messenger_connect(MESSENGER *messenger, char *addr, char name[32]) {
+    // Called without the lock: ip or username@ip (identity on a shared node)
+    // Contact's username copied to name (if not NULL): the connection may be gone once unlocked
+    char target[32] = "";
+    char ip[16];
+    char *at = strchr(addr, '@');
+    char *host = (at!=NULL? at+1 : addr);
+    if(at!=NULL) {
+        int len = at-addr;
+        if(len>31)
+            len = 31;
+        memcpy(target, addr, len);
+        target[len] = '\0';
+    }
+
+    // Dotted quad at most, as connections keep it
+    if(strlen(host)>15) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(ip, host);
+
+    // Check if is already connected
+    messenger_lock(messenger);
+    CONNECTION *conn = (target[0]!='\0'? messenger_conn_getConnByAddr(messenger, ip, target) : messenger_conn_getConnByIP(messenger, ip));
+    if(conn!=NULL && name!=NULL)
+        strcpy(name, conn->username);
+    messenger_unlock(messenger);
+    if(conn!=NULL)
+        return 0;
+
+    // Connect (may block up to the TCP timeout: no lock held)
+    int sock = client_connect(ip, MESSENGER_SERVER_PORT);
+    if(sock<0)
+        return -1;
+
+    messenger_lock(messenger);
+    conn = connection_new(sock, ip, "Unknown contact");
+
+    // Add to list
+    messenger_snapshot_claim(messenger, conn);
+    messenger_conn_add(messenger, conn);
+
+    // Start thread
+    messenger_conn_start(messenger, conn);
+
+    // Send username
+    messenger_conn_hello(messenger, conn, target);
+    if(name!=NULL)
+        strcpy(name, conn->username);
+    messenger_unlock(messenger);
+
+    return 1;
+}
+
+int messenger_notify(MESSENGER *messenger, int event, CONNECTION *conn, char *text) {
+    if(messenger->listener==NULL)
+        return 0;
+    return messenger->listener(messenger->listenerArg, event, conn, text);
 }
 
 void messenger_stopConn(MESSENGER *messenger, int pos) {
-    // Get conn
+    // Get conn and take it out of the list
     CONNECTION *conn = messenger_conn_getConnByPos(messenger, pos);
+    messenger_conn_detach(messenger, pos);
 
-    // Thread
-    pthread_cancel(conn->thread);
-    pthread_join(conn->thread, NULL);
+    // Thread, or the I/O thread's interest
+    if(conn->polled)
+        poller_remove(messenger->io, conn->socket);
+    else
+        messenger_joinThread(messenger, conn->thread);
 
     // Socket
     client_disconnect(conn->socket);
 
-    // Remove from list
-    messenger_conn_remove(messenger, pos);
+    // Free
+    connection_destroy(conn);
+}
+
+void messenger_joinThread(MESSENGER *messenger, pthread_t thread) {
+    // Threads only accept cancellation outside the lock, so release it while joining
+    pthread_cancel(thread);
+    pthread_mutex_unlock(&(messenger->mutex));
+    pthread_join(thread, NULL);
+    pthread_mutex_lock(&(messenger->mutex));
+}
+
+void messenger_lock(MESSENGER *messenger) {
+    uint64_t span = trace_begin();
+    pthread_mutex_lock(&(messenger->mutex));
+    trace_end("lock wait", span);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+}
+
+void messenger_unlock(MESSENGER *messenger) {
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    pthread_mutex_unlock(&(messenger->mutex));
 }
 
 void messenger_destroy(MESSENGER *messenger) {
@@ -178,12 +862,27 @@ void messenger_destroy(MESSENGER *messenger) {
     server_destroy(&(messenger->server));
 
     // Free connections
-    int i=0;
-    for(i=0; i<messenger->numConn; i++) {
-        CONNECTION *conn = messenger_conn_getConnByPos(messenger, i);
-        pthread_mutex_destroy(&(conn->mutex));
-        free(conn);
-    }
+    while(messenger->numConn>0)
+        messenger_conn_remove(messenger, messenger->numConn-1);
+
+    // Destroy history
+    history_destroy(&(messenger->history));
+
+    // Destroy restore state
+    snapshot_destroy(&(messenger->restore));
+
+    // Destroy UDP transport
+    udp_destroy(&(messenger->udp));
+
+    // Destroy directory
+    gossip_destroy(&(messenger->gossip));
+
+    // Close capture
+    capture_destroy(&(messenger->capture));
+
+    // Destroy I/O thread
+    poller_destroy(&(messenger->poller));
+    lanes_destroy(&(messenger->pollInbox));
 
     pthread_mutex_destroy(&(messenger->mutex));
 }
@@ -191,21 +890,20 @@ void messenger_destroy(MESSENGER *messenger) {
 void messenger_menu(MESSENGER *messenger) {
     int running = 1;
 
-    // Messenger menu loop
+    // Messenger menu loop (input is read without the lock)
     while(running) {
         __fpurge(stdin);
-        system("clear");
+        messenger_menu_clear();
         printf("################# Main menu #################\n");
         printf("Hello, %s.\n\n", messenger->username);
-        printf("1- Add contact\n2- Contact list\n3- Delete contact\n4- Send message\n5- Send group message\n6- Check new messages\n7- Quit\n");
+        printf("1- Add contact\n2- Contact list\n3- Delete contact\n4- Send message\n5- Send group message\n6- Check new messages\n7- Search messages\n8- Statistics\n");
+        printf(messenger->hosted? "9- Switch identity\n" : "9- Quit\n");
         printf("\nChoose option: ");
 
         int option = getchar();
         __fpurge(stdin);
-        if(option!='7')
-            system("clear");
-
-        pthread_mutex_lock(&(messenger->mutex));
+        if(option!='9')
+            messenger_menu_clear();
 
         int invalidOption = 0;
         switch (option) {
@@ -228,7 +926,18 @@ void messenger_menu(MESSENGER *messenger) {
                 messenger_menu_checkMessages(messenger);
                 break;
             case '7':
-                messenger_stop(messenger);
+                messenger_menu_searchMessages(messenger);
+                break;
+            case '8':
+                messenger_menu_statistics(messenger);
+                break;
+            case '9':
+                // Tenants keep running, the node stops them
+                if(!messenger->hosted) {
+                    messenger_lock(messenger);
+                    messenger_stop(messenger);
+                    messenger_unlock(messenger);
+                }
                 running = 0;
                 break;
             default:
@@ -236,105 +945,125 @@ void messenger_menu(MESSENGER *messenger) {
                 break;
         }
 
-        pthread_mutex_unlock(&(messenger->mutex));
-
         // Show only in valid options
-        if(!invalidOption && option!='7') {
+        if(!invalidOption && option!='9') {
             printf("\nPress <ENTER> to go back to menu...");
             getchar();
         }
 
     }
 
-    printf("\nSee you, %s!\n\n", messenger->username);
+    if(!messenger->hosted)
+        printf("\nSee you, %s!\n\n", messenger->username);
 }
 
-int messenger_menu_chooseContact(MESSENGER *messenger) {
+void messenger_menu_clear(void) {
+    // ANSI clear screen, instead of running clear(1)
+    printf("\033[H\033[2J");
+}
+
+int messenger_menu_readLine(char *prompt, char dest[], int size) {
+    // Read a line without the '\n', returns its length
+    if(prompt!=NULL)
+        printf("%s", prompt);
+    __fpurge(stdin);
+    if(fgets(dest, size, stdin)==NULL)
+        dest[0] = '\0';
+    dest[strcspn(dest, "\n")] = '\0';
+    __fpurge(stdin);
+    return strlen(dest);
+}
+
+void messenger_menu_printContacts(MESSENGER *messenger) {
+    // Called with the lock
+    int i;
+    for(i=0; i<messenger->numConn; i++)
+        printf("%d- %s (%s)\n", i+1, messenger->conn[i]->username, messenger->conn[i]->ip);
+}
+
+void messenger_menu_printDirectory(MESSENGER *messenger) {
+    // Online identities we are not connected to (with the lock)
+    GOSSIP *gossip = &(messenger->gossip);
+    const double now = timer_nowmsec();
+    int i=0, count=0;
+    for(i=0; i<gossip->numRecords; i++) {
+        GOSSIP_RECORD *record = &(gossip->records[i]);
+        if(!gossip_isOnline(record, now) || messenger_conn_getConnByAddr(messenger, record->ip, record->username)!=NULL)
+            continue;
+        if(count++==0)
+            printf("\nAlso online (add them as user@ip):\n\n");
+        printf("  %s@%s\n", record->username, record->ip);
+    }
+}
+
+CONNECTION* messenger_menu_chooseContact(MESSENGER *messenger) {
+    messenger_lock(messenger);
+
     // Check no contacts
     if(messenger->numConn==0) {
+        messenger_unlock(messenger);
         printf("You have no contacts!\n");
         printf("Use option (1) to add a contact.\n");
-        return -1;
+        return NULL;
     }
 
     // Show contacts
     printf("Contact list:\n");
-    int i;
-    for(i=0; i<messenger->numConn; i++)
-        printf("%d- %s (%s)\n", i+1, messenger->conn[i]->username, messenger->conn[i]->ip);
+    messenger_menu_printContacts(messenger);
+    messenger_unlock(messenger);
 
-    // Choose contact
-    int contact=0;
-    do {
+    // Choose contact (the list may change meanwhile: checked under the lock)
+    CONNECTION *conn = NULL;
+    while(conn==NULL) {
+        int contact=0;
         __fpurge(stdin);
         printf("\n>> Choose contact (0 to exit): ");
-        scanf("%d", &contact);
+        if(scanf("%d", &contact)!=1)
+            contact = -1;
         __fpurge(stdin);
         if(contact==0)
-            break;
-    } while(contact>messenger->numConn);
+            return NULL;
+
+        messenger_lock(messenger);
+        if(contact>=1 && contact<=messenger->numConn)
+            conn = messenger_conn_getConnByPos(messenger, contact-1);
+        messenger_unlock(messenger);
+    }
 
-    return contact-1;
+    // May be gone by the time it is used: check with messenger_conn_getConnPos
+    return conn;
 }
 
 void messenger_menu_addContact(MESSENGER *messenger) {
     printf("################# Add contact #################\n");
-    printf("Type your contact's IP address (0 to exit): ");
 
     // Read contact IP address
-    char ip[17];
-    __fpurge(stdin);
-    fgets(ip, 17, stdin);
-    ip[strlen(ip)-1] = '\0';
+    char addr[64];
+    messenger_menu_readLine("Type your contact's IP address, or username@IP on a shared node (0 to exit): ", addr, sizeof(addr));
 
     // Check exit
-    if(strcmp(ip, "")==0 || strcmp(ip, "0")==0)
+    if(strcmp(addr, "")==0 || strcmp(addr, "0")==0)
         return;
 
     printf(">> Connecting...\n");
 
+    char name[32];
+    int retn = messenger_connect(messenger, addr, name);
+
     // Check if is already connected
-    if(messenger_conn_connected2(messenger, ip)) {
-        CONNECTION *conn = messenger_conn_getConnByIP(messenger, ip);
-        printf(">> You are already connected to %s (%s).\n", conn->username, conn->ip);
+    if(retn==0) {
+        printf(">> You are already connected to %s (%s).\n", name, addr);
         return;
     }
 
-    CONNECTION *newConn=NULL;
-    int connected = 0;
-
-    // Connect
-    int sock = client_connect(ip, MESSENGER_SERVER_PORT);
-    if(sock>=0) {
-        newConn = connection_new(sock, ip, "Unknown contact");
-        connected = 1;
-    }
-
     // If connected
-    if(connected) {
-        // Add to list
-        messenger_conn_add(messenger, newConn);
-
-        // Start thread
-        CONNECTION *conn = messenger_conn_getConnByIP(messenger, ip);
-
-        PTHREAD_CONN_ARG args;
-        args.messenger = messenger;
-        args.conn = conn;
-        pthread_create(&(conn->thread), NULL, (void*)messenger_conn_run, (void*)&args);
-
-        // Send username
-        char sendBuffer[33];
-        int msgSize = messenger_msg_encode(MSGTYPE_USERNAME, messenger->username, strlen(messenger->username), sendBuffer);
-        send(conn->socket, sendBuffer, msgSize, 0);
-
+    if(retn==1) {
         printf(">> Successfully connected.\n");
-
         return;
     }
 
     // Failed to connect
-    printf(">> Failed to connect to %s!\n", ip);
+    printf(">> Failed to connect to %s!\n", addr);
     printf(">> The contact is probably offline.\n");
     printf(">> Error: %s.\n", strerror(errno));
 }
@@ -342,31 +1071,35 @@ void messenger_menu_addContact(MESSENGER *messenger) {
 void messenger_menu_listContacts(MESSENGER *messenger) {
     printf("################# Contact list #################\n");
 
+    messenger_lock(messenger);
+
     // Check no contatcs
     if(messenger->numConn==0) {
         printf("You have no contacts!\n");
         printf("Use option (1) to add a contact.\n");
-        return;
     } else {
         printf("Here are your contacts, %s:\n\n", messenger->username);
+        messenger_menu_printContacts(messenger);
     }
+    messenger_menu_printDirectory(messenger);
 
-    // Show contacts
-    int i;
-    for(i=0; i<messenger->numConn; i++)
-        printf("%d- %s (%s)\n", i+1, messenger->conn[i]->username, messenger->conn[i]->ip);
+    messenger_unlock(messenger);
 }
 
 void messenger_menu_deleteContact(MESSENGER *messenger) {
     printf("################# Delete contact #################\n");
 
     // Choose contact
-    int pos = messenger_menu_chooseContact(messenger);
-    if(pos==-1)
+    CONNECTION *conn = messenger_menu_chooseContact(messenger);
+    if(conn==NULL)
         return;
 
     // Stop conn
-    messenger_stopConn(messenger, pos);
+    messenger_lock(messenger);
+    int pos = messenger_conn_getConnPos(messenger, conn);
+    if(pos!=-1)
+        messenger_stopConn(messenger, pos);
+    messenger_unlock(messenger);
 
     printf(">> Contact deleted.\n");
 }
@@ -375,33 +1108,39 @@ void messenger_menu_sendMessage(MESSENGER *messenger) {
     printf("################# Send message #################\n");
 
     // Choose contact
-    int pos = messenger_menu_chooseContact(messenger);
-    if(pos==-1)
+    CONNECTION *conn = messenger_menu_chooseContact(messenger);
+    if(conn==NULL)
         return;
 
-    // Get connection
-    CONNECTION *conn = messenger_conn_getConnByPos(messenger, pos);
-
+    messenger_lock(messenger);
+    if(messenger_conn_getConnPos(messenger, conn)==-1) {
+        messenger_unlock(messenger);
+        printf(">> Contact disconnected.\n");
+        return;
+    }
     printf(">> Type message to %s (%s):\n", conn->username, conn->ip);
+    messenger_unlock(messenger);
     printf(">> Press single <ENTER> to stop.\n");
     while(1) {
 
         // Read message to send
-        __fpurge(stdin);
-        char msg[128];
-        fgets(msg, 128, stdin);
-        msg[strlen(msg)-1] = '\0';
-        __fpurge(stdin);
-
-        // Check <ENTER>
-        if(msg[0]=='\0')
+        char msg[MSG_MAX_SIZE+1];
+        if(messenger_menu_readLine(NULL, msg, sizeof(msg))==0)
             break;
 
-        char sendBuffer[129];
+        // Send, if still connected
+        messenger_lock(messenger);
+        int connected = (messenger_conn_getConnPos(messenger, conn)!=-1);
+        if(connected) {
+            messenger_msg_send(messenger, conn, msg);
+            messenger_msg_flush(messenger);
+        }
+        messenger_unlock(messenger);
 
-        // Send
-        int msgSize = messenger_msg_encode(MSGTYPE_MSG, msg, strlen(msg), sendBuffer);
-        send(conn->socket, sendBuffer, msgSize, 0);
+        if(!connected) {
+            printf(">> Contact disconnected.\n");
+            return;
+        }
     }
 
     // Check retn
@@ -411,8 +1150,11 @@ void messenger_menu_sendMessage(MESSENGER *messenger) {
 void messenger_menu_sendGroupMessage(MESSENGER *messenger) {
     printf("################# Send group message #################\n");
 
+    messenger_lock(messenger);
+
     // Check no contatcs
     if(messenger->numConn==0) {
+        messenger_unlock(messenger);
         printf("You have no contacts!\n");
         printf("Use option (1) to add a contact.\n");
         return;
@@ -420,16 +1162,12 @@ void messenger_menu_sendGroupMessage(MESSENGER *messenger) {
 
     // Show contacts
     printf("Contact list:\n");
-    int i;
-    for(i=0; i<messenger->numConn; i++)
-        printf("%d- %s (%s)\n", i+1, messenger->conn[i]->username, messenger->conn[i]->ip);
+    messenger_menu_printContacts(messenger);
+    messenger_unlock(messenger);
 
     // Choose contacts
-    printf("\n>> Choose up to 5 contacts, separated by space (0 to exit): ");
     char buf[32];
-    __fpurge(stdin);
-    fgets(buf, 32, stdin);
-    __fpurge(stdin);
+    messenger_menu_readLine("\n>> Choose up to 5 contacts, separated by space (0 to exit): ", buf, sizeof(buf));
 
     // Parse
     int contacts[5];
@@ -440,27 +1178,23 @@ void messenger_menu_sendGroupMessage(MESSENGER *messenger) {
     while(1) {
 
         // Read message to send
-        __fpurge(stdin);
-        char msg[128];
-        fgets(msg, 128, stdin);
-        msg[strlen(msg)-1] = '\0';
-        __fpurge(stdin);
-
-        // Check <ENTER>
-        if(msg[0]=='\0')
+        char msg[MSG_MAX_SIZE+1];
+        if(messenger_menu_readLine(NULL, msg, sizeof(msg))==0)
             break;
 
-        char sendBuffer[129];
+        messenger_lock(messenger);
+        int i;
         for(i=0; i<numGroup; i++) {
             int pos = contacts[i]-1;
-            if(pos>=messenger->numConn)
+            if(pos<0 || pos>=messenger->numConn)
                 continue;
             CONNECTION *conn = messenger_conn_getConnByPos(messenger, pos);
 
             // Send
-            int msgSize = messenger_msg_encode(MSGTYPE_MSG, msg, strlen(msg), sendBuffer);
-            send(conn->socket, sendBuffer, msgSize, 0);
+            messenger_msg_send(messenger, conn, msg);
         }
+        messenger_msg_flush(messenger);
+        messenger_unlock(messenger);
 
     }
 
@@ -470,6 +1204,8 @@ void messenger_menu_sendGroupMessage(MESSENGER *messenger) {
 void messenger_menu_checkMessages(MESSENGER *messenger) {
     printf("################# New messages #################\n");
 
+    messenger_lock(messenger);
+
     // Check connection list
     int i;
     int hasMessages = 0;
@@ -481,9 +1217,10 @@ void messenger_menu_checkMessages(MESSENGER *messenger) {
             hasMessages = 1;
 
             // Pop message
-            char msg[1024];
+            char msg[MSG_MAX_SIZE+1];
             time_t time;
-            connection_popMessage(conn, msg, &time);
+            if(connection_popMessage(conn, msg, sizeof(msg), &time)==-1)
+                break;
 
             // Convert time to str
             struct tm *timeinfo = localtime(&time);
@@ -495,11 +1232,127 @@ void messenger_menu_checkMessages(MESSENGER *messenger) {
         }
     }
 
+    messenger_unlock(messenger);
+
     // No messages
     if(!hasMessages)
         printf("%s, you don't have new messages.\n", messenger->username);
 }
 
+void messenger_menu_searchMessages(MESSENGER *messenger) {
+    printf("################# Search messages #################\n");
+
+    // Read query
+    char query[MSG_MAX_SIZE+1];
+    messenger_menu_readLine("Type words to search (0 to exit): ", query, sizeof(query));
+
+    // Check exit
+    if(strcmp(query, "")==0 || strcmp(query, "0")==0)
+        return;
+
+    // Read time filter
+    int days=0;
+    printf("Only messages from the last N days (0 for all): ");
+    scanf("%d", &days);
+    __fpurge(stdin);
+
+    time_t to = time(NULL);
+    time_t from = (days>0? to - (time_t)days*24*60*60 : 0);
+
+    // Search (entries may move while messages arrive: read them with the lock)
+    messenger_lock(messenger);
+    TIMER t;
+    INDEX_RESULT results[SEARCH_MAX_RESULTS];
+    timer_start(&t);
+    int num = history_search(&(messenger->history), query, from, to, results, SEARCH_MAX_RESULTS);
+    timer_stop(&t);
+
+    if(num==0) {
+        messenger_unlock(messenger);
+        printf("\nNo messages found (%.3f ms).\n", timer_timemsec(&t));
+        return;
+    }
+    printf("\nBest %d matches (%.3f ms):\n", num, timer_timemsec(&t));
+
+    // Show results
+    int i;
+    for(i=0; i<num; i++) {
+        HISTORY_ENTRY *entry = history_get(&(messenger->history), results[i].id);
+
+        // Convert time to str
+        struct tm *timeinfo = localtime(&(entry->time));
+        char timeStr[20];
+        strftime(timeStr, 20,"[%d/%m/%y %Hh%M]", timeinfo);
+
+        // Print
+        if(entry->direction==HISTORY_OUT)
+            printf("%s You -> %s (%s): %s\n", timeStr, entry->username, entry->ip, history_getText(&(messenger->history), results[i].id));
+        else
+            printf("%s %s (%s): %s\n", timeStr, entry->username, entry->ip, history_getText(&(messenger->history), results[i].id));
+    }
+
+    messenger_unlock(messenger);
+}
+
+void messenger_menu_statistics(MESSENGER *messenger) {
+    printf("################# Statistics #################\n");
+
+    messenger_lock(messenger);
+    messenger_printStatistics(messenger);
+    messenger_unlock(messenger);
+}
+
+void messenger_printStatistics(MESSENGER *messenger) {
+
+    // Totals
+    STATS *stats = &(messenger->stats);
+    printf("Received: %ld frames, %ld bytes\n", stats->framesIn, stats->bytesIn);
+    printf("Sent: %ld frames, %ld bytes\n", stats->framesOut, stats->bytesOut);
+    printf("Throttled: %ld times, %.1f ms\n", stats->throttleEvents, stats->throttleTime/1000.0);
+    printf("Filtered: %ld invalid, %ld muted\n", stats->rejected, stats->muted);
+    printf("Synced: %ld messages recovered on reconnect\n", stats->synced);
+    if(messenger->udp.running)
+        printf("UDP: %ld datagrams in, %ld out, %ld retransmits, %ld fallbacks to TCP, %ld oversized, %ld malformed\n",
+               messenger->udp.datagramsIn, messenger->udp.datagramsOut, messenger->udp.retransmits, stats->udpFallbacks,
+               messenger->udp.dropped, stats->udpMalformed);
+
+    // Unread backlog (memory is shared by all identities of the process)
+    int i, spilled = 0;
+    for(i=0; i<messenger->numConn; i++)
+        spilled += messenger->conn[i]->spill.numMessages;
+    printf("Inbox: %ld bytes unread in memory, %d messages on disk\n", connection_getInboxBytes(), spilled);
+
+    // Memory held for peers (kernel socket buffers aside; the pool is shared by all identities)
+    CONNECTION_POOL_STATS pool;
+    connection_poolStats(&pool);
+    int threads = 0;
+    for(i=0; i<messenger->numConn; i++)
+        threads += !messenger->conn[i]->polled + (messenger->conn[i]->shm.rx!=NULL);
+    printf("Memory: %ld bytes for %d peers, %d of %d pooled connections in use, %d reader threads (%d KB of stacks)\n",
+           messenger_memory(messenger), messenger->numConn, pool.used, pool.slots, threads, threads*(CONN_STACK_SIZE/1024));
+
+    // Per contact
+    if(messenger->numConn==0)
+        return;
+    printf("\nPer contact:\n");
+    for(i=0; i<messenger->numConn; i++) {
+        CONNECTION *conn = messenger_conn_getConnByPos(messenger, i);
+        stats = &(conn->stats);
+        char *transport = (conn->shm.tx!=NULL? "shm" : (conn->udpPeer!=-1? "udp" : "tcp"));
+        printf("%d- %s (%s, %s): in %ld/%ld, out %ld/%ld (frames/bytes), throttled %ld times (%.1f ms), memory %ld bytes\n", i+1, conn->username, conn->ip, transport,
+               stats->framesIn, stats->bytesIn, stats->framesOut, stats->bytesOut, stats->throttleEvents, stats->throttleTime/1000.0, connection_memory(conn));
+    }
+}
+
+long messenger_memory(MESSENGER *messenger) {
+    // Connections and the list pointing to them
+    long bytes = messenger->numConn*sizeof(CONNECTION*);
+    int i=0;
+    for(i=0; i<messenger->numConn; i++)
+        bytes += connection_memory(messenger->conn[i]);
+    return bytes;
+}
+
 int messenger_conn_connected2(MESSENGER *messenger, char ip[]) {
     // Check connection list
     int i;
@@ -518,6 +1371,15 @@ CONNECTION* messenger_conn_getConnByIP(MESSENGER *messenger, char ip[]) {
     return NULL;
 }
 
+CONNECTION* messenger_conn_getConnByAddr(MESSENGER *messenger, char ip[], char username[]) {
+    // Search on connection list, by IP and username (several identities may share an IP)
+    int i;
+    for(i=0; i<messenger->numConn; i++)
+        if(strcmp(messenger->conn[i]->ip, ip)==0 && strcmp(messenger->conn[i]->username, username)==0)
+            return messenger->conn[i];
+    return NULL;
+}
+
 int messenger_conn_getConnPosByIP(MESSENGER *messenger, char ip[]) {
     // Search on conn list, and return
     int i;
@@ -527,6 +1389,24 @@ int messenger_conn_getConnPosByIP(MESSENGER *messenger, char ip[]) {
     return -1;
 }
 
+int messenger_conn_getConnPos(MESSENGER *messenger, CONNECTION *conn) {
+    // Search on conn list, and return
+    int i;
+    for(i=0; i<messenger->numConn; i++)
+        if(messenger->conn[i]==conn)
+            return i;
+    return -1;
+}
+
+CONNECTION* messenger_conn_getConnByUdpPeer(MESSENGER *messenger, int peerId) {
+    // Search on conn list, and return
+    int i;
+    for(i=0; i<messenger->numConn; i++)
+        if(messenger->conn[i]->udpPeer==peerId)
+            return messenger->conn[i];
+    return NULL;
+}
+
 CONNECTION* messenger_conn_getConnByPos(MESSENGER *messenger, int pos) {
     // Check pos
     if(pos>=messenger->numConn)
@@ -545,6 +1425,7 @@ void messenger_conn_add(MESSENGER *messenger, CONNECTION *conn) {
 
     // Add element
     messenger->conn[newPos] = conn;
+    conn->captureId = capture_conn(&(messenger->capture), conn->ip);
 
     // Inc counter
     (messenger->numConn)++;
@@ -555,8 +1436,29 @@ void messenger_conn_remove(MESSENGER *messenger, int pos) {
     if(messenger->numConn==0)
         return;
 
-    // Free connection
-    free(messenger->conn[pos]);
+    // Remove from list, then free connection
+    CONNECTION *conn = messenger->conn[pos];
+    messenger_conn_detach(messenger, pos);
+    connection_destroy(conn);
+}
+
+void messenger_conn_detach(MESSENGER *messenger, int pos) {
+    // Check size
+    if(messenger->numConn==0)
+        return;
+
+    // Stop UDP traffic and capture
+    CONNECTION *conn = messenger->conn[pos];
+    capture_end(&(messenger->capture), conn->captureId);
+    conn->captureId = -1;
+    if(conn->pausedUntil>0) {
+        conn->pausedUntil = 0;
+        __sync_fetch_and_sub(&(messenger->numPaused), 1);
+    }
+    if(conn->udpPeer!=-1) {
+        udp_removePeer(&(messenger->udp), conn->udpPeer);
+        conn->udpPeer = -1;
+    }
 
     // Shift list and realloc
     int newListSize = messenger->numConn - 1;
@@ -572,13 +1474,608 @@ void messenger_conn_remove(MESSENGER *messenger, int pos) {
 
     // Update counter
     messenger->numConn = newListSize;
+
+    // Stop shared-memory traffic (unlocks while joining, so do it once out of the list)
+    messenger_shm_stop(messenger, conn);
+}
+
+void messenger_conn_start(MESSENGER *messenger, CONNECTION *conn) {
+    // Receive rate limits and outbound lane weights
+    CONFIG *config = &(messenger->config);
+    connection_setRateLimit(conn, config->rateFrames, config->burstFrames, config->rateBytes, config->burstBytes);
+    connection_setLaneWeights(conn, config->weightControl, config->weightData);
+
+    // Low-latency or event-loop mode: no thread, the I/O thread reads it
+    if(messenger->io->running) {
+        if(config->lowLatency)
+            poller_tuneSocket(conn->socket);
+        conn->owner = messenger;
+        if(poller_add(messenger->io, conn->socket, conn)!=-1) {
+            conn->polled = 1;
+            return;
+        }
+    }
+
+    // Args are freed by the connection thread
+    PTHREAD_CONN_ARG *args = malloc(sizeof(PTHREAD_CONN_ARG));
+    args->messenger = messenger;
+    args->conn = conn;
+
+    int retn = messenger_startThread(&(conn->thread), (void*)messenger_conn_run, (void*)args);
+    if(retn!=0)
+        printf(">> MESSENGER: Failed to start connection thread (%s)!\n", strerror(retn));
+}
+
+CONNECTION* messenger_conn_accept(MESSENGER *messenger, int sock) {
+    // Get IP address
+    char ip[16];
+    socket2ip(sock, ip);
+
+    // Create connection and add to list (thread started by caller)
+    CONNECTION *newConn = connection_new(sock, ip, "Unknown contact");
+    messenger_snapshot_claim(messenger, newConn);
+    messenger_conn_add(messenger, newConn);
+
+    return newConn;
+}
+
+void messenger_gossip_round(MESSENGER *messenger) {
+    // Exchange with contacts picked at random
+    char syn[MSG_MAX_SIZE];
+    int size = gossip_syn(&(messenger->gossip), syn, MSG_MAX_SIZE);
+    int i=0;
+    for(i=0; i<GOSSIP_FANOUT && messenger->numConn>0; i++) {
+        CONNECTION *conn = messenger->conn[gossip_random(&(messenger->gossip), messenger->numConn)];
+        messenger_gossip_send(messenger, conn, syn, size);
+    }
+}
+
+void messenger_gossip_leave(MESSENGER *messenger) {
+    // Tell every contact now, rather than let them wait for GOSSIP_TIMEOUT
+    gossip_leave(&(messenger->gossip));
+    char syn[MSG_MAX_SIZE];
+    int size = gossip_syn(&(messenger->gossip), syn, MSG_MAX_SIZE);
+    int i=0;
+    for(i=0; i<messenger->numConn; i++)
+        messenger_gossip_send(messenger, messenger->conn[i], syn, size);
+}
+
+void messenger_gossip_send(MESSENGER *messenger, CONNECTION *conn, char *data, int size) {
+    // Once names are exchanged: both ends key records by them
+    if(strcmp(conn->username, "Unknown contact")!=0)
+        messenger_msg_sendFrame(messenger, conn, MSGTYPE_GOSSIP, data, size);
+}
+
+void messenger_sync_start(MESSENGER *messenger, CONNECTION *conn) {
+    // One side starts the walk: lower address (then username)
+    char myIp[17];
+    socket2localIp(conn->socket, myIp);
+    int order = strcmp(myIp, conn->ip);
+    if(order==0)
+        order = strcmp(messenger->username, conn->username);
+    if(order>=0)
+        return;
+
+    MERKLE_TREE *tree = messenger_sync_tree(messenger, conn);
+
+    char frame[32];
+    int size = sprintf(frame, "root %016llx", (unsigned long long)merkle_root(tree));
+    messenger_msg_sendFrame(messenger, conn, MSGTYPE_SYNC, frame, size);
+}
+
+void messenger_sync_handle(MESSENGER *messenger, CONNECTION *conn, char *data) {
+    if(!conn->syncPeer)
+        return;
+
+    // Our side of the conversation, as of this frame
+    MERKLE_TREE *tree = messenger_sync_tree(messenger, conn);
+
+    unsigned long long hash = 0;
+    unsigned int prefix = 0;
+    int level = 0, chunk = 0, offset = 0, read = 0;
+    char kind[8];
+
+    if(sscanf(data, "root %llx", &hash)==1) {
+        // Roots differ: walk down from the top
+        if(hash!=merkle_root(tree))
+            messenger_sync_sendNode(messenger, conn, tree, MERKLE_LEVELS, 0);
+
+    } else if(sscanf(data, "node %d %u%n", &level, &prefix, &offset)==2 && level>0 && level<=MERKLE_LEVELS
+              && (prefix >> (4*(MERKLE_LEVELS-level)))==0) {
+        // Sender's children of a node that differs: go on with those that differ
+        uint64_t theirs[MERKLE_FANOUT], mine[MERKLE_FANOUT];
+        memset(theirs, 0, sizeof(theirs));
+        char *p = data+offset;
+        int c=0;
+        while(sscanf(p, " %d:%llx%n", &c, &hash, &read)==2) {
+            if(c>=0 && c<MERKLE_FANOUT)
+                theirs[c] = hash;
+            p += read;
+        }
+
+        merkle_children(tree, level, prefix, mine);
+        for(c=0; c<MERKLE_FANOUT; c++) {
+            uint32_t child = prefix*MERKLE_FANOUT + c;
+            if(mine[c]==theirs[c])
+                continue;
+
+            if(mine[c]==0) {
+                // Nothing here: all of theirs is missing
+                char frame[32];
+                int size = sprintf(frame, "empty %d %u", level-1, child);
+                messenger_msg_sendFrame(messenger, conn, MSGTYPE_SYNC, frame, size);
+            } else if(theirs[c]==0) {
+                messenger_sync_sendRange(messenger, conn, tree, level-1, child);
+            } else if(level-1>0) {
+                messenger_sync_sendNode(messenger, conn, tree, level-1, child);
+            } else {
+                messenger_sync_sendBucket(messenger, conn, tree, "bucket", child);
+            }
+        }
+
+    } else if(sscanf(data, "empty %d %u", &level, &prefix)==2 && level>=0 && level<MERKLE_LEVELS
+              && (prefix >> (4*(MERKLE_LEVELS-level)))==0) {
+        // Sender has nothing in that range
+        messenger_sync_sendRange(messenger, conn, tree, level, prefix);
+
+    } else if(strncmp(data, "msgs\n", 5)==0) {
+        messenger_sync_apply(messenger, conn, tree, data+5);
+
+    } else if(sscanf(data, "%7s %u %d%n", kind, &prefix, &chunk, &offset)==3) {
+        // Hash lists of one bucket
+        uint64_t hashes[MSG_MAX_SIZE/17];
+        int num = 0;
+        char *p = data+offset;
+        while(num<MSG_MAX_SIZE/17 && sscanf(p, " %llx%n", &hash, &read)==1) {
+            hashes[num++] = hash;
+            p += read;
+        }
+
+        if(strcmp(kind, "bucket")==0 || strcmp(kind, "have")==0) {
+            // Sender's messages: want those we lack, and offer ours once
+            int wants=0, i=0;
+            for(i=0; i<num; i++)
+                if(merkle_find(tree, prefix, hashes[i])==-1)
+                    hashes[wants++] = hashes[i];
+            if(wants>0)
+                messenger_sync_sendList(messenger, conn, "want", prefix, hashes, wants);
+            if(strcmp(kind, "bucket")==0 && chunk==0)
+                messenger_sync_sendBucket(messenger, conn, tree, "have", prefix);
+
+        } else if(strcmp(kind, "want")==0) {
+            messenger_sync_sendMessages(messenger, conn, tree, prefix, hashes, num);
+        }
+    }
+}
+
+MERKLE_TREE* messenger_sync_tree(MESSENGER *messenger, CONNECTION *conn) {
+    // Stamped messages with this contact, leaf id = history id. History only grows: just the entries added since the last frame.
+    HISTORY *history = &(messenger->history);
+    MERKLE_TREE *tree = &(conn->syncTree);
+
+    pthread_mutex_lock(&(history->mutex));
+    int i=0;
+    for(i=conn->syncScanned; i<history->numEntries; i++) {
+        HISTORY_ENTRY *entry = &(history->entries[i]);
+        if(entry->hash!=0 && strcmp(entry->ip, conn->ip)==0 && strcmp(entry->username, conn->username)==0)
+            merkle_add(tree, entry->hash, entry->sent, i);
+    }
+    conn->syncScanned = history->numEntries;
+    pthread_mutex_unlock(&(history->mutex));
+
+    merkle_build(tree);
+    return tree;
+}
+
+void messenger_sync_sendNode(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, int level, uint32_t prefix) {
+    // "node <level> <prefix> <child>:<hash>...", non-empty children only
+    uint64_t hashes[MERKLE_FANOUT];
+    merkle_children(tree, level, prefix, hashes);
+
+    char frame[32 + MERKLE_FANOUT*20];
+    int size = sprintf(frame, "node %d %u", level, prefix);
+    int c=0;
+    for(c=0; c<MERKLE_FANOUT; c++)
+        if(hashes[c]!=0)
+            size += sprintf(frame+size, " %d:%016llx", c, (unsigned long long)hashes[c]);
+    messenger_msg_sendFrame(messenger, conn, MSGTYPE_SYNC, frame, size);
+}
+
+void messenger_sync_sendRange(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, int level, uint32_t prefix) {
+    // Every bucket we have under node (level, prefix), peer has none of them
+    const uint64_t end = (uint64_t)(prefix+1) << (4*level);
+    int i = merkle_lowerBound(tree, (uint64_t)prefix << (4*level));
+    while(i<tree->numLeaves && tree->leaves[i].bucket<end) {
+        uint32_t bucket = tree->leaves[i].bucket;
+        messenger_sync_sendBucket(messenger, conn, tree, "have", bucket);
+        while(i<tree->numLeaves && tree->leaves[i].bucket==bucket)
+            i++;
+    }
+}
+
+void messenger_sync_sendBucket(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, char *kind, uint32_t bucket) {
+    int first = 0;
+    int num = merkle_bucket(tree, bucket, &first);
+
+    uint64_t *hashes = malloc((num>0? num : 1)*sizeof(uint64_t));
+    int i=0;
+    for(i=0; i<num; i++)
+        hashes[i] = tree->leaves[first+i].hash;
+    messenger_sync_sendList(messenger, conn, kind, bucket, hashes, num);
+    free(hashes);
+}
+
+void messenger_sync_sendList(MESSENGER *messenger, CONNECTION *conn, char *kind, uint32_t bucket, uint64_t *hashes, int num) {
+    // "<kind> <bucket> <chunk> <hash>...", in as many frames as needed
+    char frame[MSG_MAX_SIZE+1];
+    int chunk=0, i=0;
+    do {
+        int size = sprintf(frame, "%s %u %d", kind, bucket, chunk);
+        while(i<num && size+17<=MSG_MAX_SIZE)
+            size += sprintf(frame+size, " %016llx", (unsigned long long)hashes[i++]);
+        messenger_msg_sendFrame(messenger, conn, MSGTYPE_SYNC, frame, size);
+        chunk++;
+    } while(i<num);
+}
+
+void messenger_sync_sendMessages(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, uint32_t bucket, uint64_t *hashes, int num) {
+    // "msgs" then "m <sent> <o|i> <len>\n<text>\n" per message (o = sent by us), batched
+    HISTORY *history = &(messenger->history);
+    char frame[MSG_MAX_SIZE+1];
+    int size = sprintf(frame, "msgs\n");
+
+    int i=0;
+    for(i=0; i<num; i++) {
+        int pos = merkle_find(tree, bucket, hashes[i]);
+        if(pos==-1)
+            continue;
+        HISTORY_ENTRY *entry = history_get(history, tree->leaves[pos].id);
+        char *text = history_getText(history, tree->leaves[pos].id);
+        int len = strlen(text);
+
+        char header[48];
+        int headerSize = sprintf(header, "m %ld %c %d\n", (long)entry->sent, (entry->direction==HISTORY_OUT? 'o' : 'i'), len);
+        if(5+headerSize+len+1 > MSG_MAX_SIZE)
+            continue; // never fits a frame
+
+        // Frame full: send it, start the next one
+        if(size+headerSize+len+1 > MSG_MAX_SIZE) {
+            messenger_msg_sendFrame(messenger, conn, MSGTYPE_SYNC, frame, size);
+            size = sprintf(frame, "msgs\n");
+        }
+        memcpy(frame+size, header, headerSize);
+        size += headerSize;
+        memcpy(frame+size, text, len);
+        size += len;
+        frame[size++] = '\n';
+    }
+    if(size>5)
+        messenger_msg_sendFrame(messenger, conn, MSGTYPE_SYNC, frame, size);
+}
+
+void messenger_sync_apply(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, char *data) {
+    // Messages we lack: ours go to history, theirs are received as if just sent
+    char *p = data;
+    while(strncmp(p, "m ", 2)==0) {
+        long sent = 0;
+        char direction = 0;
+        int len = 0;
+        char *text = strchr(p, '\n');
+        if(text==NULL || sscanf(p, "m %ld %c %d", &sent, &direction, &len)!=3 || sent<0 || len<0 || len>(int)strlen(text+1))
+            break;
+        text++;
+        char *end = text+len;
+        if(*end!='\n')
+            break;
+        *end = '\0';
+
+        char *sender = (direction=='o'? conn->username : messenger->username);
+        uint64_t hash = merkle_messageHash(sender, (time_t)sent, text);
+        if((direction=='o' || direction=='i') && merkle_find(tree, (uint32_t)(sent/MERKLE_BUCKET), hash)==-1) {
+            int kept = 1;
+            if(direction=='o')
+                kept = messenger_msg_receive(messenger, conn, text, len, (time_t)sent, 1);
+            else
+                history_addSent(&(messenger->history), HISTORY_OUT, conn->ip, conn->username, text, time(NULL), (time_t)sent, hash);
+            if(kept)
+                stats_add(&(messenger->stats.synced), 1);
+        }
+
+        p = end+1;
+    }
+}
+
+void messenger_capture_start(MESSENGER *messenger) {
+    // Tenants of a node share the setting: one file each
+    char path[320];
+    if(messenger->config.capture[0]=='\0')
+        return;
+    if(messenger->hosted)
+        sprintf(path, "%s.%s", messenger->config.capture, messenger->username);
+    else
+        strcpy(path, messenger->config.capture);
+
+    if(capture_open(&(messenger->capture), path)==-1)
+        printf(">> Capture to %s disabled.\n>> Error: %s.\n", path, strerror(errno));
+}
+
+int messenger_snapshot_save(MESSENGER *messenger) {
+    SNAPSHOT snapshot;
+    snapshot_init(&snapshot);
+    strcpy(snapshot.username, messenger->username);
+
+    // Connected contacts and their pending messages
+    int ok = 1;
+    int i=0, j=0;
+    for(i=0; i<messenger->numConn; i++) {
+        CONNECTION *conn = messenger_conn_getConnByPos(messenger, i);
+
+        // One contact per IP address
+        SNAPSHOT_CONTACT *contact = NULL;
+        int pos = snapshot_getContactPosByIP(&snapshot, conn->ip);
+        if(pos==-1)
+            contact = snapshot_addContact(&snapshot, conn->ip, conn->username);
+        else
+            contact = &(snapshot.contacts[pos]);
+        snapshot_addDelivered(contact, conn->delivered, conn->numDelivered);
+
+        // Oldest ones on disk (only referenced), then memory
+        pthread_mutex_lock(&(conn->mutex));
+        ok = (snapshot_addSpill(contact, &(conn->spill))!=-1) && ok;
+        for(j=0; j<conn->numMessages; j++)
+            snapshot_addMessage(contact, conn->messages[j], conn->messagesTime[j]);
+        pthread_mutex_unlock(&(conn->mutex));
+    }
+
+    // Contacts from last run still offline
+    for(i=0; i<messenger->restore.numContacts; i++) {
+        SNAPSHOT_CONTACT *old = &(messenger->restore.contacts[i]);
+        if(snapshot_getContactPosByIP(&snapshot, old->ip)!=-1)
+            continue;
+
+        SNAPSHOT_CONTACT *contact = snapshot_addContact(&snapshot, old->ip, old->username);
+        snapshot_addDelivered(contact, old->delivered, old->numDelivered);
+        for(j=0; j<old->numMessages; j++)
+            snapshot_addMessage(contact, old->messages[j], old->messagesTime[j]);
+    }
+
+    // Written without the lock: spilled messages are copied from their files
+    pthread_mutex_unlock(&(messenger->mutex));
+    int retn = (ok? snapshot_save(&snapshot, messenger->snapshotFile) : -1);
+    snapshot_destroy(&snapshot);
+    pthread_mutex_lock(&(messenger->mutex));
+
+    return retn;
+}
+
+void messenger_snapshot_redial(MESSENGER *messenger) {
+    const int num = messenger->restore.numContacts;
+    if(num==0)
+        return;
+
+    printf(">> Reconnecting to %d contacts...\n", num);
+
+    // Connect to all contacts in parallel
+    TIMER t;
+    timer_start(&t);
+    char (*ips)[16] = malloc(num*sizeof(*ips));
+    int *socks = malloc(num*sizeof(int));
+    int i=0;
+    for(i=0; i<num; i++)
+        strcpy(ips[i], messenger->restore.contacts[i].ip);
+    int connected = client_connectMany(ips, num, MESSENGER_SERVER_PORT, socks, REDIAL_TIMEOUT);
+
+    // Restore connections (claim removes them from restore list)
+    for(i=0; i<num; i++) {
+        if(socks[i]==-1)
+            continue;
+
+        const int pos = snapshot_getContactPosByIP(&(messenger->restore), ips[i]);
+        CONNECTION *conn = connection_new(socks[i], ips[i], messenger->restore.contacts[pos].username);
+        messenger_snapshot_claim(messenger, conn);
+        messenger_conn_add(messenger, conn);
+        messenger_conn_start(messenger, conn);
+
+        // Send username (to the same identity, if its node hosts many)
+        char *target = conn->username;
+        if(strcmp(target, "Unknown contact")==0)
+            target = NULL;
+        messenger_conn_hello(messenger, conn, target);
+    }
+    timer_stop(&t);
+
+    printf(">> Reconnected to %d of %d contacts in %.0f ms.\n", connected, num, timer_timemsec(&t));
+
+    free(ips);
+    free(socks);
+}
+
+void messenger_snapshot_claim(MESSENGER *messenger, CONNECTION *conn) {
+    const int pos = snapshot_getContactPosByIP(&(messenger->restore), conn->ip);
+    if(pos==-1)
+        return;
+
+    // Move pending messages from last run to the connection
+    SNAPSHOT_CONTACT *contact = &(messenger->restore.contacts[pos]);
+    connection_restoreDelivered(conn, contact->delivered, contact->numDelivered);
+    int i=0;
+    for(i=0; i<contact->numMessages; i++)
+        connection_pushMessageAt(conn, contact->messages[i], contact->messagesTime[i]);
+
+    snapshot_removeContact(&(messenger->restore), pos);
 }
 
 int messenger_msg_encode(char msgType, char *data, int size, char dest[]) {
+    // Truncate oversized data
+    if(size>MSG_MAX_SIZE)
+        size = MSG_MAX_SIZE;
+
     // 1o byte = msg type
     dest[0] = msgType;
-    // 2+ byte = data
-    memcpy(dest+1, data, size);
+    // 2o-3o bytes = data size (big endian)
+    dest[1] = (size >> 8) & 0xFF;
+    dest[2] = size & 0xFF;
+    // 4+ byte = data
+    memcpy(dest+MSG_HEADER_SIZE, data, size);
+
+    return size+MSG_HEADER_SIZE;
+}
+
+int messenger_msg_recv(int sock, char *msgType, char dest[], int max) {
+    // Header
+    unsigned char header[MSG_HEADER_SIZE];
+    int retn = recv(sock, header, MSG_HEADER_SIZE, MSG_WAITALL);
+    if(retn<=0)
+        return retn;
+    if(retn<MSG_HEADER_SIZE)
+        return 0; // peer closed mid-frame
+
+    *msgType = header[0];
+    int size = (header[1] << 8) | header[2];
+
+    // Data
+    if(size>0) {
+        int toRead = (size>max? max : size);
+        retn = recv(sock, dest, toRead, MSG_WAITALL);
+        if(retn<=0)
+            return retn;
+        if(retn<toRead)
+            return 0;
+
+        // Drop what does not fit
+        int rest = size - toRead;
+        while(rest>0) {
+            char discard[256];
+            retn = recv(sock, discard, (rest>256? 256 : rest), 0);
+            if(retn<=0)
+                return retn;
+            rest -= retn;
+        }
+        size = toRead;
+    }
+    dest[size] = '\0';
 
+    // Frame size (type + data)
     return size+1;
 }
+
+int messenger_msg_pending(int sock) {
+    // A whole frame header is already buffered
+    int available = 0;
+    if(ioctl(sock, FIONREAD, &available)==-1)
+        return 0;
+    return (available>=MSG_HEADER_SIZE);
+}
+
+int messenger_msg_lane(char msgType) {
+    // Everything except chat payloads (and history catch-up) is control traffic
+    return (msgType==MSGTYPE_MSG || msgType==MSGTYPE_MSG_SENT || msgType==MSGTYPE_SYNC? LANE_DATA : LANE_CONTROL);
+}
+
+int messenger_msg_sendFrame(MESSENGER *messenger, CONNECTION *conn, char msgType, char *data, int size) {
+    char sendBuffer[MSG_HEADER_SIZE+MSG_MAX_SIZE];
+
+    // Encode, queue in its lane and send what is queued
+    int msgSize = messenger_msg_encode(msgType, data, size, sendBuffer);
+    capture_frame(&(messenger->capture), conn->captureId, CAPTURE_OUT, msgType, sendBuffer+MSG_HEADER_SIZE, msgSize-MSG_HEADER_SIZE);
+    connection_queueFrame(conn, messenger_msg_lane(msgType), sendBuffer, msgSize);
+    int retn = connection_flush(conn);
+
+    // Stats
+    if(retn!=-1) {
+        stats_add(&(conn->stats.framesOut), 1);
+        stats_add(&(conn->stats.bytesOut), msgSize-MSG_HEADER_SIZE);
+        stats_add(&(messenger->stats.framesOut), 1);
+        stats_add(&(messenger->stats.bytesOut), msgSize-MSG_HEADER_SIZE);
+    }
+
+    return retn;
+}
+
+int messenger_msg_send(MESSENGER *messenger, CONNECTION *conn, char *msg) {
+    int retn = -1;
+
+    // Sync peers get it stamped with our clock, cut (on a UTF-8 boundary) to what reconciliation carries
+    time_t sent = time(NULL);
+    char msgType = MSGTYPE_MSG;
+    char stamped[MSG_MAX_SIZE+1];
+    char *data = msg, *text = msg;
+    uint64_t hash = 0;
+    if(conn->syncPeer) {
+        int len = strlen(msg);
+        if(len>SYNC_TEXT_MAX) {
+            len = SYNC_TEXT_MAX;
+            while(len>0 && (msg[len]&0xC0)==0x80)
+                len--;
+        }
+        text = stamped + sprintf(stamped, "%ld ", (long)sent);
+        memcpy(text, msg, len);
+        text[len] = '\0';
+
+        msgType = MSGTYPE_MSG_SENT;
+        data = stamped;
+        hash = merkle_messageHash(messenger->username, sent, text);
+    }
+
+    // Shared memory or UDP if negotiated (UDP batched until messenger_msg_flush), else or if full TCP
+    if(conn->udpPeer!=-1 && conn->shm.tx==NULL) {
+        char sendBuffer[MSG_HEADER_SIZE+MSG_MAX_SIZE];
+        int msgSize = messenger_msg_encode(msgType, data, strlen(data), sendBuffer);
+        retn = udp_send(&(messenger->udp), conn->udpPeer, sendBuffer, msgSize);
+        if(retn!=-1) {
+            capture_frame(&(messenger->capture), conn->captureId, CAPTURE_OUT, msgType, sendBuffer+MSG_HEADER_SIZE, msgSize-MSG_HEADER_SIZE);
+            stats_add(&(conn->stats.framesOut), 1);
+            stats_add(&(conn->stats.bytesOut), msgSize-MSG_HEADER_SIZE);
+            stats_add(&(messenger->stats.framesOut), 1);
+            stats_add(&(messenger->stats.bytesOut), msgSize-MSG_HEADER_SIZE);
+        }
+    }
+    if(retn==-1) // shared memory goes through the outbox as well
+        retn = messenger_msg_sendFrame(messenger, conn, msgType, data, strlen(data));
+
+    // Keep in history
+    if(retn!=-1)
+        history_addSent(&(messenger->history), HISTORY_OUT, conn->ip, conn->username, text, sent, sent, hash);
+
+    return retn;
+}
+
+int messenger_msg_receive(MESSENGER *messenger, CONNECTION *conn, char *msg, int size, time_t sent, int synced) {
+    // Returns 1 if kept, 0 if filtered out
+
+    // Embedded NULs, invalid UTF-8 and terminal control sequences never reach the inbox
+    if(messenger->config.filter && !filter_validate(&(messenger->filter), msg, size)) {
+        stats_add(&(messenger->stats.rejected), 1);
+        return 0;
+    }
+    if(filter_match(&(messenger->filter), msg, size)) {
+        stats_add(&(messenger->stats.muted), 1);
+        return 0;
+    }
+
+    // Sync peers' messages are identified by their own clock
+    uint64_t hash = (conn->syncPeer? merkle_messageHash(conn->username, sent, msg) : 0);
+
+    // Subscribers get it streamed, otherwise it waits as unread (recovered ones as of when they were sent).
+    // Recovered ones delivered before a restart (unread ones are in the snapshot) only rebuild history.
+    if(!synced || !connection_wasDelivered(conn, hash)) {
+        if(messenger_notify(messenger, MESSENGER_EVENT_MSG, conn, msg)!=1) {
+            if(synced)
+                connection_pushMessageAt(conn, msg, sent);
+            else
+                connection_pushMessage(conn, msg);
+        }
+        if(hash!=0)
+            connection_addDelivered(conn, hash);
+    }
+
+    history_addSent(&(messenger->history), HISTORY_IN, conn->ip, conn->username, msg, time(NULL), sent, hash);
+
+    return 1;
+}
+
+void messenger_msg_flush(MESSENGER *messenger) {
+    // TCP frames are flushed as they are sent, UDP ones are batched
+    if(messenger->udp.running)
+        udp_flush(&(messenger->udp));
+}
@@ -4,17 +4,53 @@
 #include "global.h"
 #include "server.h"
 #include "connection.h"
+#include "history.h"
+#include "snapshot.h"
+#include "config.h"
+#include "stats.h"
+#include "udp.h"
+#include "filter.h"
+#include "poller.h"
+#include "gossip.h"
+#include "merkle.h"
+#include "capture.h"
 
 #define MESSENGER_SERVER_PORT 2020
 #define THREAD_LOOP_TIME 100 // ms
+#define SEARCH_MAX_RESULTS 20
+
+#define SNAPSHOT_FILE     "messenger.snap"
+#define SNAPSHOT_INTERVAL 5000 // ms
+#define REDIAL_TIMEOUT    1000 // ms
 
 #define MSGTYPE_USERNAME        0
 #define MSGTYPE_USERNAME_ANSWER 1
 #define MSGTYPE_MSG             2
+#define MSGTYPE_TRANSPORT       3 // transport offer: "udp <port>", "host <boot id>" or "shm <pid> <fd>"
+#define MSGTYPE_TARGET          4 // identity the dialer wants to reach, first frame (multi-tenant nodes)
+#define MSGTYPE_GOSSIP          5 // presence exchange: "syn", "ack" or "ack2" then records (see gossip.h)
+#define MSGTYPE_MSG_SENT        6 // chat message with the sender's clock: "<time> <text>" (peers that offered "sync")
+#define MSGTYPE_SYNC            7 // history reconciliation: "root", "node", "empty", "bucket", "have", "want" or "msgs"
+
+#define MSG_HEADER_SIZE 3 // type + data size
+#define MSG_MAX_SIZE    1024 // max data size
+#define RECV_BATCH      32 // frames dispatched per lock
+#define SYNC_TEXT_MAX   (MSG_MAX_SIZE-40) // message text kept for sync peers: fits a stamped frame or a "msgs" record
+#define POLL_RX_SIZE    (2*(MSG_HEADER_SIZE+MSG_MAX_SIZE)) // I/O thread read buffer (connections keep partial frames, or frames over the rate limit)
+#define CONN_STACK_SIZE (64*1024) // per reader thread (glibc default is 8 MB)
+#define PEER_BUDGET     2048 // bytes of process memory per idle peer in event-loop mode (100k peers in ~200 MB, kernel socket buffers aside)
+
+#define MESSENGER_EVENT_MSG          0 // text = message
+#define MESSENGER_EVENT_CONNECTED    1 // text = username
+#define MESSENGER_EVENT_DISCONNECTED 2 // text = username
+
+// Called with the lock held; returns 1 if it consumed a message (not kept as unread)
+typedef int (*MESSENGER_LISTENER)(void *arg, int event, CONNECTION *conn, char *text);
 
 typedef struct {
     pthread_t thread;
     SERVER server;
+    int hosted; // tenant of a NODE: no own server or handler thread
 
     // Username
     char username[32];
@@ -23,6 +59,42 @@ typedef struct {
     int numConn;
     CONNECTION **conn;
     pthread_mutex_t mutex;
+
+    // Sent and received messages
+    HISTORY history;
+
+    // Contacts from the last snapshot not reconnected yet
+    SNAPSHOT restore;
+    char snapshotFile[64];
+
+    CONFIG config;
+    STATS stats; // totals over all connections
+
+    // Optional UDP transport for chat messages
+    UDP_TRANSPORT udp;
+
+    // Boot id, to detect peers on the same host ("" = unknown)
+    char hostId[40];
+
+    // Received text checks and muted keywords
+    FILTER filter;
+
+    // Presence and usernames of identities beyond our contacts
+    GOSSIP gossip;
+
+    // Low-latency or event-loop mode: TCP peers are read by this thread (not running = one thread each)
+    POLLER poller;
+    POLLER *io; // the one in use: ours, or the node's shared by its tenants
+    int numPaused; // its connections over the rate limit, taken out until their buckets refill
+    LANES pollInbox;
+    char pollBuffer[POLL_RX_SIZE];
+
+    // Frames sent and received, when MESSENGER_CAPTURE is set
+    CAPTURE capture;
+
+    // Event subscriber (daemon mode)
+    MESSENGER_LISTENER listener;
+    void *listenerArg;
 } MESSENGER;
 
 typedef struct {
@@ -34,11 +106,68 @@ typedef struct {
 void messenger_init(MESSENGER *messenger);
 void messenger_destroy(MESSENGER *messenger);
 void messenger_start(MESSENGER *messenger);
+void messenger_host(MESSENGER *messenger, char *username);
 void messenger_stop(MESSENGER *messenger);
+int messenger_connect(MESSENGER *messenger, char *addr, char name[32]);
+int messenger_notify(MESSENGER *messenger, int event, CONNECTION *conn, char *text);
 
 void messenger_run(MESSENGER *messenger);
+void messenger_acceptPending(MESSENGER *messenger);
+int messenger_startThread(pthread_t *thread, void *run, void *args);
 void messenger_conn_run(PTHREAD_CONN_ARG *args);
+int messenger_conn_recv(MESSENGER *messenger, CONNECTION *conn, LANES *inbox, char *buffer);
+double messenger_conn_account(MESSENGER *messenger, CONNECTION *conn, int size);
+void messenger_conn_dispatch(MESSENGER *messenger, CONNECTION *conn, char msgType, char *data, int size);
+void messenger_conn_hello(MESSENGER *messenger, CONNECTION *conn, char *target);
+void messenger_conn_offerTransports(MESSENGER *messenger, CONNECTION *conn);
+
+// I/O thread (low-latency and event-loop modes)
+void messenger_poll_start(MESSENGER *messenger);
+void messenger_poll_readable(MESSENGER *messenger, CONNECTION *conn);
+void messenger_poll_handle(MESSENGER *messenger, CONNECTION *conn);
+void messenger_poll_spin(MESSENGER *messenger);
+void messenger_poll_pause(MESSENGER *messenger, CONNECTION *conn, double wait);
+void messenger_poll_resume(MESSENGER *messenger);
+int messenger_poll_recv(MESSENGER *messenger, CONNECTION *conn, LANES *inbox);
+
+// UDP transport handlers
+void messenger_udp_receive(MESSENGER *messenger, int peerId, char *data, int size);
+void messenger_udp_failure(MESSENGER *messenger, int peerId, char *data, int size);
+
+// Shared-memory transport
+void messenger_shm_start(MESSENGER *messenger, CONNECTION *conn);
+void messenger_shm_run(PTHREAD_CONN_ARG *args);
+int messenger_shm_recv(MESSENGER *messenger, CONNECTION *conn, LANES *inbox, char *buffer);
+void messenger_shm_stop(MESSENGER *messenger, CONNECTION *conn);
+void messenger_shm_retry(MESSENGER *messenger);
 void messenger_stopConn(MESSENGER *messenger, int pos);
+void messenger_joinThread(MESSENGER *messenger, pthread_t thread);
+void messenger_lock(MESSENGER *messenger);
+void messenger_unlock(MESSENGER *messenger);
+
+// Presence directory (with the lock)
+void messenger_gossip_round(MESSENGER *messenger);
+void messenger_gossip_leave(MESSENGER *messenger);
+void messenger_gossip_send(MESSENGER *messenger, CONNECTION *conn, char *data, int size);
+
+// History reconciliation (with the lock): Merkle trees over each conversation, compared top-down
+void messenger_sync_start(MESSENGER *messenger, CONNECTION *conn);
+void messenger_sync_handle(MESSENGER *messenger, CONNECTION *conn, char *data);
+MERKLE_TREE* messenger_sync_tree(MESSENGER *messenger, CONNECTION *conn);
+void messenger_sync_sendNode(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, int level, uint32_t prefix);
+void messenger_sync_sendRange(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, int level, uint32_t prefix);
+void messenger_sync_sendBucket(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, char *kind, uint32_t bucket);
+void messenger_sync_sendList(MESSENGER *messenger, CONNECTION *conn, char *kind, uint32_t bucket, uint64_t *hashes, int num);
+void messenger_sync_sendMessages(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, uint32_t bucket, uint64_t *hashes, int num);
+void messenger_sync_apply(MESSENGER *messenger, CONNECTION *conn, MERKLE_TREE *tree, char *data);
+
+// Traffic capture
+void messenger_capture_start(MESSENGER *messenger);
+
+// Warm restart (save is called with the lock held, and releases it while writing)
+int messenger_snapshot_save(MESSENGER *messenger);
+void messenger_snapshot_redial(MESSENGER *messenger);
+void messenger_snapshot_claim(MESSENGER *messenger, CONNECTION *conn);
 
 // Menu
 void messenger_menu(MESSENGER *messenger);
@@ -48,17 +177,38 @@ void messenger_menu_deleteContact(MESSENGER *messenger);
 void messenger_menu_sendMessage(MESSENGER *messenger);
 void messenger_menu_sendGroupMessage(MESSENGER *messenger);
 void messenger_menu_checkMessages(MESSENGER *messenger);
-int messenger_menu_chooseContact(MESSENGER *messenger);
+void messenger_menu_searchMessages(MESSENGER *messenger);
+void messenger_menu_statistics(MESSENGER *messenger);
+void messenger_menu_clear(void);
+int messenger_menu_readLine(char *prompt, char dest[], int size);
+void messenger_menu_printContacts(MESSENGER *messenger);
+void messenger_menu_printDirectory(MESSENGER *messenger);
+CONNECTION* messenger_menu_chooseContact(MESSENGER *messenger);
+void messenger_printStatistics(MESSENGER *messenger);
+long messenger_memory(MESSENGER *messenger);
 
 // Connections
 int messenger_conn_connected2(MESSENGER *messenger, char ip[]);
 CONNECTION* messenger_conn_getConnByIP(MESSENGER *messenger, char ip[]);
+CONNECTION* messenger_conn_getConnByAddr(MESSENGER *messenger, char ip[], char username[]);
 CONNECTION* messenger_conn_getConnByPos(MESSENGER *messenger, int pos);
+int messenger_conn_getConnPos(MESSENGER *messenger, CONNECTION *conn);
+CONNECTION* messenger_conn_getConnByUdpPeer(MESSENGER *messenger, int peerId);
 int messenger_conn_getConnPosByIP(MESSENGER *messenger, char ip[]);
 void messenger_conn_add(MESSENGER *messenger, CONNECTION *conn);
 void messenger_conn_remove(MESSENGER *messenger, int pos);
+void messenger_conn_detach(MESSENGER *messenger, int pos);
+void messenger_conn_start(MESSENGER *messenger, CONNECTION *conn);
+CONNECTION* messenger_conn_accept(MESSENGER *messenger, int sock);
 
 // Messages
 int messenger_msg_encode(char msgType, char *data, int size, char dest[]);
+int messenger_msg_recv(int sock, char *msgType, char dest[], int max);
+int messenger_msg_pending(int sock);
+int messenger_msg_lane(char msgType);
+int messenger_msg_sendFrame(MESSENGER *messenger, CONNECTION *conn, char msgType, char *data, int size);
+int messenger_msg_send(MESSENGER *messenger, CONNECTION *conn, char *msg);
+int messenger_msg_receive(MESSENGER *messenger, CONNECTION *conn, char *msg, int size, time_t sent, int synced);
+void messenger_msg_flush(MESSENGER *messenger);
 
 #endif // MESSENGER_H
@@ -0,0 +1,1142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "messenger.h"
+#include "connection.h"
+#include "server.h"
+#include "history.h"
+#include "lane.h"
+#include "timer.h"
+#include "udp.h"
+#include "filter.h"
+#include "poller.h"
+#include "gossip.h"
+#include "merkle.h"
+#include "node.h"
+
+#define BENCH_WARMUP    2
+#define BENCH_REPS      10
+#define BENCH_PRODUCERS 4
+#define BENCH_CONTACTS  256
+#define BENCH_HISTORY   1000000 // messages in searched history
+#define BENCH_WORDS     5000 // vocabulary size
+#define BENCH_PING_SIZE 64 // bytes per ping-pong message
+#define BENCH_TEXT_SIZE 1024 // bytes per filtered message
+#define BENCH_RTT_SAMPLES 20000 // round trips timed one by one, for percentiles
+#define BENCH_GOSSIP_ROUNDS 200 // then a gossip run is reported as not converged
+#define BENCH_SYNC_TEXT  64 // bytes per reconciled message
+#define BENCH_IDLE_PEERS 100000 // connected peers, capped by the open file limit (both ends are in this process)
+#define BENCH_IDLE_PORT  2022 // loopback node (not MESSENGER_SERVER_PORT: one may be running)
+#define BENCH_IDLE_WAIT  60000 // ms for the node to take every peer
+
+typedef struct {
+    const char *name;
+    int ops; // operations per repetition
+    void (*setup)(void);
+    void (*run)(int ops);
+    void (*teardown)(void);
+} BENCH;
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*roundTrip)(void);
+    void (*teardown)(void);
+} LATENCY_BENCH;
+
+// Allocation counter (malloc, calloc and realloc are wrapped at link time)
+static long allocCount = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __sync_fetch_and_add(&allocCount, 1);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+    __sync_fetch_and_add(&allocCount, 1);
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&allocCount, 1);
+    return __real_realloc(ptr, size);
+}
+
+/* ----------------------------------------------------------------------- */
+/* connection_pushMessage / connection_popMessage                          */
+/* ----------------------------------------------------------------------- */
+
+static CONNECTION *benchConn = NULL;
+
+typedef struct {
+    int ops;
+} PRODUCER_ARG;
+
+void bench_inbox_setup(void) {
+    char ip[16] = "127.0.0.1", name[32] = "bench";
+    benchConn = connection_new(-1, ip, name);
+}
+
+void bench_inbox_teardown(void) {
+    connection_destroy(benchConn);
+    benchConn = NULL;
+}
+
+void bench_inbox_producer(PRODUCER_ARG *arg) {
+    int i=0;
+    for(i=0; i<arg->ops; i++)
+        connection_pushMessage(benchConn, "The quick brown fox jumps over the lazy dog");
+}
+
+void bench_inbox_run(int ops) {
+    // Start producers
+    pthread_t threads[BENCH_PRODUCERS];
+    PRODUCER_ARG arg;
+    arg.ops = ops/BENCH_PRODUCERS;
+    int i=0;
+    for(i=0; i<BENCH_PRODUCERS; i++)
+        pthread_create(&(threads[i]), NULL, (void*)&bench_inbox_producer, (void*)&arg);
+
+    // Consume everything while producers are running
+    int popped = 0;
+    char msg[MSG_MAX_SIZE+1];
+    time_t time;
+    while(popped < arg.ops*BENCH_PRODUCERS) {
+        if(connection_popMessage(benchConn, msg, sizeof(msg), &time)!=-1)
+            popped++;
+    }
+
+    for(i=0; i<BENCH_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/* ----------------------------------------------------------------------- */
+/* messenger_msg_encode                                                    */
+/* ----------------------------------------------------------------------- */
+
+void bench_encode_run(int ops) {
+    char *msg = "The quick brown fox jumps over the lazy dog";
+    const int size = strlen(msg);
+    char sendBuffer[129];
+
+    int i=0;
+    for(i=0; i<ops; i++)
+        messenger_msg_encode(MSGTYPE_MSG, msg, size, sendBuffer);
+}
+
+/* ----------------------------------------------------------------------- */
+/* Connection lookups                                                      */
+/* ----------------------------------------------------------------------- */
+
+static MESSENGER benchMessenger;
+static char benchIPs[BENCH_CONTACTS][16];
+
+void bench_lookup_setup(void) {
+    messenger_init(&benchMessenger);
+
+    char name[32] = "bench";
+    int i=0;
+    for(i=0; i<BENCH_CONTACTS; i++) {
+        sprintf(benchIPs[i], "10.0.%d.%d", i/250, i%250+1);
+        messenger_conn_add(&benchMessenger, connection_new(-1, benchIPs[i], name));
+    }
+}
+
+void bench_lookup_teardown(void) {
+    messenger_destroy(&benchMessenger);
+}
+
+void bench_lookup_byIP_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        messenger_conn_getConnByIP(&benchMessenger, benchIPs[(i*7919)%BENCH_CONTACTS]);
+}
+
+void bench_lookup_posByIP_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        messenger_conn_getConnPosByIP(&benchMessenger, benchIPs[(i*7919)%BENCH_CONTACTS]);
+}
+
+void bench_lookup_connected2_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        messenger_conn_connected2(&benchMessenger, benchIPs[(i*7919)%BENCH_CONTACTS]);
+}
+
+void bench_lookup_byPos_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        messenger_conn_getConnByPos(&benchMessenger, (i*7919)%BENCH_CONTACTS);
+}
+
+/* ----------------------------------------------------------------------- */
+/* server_addNewConnection / server_getNewConnections                      */
+/* ----------------------------------------------------------------------- */
+
+static SERVER benchServer;
+
+void bench_server_setup(void) {
+    server_init(&benchServer);
+}
+
+void bench_server_teardown(void) {
+    server_destroy(&benchServer);
+}
+
+void bench_server_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        server_addNewConnection(&benchServer, i);
+
+    // Drain in batches, as messenger_run does
+    int socks[8];
+    while(server_getNewConnections(&benchServer, socks, 8) > 0);
+}
+
+/* ----------------------------------------------------------------------- */
+/* lanes_push / lanes_pop                                                  */
+/* ----------------------------------------------------------------------- */
+
+void bench_lanes_run(int ops) {
+    LANES lanes;
+    lanes_init(&lanes, 8, 1);
+
+    // One control frame every 8 data frames, popped in batches of 32
+    char frame[128];
+    memset(frame, 'x', sizeof(frame));
+    int i=0, j=0;
+    for(i=0; i<ops; i+=32) {
+        for(j=0; j<32; j++)
+            lanes_push(&lanes, ((i+j)%8==0? LANE_CONTROL : LANE_DATA), frame, ((i+j)%8==0? 36 : 128));
+        LANE_FRAME *popped = NULL;
+        while((popped = lanes_pop(&lanes))!=NULL)
+            free(popped);
+    }
+
+    lanes_destroy(&lanes);
+}
+
+/* ----------------------------------------------------------------------- */
+/* history_add / history_search                                            */
+/* ----------------------------------------------------------------------- */
+
+static HISTORY benchHistory;
+static int benchHistoryReady = 0;
+static char benchWords[BENCH_WORDS][12];
+static unsigned int benchSeed = 1;
+
+unsigned int bench_rand(void) {
+    benchSeed = benchSeed*1103515245u + 12345u;
+    return (benchSeed >> 8);
+}
+
+void bench_history_message(char msg[128]) {
+    // 6-12 words, skewed towards the first words of the vocabulary
+    int numWords = 6 + bench_rand()%7;
+    msg[0] = '\0';
+    int i=0;
+    for(i=0; i<numWords; i++) {
+        unsigned int r = bench_rand()%BENCH_WORDS;
+        strcat(msg, benchWords[(r*r)/BENCH_WORDS]);
+        strcat(msg, " ");
+    }
+}
+
+void bench_history_setup(void) {
+    if(benchHistoryReady)
+        return;
+
+    int i=0;
+    for(i=0; i<BENCH_WORDS; i++)
+        sprintf(benchWords[i], "w%c%c%d", 'a'+i%26, 'a'+(i/26)%26, i);
+
+    // One message every 2.5s over the last month
+    history_init(&benchHistory);
+    time_t now = time(NULL);
+    char msg[128];
+    for(i=0; i<BENCH_HISTORY; i++) {
+        bench_history_message(msg);
+        history_add(&benchHistory, i%2, "10.0.0.1", "bench", msg, now - (time_t)(BENCH_HISTORY-i)*5/2);
+    }
+    benchHistoryReady = 1;
+}
+
+void bench_history_add_run(int ops) {
+    HISTORY history;
+    history_init(&history);
+
+    char msg[128];
+    int i=0;
+    for(i=0; i<ops; i++) {
+        bench_history_message(msg);
+        history_add(&history, HISTORY_IN, "10.0.0.1", "bench", msg, i);
+    }
+
+    history_destroy(&history);
+}
+
+void bench_history_search(int ops, int days) {
+    INDEX_RESULT results[20];
+    time_t to = time(NULL);
+    time_t from = (days>0? to - (time_t)days*24*60*60 : 0);
+
+    char query[32];
+    int i=0;
+    for(i=0; i<ops; i++) {
+        sprintf(query, "%s %s", benchWords[bench_rand()%200], benchWords[bench_rand()%1000]);
+        history_search(&benchHistory, query, from, to, results, 20);
+    }
+}
+
+void bench_history_search_all_run(int ops) {
+    bench_history_search(ops, 0);
+}
+
+void bench_history_search_week_run(int ops) {
+    bench_history_search(ops, 7);
+}
+
+/* ----------------------------------------------------------------------- */
+/* Transport round trip on loopback (TCP vs UDP, TCP low latency)         */
+/* ----------------------------------------------------------------------- */
+
+static int benchTcpPing = -1, benchTcpPong = -1;
+static pthread_t benchTcpThread;
+static POLLER benchPoller;
+
+void bench_tcp_echo(void *arg) {
+    char msgType;
+    char recvBuffer[MSG_MAX_SIZE];
+    char sendBuffer[MSG_HEADER_SIZE+MSG_MAX_SIZE];
+    int size=0;
+    while((size = messenger_msg_recv(benchTcpPong, &msgType, recvBuffer, MSG_MAX_SIZE)) > 0) {
+        int len = messenger_msg_encode(msgType, recvBuffer, size, sendBuffer);
+        send(benchTcpPong, sendBuffer, len, 0);
+    }
+}
+
+void bench_tcp_connect(void) {
+    // Listen on an ephemeral loopback port
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(listener, (struct sockaddr*)&addr, sizeof(addr));
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr*)&addr, &addrLen);
+
+    benchTcpPing = socket(AF_INET, SOCK_STREAM, 0);
+    connect(benchTcpPing, (struct sockaddr*)&addr, sizeof(addr));
+    benchTcpPong = accept(listener, NULL, NULL);
+    close(listener);
+}
+
+void bench_tcp_setup(void) {
+    bench_tcp_connect();
+    pthread_create(&benchTcpThread, NULL, (void*)&bench_tcp_echo, NULL);
+}
+
+void bench_tcp_teardown(void) {
+    // Echo thread exits when the connection closes
+    shutdown(benchTcpPing, SHUT_RDWR);
+    pthread_join(benchTcpThread, NULL);
+    close(benchTcpPing);
+    close(benchTcpPong);
+}
+
+void bench_tcp_roundTrip(void) {
+    char msg[BENCH_PING_SIZE];
+    memset(msg, 'x', sizeof(msg));
+    char sendBuffer[MSG_HEADER_SIZE+BENCH_PING_SIZE];
+    const int len = messenger_msg_encode(MSGTYPE_MSG, msg, BENCH_PING_SIZE, sendBuffer);
+
+    char msgType;
+    char recvBuffer[MSG_MAX_SIZE];
+    send(benchTcpPing, sendBuffer, len, 0);
+    messenger_msg_recv(benchTcpPing, &msgType, recvBuffer, MSG_MAX_SIZE);
+}
+
+void bench_tcp_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        bench_tcp_roundTrip();
+}
+
+void bench_tcpll_echo(void *arg, void *ptr) {
+    // Echo whatever arrived: frames are bytes both ways
+    char buffer[MSG_HEADER_SIZE+MSG_MAX_SIZE];
+    int size = recv(benchTcpPong, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if(size<=0)
+        return;
+    poller_quickAck(benchTcpPong);
+    send(benchTcpPong, buffer, size, 0);
+}
+
+void bench_tcpll_setup(void) {
+    // As messenger low-latency mode: tuned sockets, echo on the busy-polling I/O thread
+    bench_tcp_connect();
+    poller_tuneSocket(benchTcpPing);
+    poller_tuneSocket(benchTcpPong);
+
+    // Last core, if there are several
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    poller_init(&benchPoller, &bench_tcpll_echo, NULL, NULL);
+    poller_start(&benchPoller, (cpus>1? cpus-1 : -1), 0);
+    poller_add(&benchPoller, benchTcpPong, NULL);
+}
+
+void bench_tcpll_teardown(void) {
+    poller_destroy(&benchPoller);
+    close(benchTcpPing);
+    close(benchTcpPong);
+}
+
+void bench_tcpll_roundTrip(void) {
+    char msg[BENCH_PING_SIZE];
+    memset(msg, 'x', sizeof(msg));
+    char sendBuffer[MSG_HEADER_SIZE+BENCH_PING_SIZE];
+    const int len = messenger_msg_encode(MSGTYPE_MSG, msg, BENCH_PING_SIZE, sendBuffer);
+    send(benchTcpPing, sendBuffer, len, 0);
+
+    // Busy-poll the reply too
+    char recvBuffer[MSG_HEADER_SIZE+BENCH_PING_SIZE];
+    int received = 0;
+    while(received<len) {
+        int retn = recv(benchTcpPing, recvBuffer+received, len-received, MSG_DONTWAIT);
+        if(retn>0)
+            received += retn;
+        else if(retn==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK))
+            break;
+        else
+            sched_yield();
+    }
+    poller_quickAck(benchTcpPing);
+}
+
+void bench_tcpll_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        bench_tcpll_roundTrip();
+}
+
+static UDP_TRANSPORT benchUdpPing, benchUdpPong;
+static int benchUdpPingPeer = -1, benchUdpPongPeer = -1;
+static int benchUdpReplies = 0;
+static pthread_mutex_t benchUdpMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t benchUdpCond = PTHREAD_COND_INITIALIZER;
+
+void bench_udp_pong(void *arg, int peerId, char *data, int size) {
+    udp_send(&benchUdpPong, peerId, data, size);
+    udp_flush(&benchUdpPong);
+}
+
+void bench_udp_reply(void *arg, int peerId, char *data, int size) {
+    pthread_mutex_lock(&benchUdpMutex);
+    benchUdpReplies++;
+    pthread_cond_signal(&benchUdpCond);
+    pthread_mutex_unlock(&benchUdpMutex);
+}
+
+void bench_udp_drop(void *arg, int peerId, char *data, int size) {
+}
+
+void bench_udp_setup(void) {
+    udp_init(&benchUdpPing, &bench_udp_reply, &bench_udp_drop, NULL);
+    udp_init(&benchUdpPong, &bench_udp_pong, &bench_udp_drop, NULL);
+    udp_start(&benchUdpPing, 0);
+    udp_start(&benchUdpPong, 0);
+    benchUdpPingPeer = udp_addPeer(&benchUdpPing, "127.0.0.1", udp_getPort(&benchUdpPong));
+    benchUdpPongPeer = udp_addPeer(&benchUdpPong, "127.0.0.1", udp_getPort(&benchUdpPing));
+    benchUdpReplies = 0;
+}
+
+void bench_udp_teardown(void) {
+    udp_stop(&benchUdpPing);
+    udp_stop(&benchUdpPong);
+    udp_destroy(&benchUdpPing);
+    udp_destroy(&benchUdpPong);
+}
+
+void bench_udp_run(int ops) {
+    char msg[BENCH_PING_SIZE];
+    memset(msg, 'x', sizeof(msg));
+
+    int i=0;
+    for(i=0; i<ops; i++) {
+        // Window full: wait for acks, as messenger_msg_send would fall back instead
+        while(udp_send(&benchUdpPing, benchUdpPingPeer, msg, BENCH_PING_SIZE)==-1)
+            usleep(100);
+        udp_flush(&benchUdpPing);
+
+        pthread_mutex_lock(&benchUdpMutex);
+        while(benchUdpReplies<=i)
+            pthread_cond_wait(&benchUdpCond, &benchUdpMutex);
+        pthread_mutex_unlock(&benchUdpMutex);
+    }
+    benchUdpReplies = 0;
+}
+
+/* ----------------------------------------------------------------------- */
+/* filter_validate / filter_match, per kernel                              */
+/* ----------------------------------------------------------------------- */
+
+static FILTER benchFilter;
+static char benchAscii[BENCH_TEXT_SIZE+1];
+static char benchUtf8[BENCH_TEXT_SIZE+1];
+
+void bench_filter_text(char dest[], char *words[], int numWords) {
+    // Words until full, then spaces (no sequence is cut)
+    int size = 0, i = 0;
+    while(1) {
+        int len = strlen(words[i%numWords]);
+        if(size+len+1 > BENCH_TEXT_SIZE)
+            break;
+        memcpy(dest+size, words[i%numWords], len);
+        dest[size+len] = ' ';
+        size += len+1;
+        i++;
+    }
+    memset(dest+size, ' ', BENCH_TEXT_SIZE-size);
+    dest[BENCH_TEXT_SIZE] = '\0';
+}
+
+void bench_filter_setup(int kernel) {
+    char *ascii[] = { "The", "quick", "brown", "fox", "jumps", "over", "the", "lazy", "dog,", "see", "you", "at", "lunch!" };
+    char *utf8[] = { "Olá,", "coração", "não", "ação", "5€", "日本語", "😀", "naïve", "Ελληνικά", "привет", "hello", "world" };
+    char *muted[] = { "unsubscribe", "lottery", "winner", "casino", "bitcoin", "crypto", "refund", "prize",
+                      "urgent", "password", "invoice", "discount", "promo", "spam", "click here", "free money" };
+
+    filter_init(&benchFilter);
+    filter_setKernel(&benchFilter, kernel); // falls back if the CPU lacks it
+    int i=0;
+    for(i=0; i<16; i++)
+        filter_addKeyword(&benchFilter, muted[i]);
+
+    bench_filter_text(benchAscii, ascii, 13);
+    bench_filter_text(benchUtf8, utf8, 12);
+}
+
+void bench_filter_scalar_setup(void) {
+    bench_filter_setup(FILTER_KERNEL_SCALAR);
+}
+
+void bench_filter_sse2_setup(void) {
+    bench_filter_setup(FILTER_KERNEL_SSE2);
+}
+
+void bench_filter_avx2_setup(void) {
+    bench_filter_setup(FILTER_KERNEL_AVX2);
+}
+
+void bench_filter_validateAscii_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        filter_validate(&benchFilter, benchAscii, BENCH_TEXT_SIZE);
+}
+
+void bench_filter_validateUtf8_run(int ops) {
+    int i=0;
+    for(i=0; i<ops; i++)
+        filter_validate(&benchFilter, benchUtf8, BENCH_TEXT_SIZE);
+}
+
+void bench_filter_match_run(int ops) {
+    // No keyword in the text: every byte is scanned
+    int i=0;
+    for(i=0; i<ops; i++)
+        filter_match(&benchFilter, benchAscii, BENCH_TEXT_SIZE);
+}
+
+/* ----------------------------------------------------------------------- */
+/* Filter kernels: SIMD results equal to the scalar ones                   */
+/* ----------------------------------------------------------------------- */
+
+static FILTER benchKernels[3];
+static int benchKernelCases = 0;
+static int benchKernelMismatches[3][2]; // by kernel: validate, match
+
+void bench_kernels_case(char *data, int size) {
+    // Exact size copy: kernels must not depend on what follows
+    char *copy = malloc(size>0? size : 1);
+    memcpy(copy, data, size);
+
+    const int valid = filter_validate(&(benchKernels[FILTER_KERNEL_SCALAR]), copy, size);
+    const int match = filter_match(&(benchKernels[FILTER_KERNEL_SCALAR]), copy, size);
+    int k=0, i=0;
+    for(k=FILTER_KERNEL_SSE2; k<=FILTER_KERNEL_AVX2; k++) {
+        if(benchKernels[k].kernel!=k)
+            continue;
+        int v = filter_validate(&(benchKernels[k]), copy, size);
+        int m = filter_match(&(benchKernels[k]), copy, size);
+        if(v==valid && m==match)
+            continue;
+
+        // First few are shown
+        if(benchKernelMismatches[k][0] + benchKernelMismatches[k][1] < 5) {
+            printf("mismatch (%s) size %d: validate %d/%d match %d/%d:", (k==FILTER_KERNEL_SSE2? "sse2" : "avx2"), size, valid, v, match, m);
+            for(i=0; i<size && i<48; i++)
+                printf(" %02x", (unsigned char)copy[i]);
+            printf("%s\n", (size>48? " ..." : ""));
+        }
+        benchKernelMismatches[k][0] += (v!=valid);
+        benchKernelMismatches[k][1] += (m!=match);
+    }
+
+    benchKernelCases++;
+    free(copy);
+}
+
+void bench_kernels_embed(char *piece, int len) {
+    // At every offset around the 16 and 32-byte block edges, with no tail, a short one and a block-long one
+    char text[128];
+    int offset=0, t=0;
+    const int tails[] = { 0, 1, 17 };
+    for(offset=0; offset<=70; offset++) {
+        for(t=0; t<3; t++) {
+            int size = offset+len+tails[t];
+            memset(text, 'a', size);
+            memcpy(text+offset, piece, len);
+            bench_kernels_case(text, size);
+
+            // Cut inside the piece: truncated sequences and keywords
+            if(len>1)
+                bench_kernels_case(text, offset+len-1);
+        }
+    }
+}
+
+int bench_kernels(void) {
+    char *muted[] = { "unsubscribe", "lottery", "winner", "casino", "bitcoin", "crypto", "refund", "prize",
+                      "urgent", "password", "invoice", "discount", "promo", "spam", "click here", "free money" };
+    int k=0, i=0, j=0;
+    for(k=FILTER_KERNEL_SCALAR; k<=FILTER_KERNEL_AVX2; k++) {
+        filter_init(&(benchKernels[k]));
+        filter_setKernel(&(benchKernels[k]), k); // falls back if the CPU lacks it
+        for(i=0; i<16; i++)
+            filter_addKeyword(&(benchKernels[k]), muted[i]);
+        benchKernelMismatches[k][0] = benchKernelMismatches[k][1] = 0;
+    }
+    benchKernelCases = 0;
+
+    // Valid text, as benchmarked
+    bench_filter_setup(FILTER_KERNEL_SCALAR);
+    for(i=0; i<=BENCH_TEXT_SIZE; i+=7) {
+        bench_kernels_case(benchAscii, i);
+        bench_kernels_case(benchUtf8, i);
+    }
+
+    // Valid and invalid sequences, controls, and keywords in any case
+    char *pieces[] = {
+        "é", "€", "日", "😀", "\t", "\n",                           // valid
+        "\x80", "\xBF", "\xC0\x80", "\xC1\xBF", "\xE0\x80\x80",      // stray continuations, overlongs
+        "\xED\xA0\x80", "\xF0\x80\x80\x80", "\xF4\x90\x80\x80",      // surrogate, overlong, above U+10FFFF
+        "\xF5\x80\x80\x80", "\xFF", "\xC3", "\xE2\x82", "\xF0\x9F\x98", // bad leads, truncated
+        "\xC3\x28", "\xE2\x28\xA1",                                  // missing continuation
+        "\x01", "\x1B", "\r", "\x7F", "\xC2\x80", "\xC2\x9F",        // C0, DEL, C1 controls
+        "spam", "SPAM", "Click Here", "free money", "lottery", "prize", "urgent",
+        "spa", "click her", "sp\xC3\xA1m", "pr\x01ize",
+    };
+    const int numPieces = sizeof(pieces)/sizeof(char*);
+    for(i=0; i<numPieces; i++)
+        bench_kernels_embed(pieces[i], strlen(pieces[i]));
+
+    // Random bytes, mostly ASCII letters and UTF-8 bits
+    const unsigned char alphabet[] = { 'a', 'p', 's', 'm', 'S', 'P', ' ', '\t', 0x01, 0x7F, 0x80, 0xA0, 0xBF, 0xC2, 0xC3, 0xE2, 0xED, 0xF0, 0xF4, 0xFF };
+    char text[256];
+    for(i=0; i<50000; i++) {
+        int size = bench_rand()%sizeof(text);
+        for(j=0; j<size; j++)
+            text[j] = (bench_rand()%4==0? alphabet[bench_rand()%sizeof(alphabet)] : 'a' + bench_rand()%26);
+        bench_kernels_case(text, size);
+    }
+
+    int failed = 0;
+    for(k=FILTER_KERNEL_SSE2; k<=FILTER_KERNEL_AVX2; k++) {
+        char name[64];
+        sprintf(name, "filter kernels agree (%s)", (k==FILTER_KERNEL_SSE2? "sse2" : "avx2"));
+        if(benchKernels[k].kernel!=k) {
+            printf("%-32s %10s\n", name, "n/a");
+            continue;
+        }
+        printf("%-32s %10d %12d %12d\n", name, benchKernelCases, benchKernelMismatches[k][0], benchKernelMismatches[k][1]);
+        failed += benchKernelMismatches[k][0] + benchKernelMismatches[k][1];
+    }
+
+    return failed;
+}
+
+/* ----------------------------------------------------------------------- */
+/* Gossip: rounds for a goodbye to reach every node of a full mesh         */
+/* ----------------------------------------------------------------------- */
+
+void bench_gossip_address(int node, char username[32], char ip[16]) {
+    sprintf(username, "user%d", node);
+    sprintf(ip, "10.%d.%d.%d", (node>>16)&255, (node>>8)&255, node&255);
+}
+
+void bench_gossip_exchange(GOSSIP *nodes, int from, int to, double now, long *frames, long *bytes) {
+    // syn, ack, ack2 in memory, as messenger_conn_dispatch would
+    char fromName[32], fromIp[16], toName[32], toIp[16];
+    bench_gossip_address(from, fromName, fromIp);
+    bench_gossip_address(to, toName, toIp);
+
+    char syn[MSG_MAX_SIZE+1], ack[MSG_MAX_SIZE+1], ack2[MSG_MAX_SIZE+1];
+    int size = gossip_syn(&(nodes[from]), syn, MSG_MAX_SIZE);
+    syn[size] = '\0';
+    (*frames)++;
+    *bytes += size;
+
+    size = gossip_handle(&(nodes[to]), fromName, fromIp, toIp, syn, ack, MSG_MAX_SIZE, now);
+    if(size==0)
+        return;
+    ack[size] = '\0';
+    (*frames)++;
+    *bytes += size;
+
+    size = gossip_handle(&(nodes[from]), toName, toIp, fromIp, ack, ack2, MSG_MAX_SIZE, now);
+    if(size==0)
+        return;
+    ack2[size] = '\0';
+    (*frames)++;
+    *bytes += size;
+    gossip_handle(&(nodes[to]), fromName, fromIp, toIp, ack2, ack, MSG_MAX_SIZE, now);
+}
+
+void bench_gossip(int numNodes) {
+    GOSSIP *nodes = malloc(numNodes*sizeof(GOSSIP));
+    char username[32], ip[16];
+
+    // Converged: everybody knows everybody, nothing recently changed
+    int i=0, j=0;
+    double now = 0;
+    for(i=0; i<numNodes; i++) {
+        gossip_init(&(nodes[i]));
+        bench_gossip_address(i, username, ip);
+        gossip_setUsername(&(nodes[i]), username);
+        nodes[i].version = 1;
+        nodes[i].seed = i+1;
+        for(j=0; j<numNodes; j++) {
+            if(j==i)
+                continue;
+            bench_gossip_address(j, username, ip);
+            gossip_update(&(nodes[i]), username, ip, 1, 1, now);
+        }
+        nodes[i].round = GOSSIP_HOT;
+    }
+
+    // Node 0 leaves; every node talks to GOSSIP_FANOUT random others per round
+    gossip_leave(&(nodes[0]));
+    bench_gossip_address(0, username, ip);
+    long frames = 0, bytes = 0;
+    int round=0;
+    for(round=1; round<=BENCH_GOSSIP_ROUNDS; round++) {
+        now += GOSSIP_INTERVAL;
+        for(i=0; i<numNodes; i++) {
+            gossip_tick(&(nodes[i]), now);
+            for(j=0; j<GOSSIP_FANOUT; j++) {
+                int peer = gossip_random(&(nodes[i]), numNodes-1);
+                bench_gossip_exchange(nodes, i, (peer>=i? peer+1 : peer), now, &frames, &bytes);
+            }
+        }
+
+        int informed = 0;
+        for(i=1; i<numNodes; i++) {
+            GOSSIP_RECORD *record = gossip_find(&(nodes[i]), username, ip);
+            informed += (record!=NULL && !record->online);
+        }
+        if(informed==numNodes-1)
+            break;
+    }
+
+    if(round>BENCH_GOSSIP_ROUNDS)
+        printf("%-32s %10d %12s\n", "gossip goodbye (full mesh)", numNodes, "never");
+    else
+        printf("%-32s %10d %12d %12.2f %12.0f\n", "gossip goodbye (full mesh)", numNodes, round, (double)frames/numNodes/round, (double)bytes/numNodes/round);
+
+    for(i=0; i<numNodes; i++)
+        gossip_destroy(&(nodes[i]));
+    free(nodes);
+}
+
+/* ----------------------------------------------------------------------- */
+/* Merkle reconciliation: bytes to find what one side missed               */
+/* ----------------------------------------------------------------------- */
+
+void bench_merkle_walk(MERKLE_TREE *a, MERKLE_TREE *b, int level, uint32_t prefix, long *frames, long *bytes) {
+    // Same walk as messenger_sync_handle: one "node" frame per differing node, hash lists per differing bucket
+    uint64_t mine[MERKLE_FANOUT], theirs[MERKLE_FANOUT];
+    merkle_children(a, level, prefix, mine);
+    merkle_children(b, level, prefix, theirs);
+    (*frames)++;
+    *bytes += 16 + 20*MERKLE_FANOUT;
+
+    int c=0;
+    for(c=0; c<MERKLE_FANOUT; c++) {
+        uint32_t child = prefix*MERKLE_FANOUT + c;
+        if(mine[c]==theirs[c])
+            continue;
+        if(level-1>0) {
+            bench_merkle_walk(a, b, level-1, child, frames, bytes);
+        } else {
+            // bucket + have, then want + msgs for the missing ones
+            int first = 0;
+            int numA = merkle_bucket(a, child, &first);
+            int numB = merkle_bucket(b, child, &first);
+            int missing = (numA>numB? numA-numB : numB-numA);
+            *frames += 4;
+            *bytes += 17*(numA+numB) + 17*missing + (24+BENCH_SYNC_TEXT)*missing;
+        }
+    }
+}
+
+void bench_merkle(int numMessages, int numMissing) {
+    // One message every 10 s; the peer lacks the last numMissing
+    MERKLE_TREE a, b;
+    merkle_init(&a);
+    merkle_init(&b);
+    const time_t start = 1700000000;
+    int i=0;
+    for(i=0; i<numMessages; i++) {
+        time_t sent = start + (time_t)i*10;
+        char text[32];
+        sprintf(text, "message %d", i);
+        uint64_t hash = merkle_messageHash("alice", sent, text);
+        merkle_add(&a, hash, sent, i);
+        if(i<numMessages-numMissing)
+            merkle_add(&b, hash, sent, i);
+    }
+
+    TIMER t;
+    timer_start(&t);
+    merkle_build(&a);
+    merkle_build(&b);
+    int equal = (merkle_root(&a)==merkle_root(&b));
+    timer_stop(&t);
+
+    long frames = 1, bytes = 22; // root
+    if(!equal)
+        bench_merkle_walk(&a, &b, MERKLE_LEVELS, 0, &frames, &bytes);
+
+    printf("%-32s %10d %12d %12ld %12ld %12ld %12.0f\n", "merkle reconcile", numMessages, numMissing, frames, bytes,
+           (long)numMessages*(24+BENCH_SYNC_TEXT), timer_timensec(&t)/1e3);
+
+    merkle_destroy(&a);
+    merkle_destroy(&b);
+}
+
+/* ----------------------------------------------------------------------- */
+/* Idle peers: memory per connected peer that says nothing                 */
+/* ----------------------------------------------------------------------- */
+
+long bench_rss(void) {
+    // Resident bytes, from /proc/self/statm (pages)
+    long size = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if(file==NULL)
+        return 0;
+    if(fscanf(file, "%ld %ld", &size, &resident)!=2)
+        resident = 0;
+    fclose(file);
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+int bench_threads(void) {
+    // Threads of this process, from /proc/self/status
+    char line[128];
+    int threads = 0;
+    FILE *file = fopen("/proc/self/status", "r");
+    if(file==NULL)
+        return 0;
+    while(fgets(line, sizeof(line), file)!=NULL)
+        if(sscanf(line, "Threads: %d", &threads)==1)
+            break;
+    fclose(file);
+    return threads;
+}
+
+int bench_idle_peers(void) {
+    // Both ends of every connection are ours: half the open file limit, raised as far as allowed
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    long peers = ((long)limit.rlim_cur-64)/2;
+    return (peers<BENCH_IDLE_PEERS? (int)peers : BENCH_IDLE_PEERS);
+}
+
+int bench_idle(char *name, int eventLoop, int numPeers) {
+    // One tenant on a loopback node; peers greet, then stay silent. Returns 1 if the node missed peers, or
+    // the event loop went over PEER_BUDGET (a thread each is shown for comparison, it has no budget)
+    setenv("MESSENGER_EVENTLOOP", (eventLoop? "1" : "0"), 1);
+    char snapshot[64];
+    sprintf(snapshot, "messenger-%s.snap", "idle");
+    unlink(snapshot);
+
+    NODE node;
+    node_init(&node);
+    if(node_start(&node, BENCH_IDLE_PORT)==-1) {
+        printf("%-32s failed to listen on port %d (%s)\n", name, BENCH_IDLE_PORT, strerror(errno));
+        node_destroy(&node);
+        return 1;
+    }
+    MESSENGER *tenant = node_addTenant(&node, "idle");
+
+    int *socks = malloc(numPeers*sizeof(int));
+    memset(socks, 0, numPeers*sizeof(int));
+    const long rssBefore = bench_rss();
+    const int threadsBefore = bench_threads();
+
+    struct sockaddr_in addr, source;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BENCH_IDLE_PORT);
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+
+    int connected = 0, i=0;
+    for(i=0; i<numPeers; i++) {
+        // Sources spread over 127.x.0.1: one address has ~28k ephemeral ports
+        socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+        source.sin_addr.s_addr = htonl(0x7F000001 | ((1+i/20000) << 16));
+        if(socks[i]==-1 || bind(socks[i], (struct sockaddr*)&source, sizeof(source))==-1
+                || connect(socks[i], (struct sockaddr*)&addr, sizeof(addr))==-1) {
+            printf("%-32s stopped at %d peers (%s)\n", name, i, strerror(errno));
+            if(socks[i]!=-1)
+                close(socks[i]);
+            break;
+        }
+
+        char username[32], frame[MSG_HEADER_SIZE+32];
+        int len = sprintf(username, "peer%d", i);
+        len = messenger_msg_encode(MSGTYPE_USERNAME, username, len, frame);
+        send(socks[i], frame, len, MSG_NOSIGNAL);
+        connected++;
+    }
+
+    // Until the node handed every peer over, or is done greeting (a storm can delay a first frame past NODE_GREET_TIMEOUT)
+    TIMER t;
+    timer_start(&t);
+    int numConn = 0, settled = 0;
+    while(1) {
+        messenger_lock(tenant);
+        numConn = tenant->numConn;
+        messenger_unlock(tenant);
+        int greeted = (__sync_fetch_and_add(&(node.greeting), 0)==0 && !server_hasNewConnections(&(node.server)));
+        settled = (greeted? settled+1 : 0);
+        timer_stop(&t);
+        if((numConn==connected && greeted) || settled>=2 || timer_timemsec(&t)>BENCH_IDLE_WAIT)
+            break;
+        msleep(100);
+    }
+
+    const long rss = bench_rss() - rssBefore;
+    const int threads = bench_threads() - threadsBefore;
+    messenger_lock(tenant);
+    const long accounted = messenger_memory(tenant);
+    messenger_unlock(tenant);
+
+    const int n = (numConn>0? numConn : 1);
+    int failed = 0;
+    if(eventLoop) {
+        failed = (rss/n > PEER_BUDGET);
+        printf("%-32s %10d %12d %12ld %12ld %12d %12s\n", name, numConn, threads, rss/n, accounted/n, PEER_BUDGET, (failed? "no" : "yes"));
+    } else {
+        printf("%-32s %10d %12d %12ld %12ld %12s %12s\n", name, numConn, threads, rss/n, accounted/n, "-", "-");
+    }
+    if(numConn<connected) {
+        printf("%-32s %d of %d peers not handed over\n", name, connected-numConn, connected);
+        failed = 1;
+    }
+
+    // Tenant side first: peers closing one by one would each be looked up in the whole list
+    node_stop(&node);
+    node_destroy(&node);
+    for(i=0; i<connected; i++)
+        close(socks[i]);
+    free(socks);
+    unlink(snapshot);
+    unsetenv("MESSENGER_EVENTLOOP");
+
+    return failed;
+}
+
+/* ----------------------------------------------------------------------- */
+/* Runner                                                                  */
+/* ----------------------------------------------------------------------- */
+
+double bench_cpuNsec(struct rusage *before, struct rusage *after) {
+    // User + system time, all threads
+    double sec = (after->ru_utime.tv_sec - before->ru_utime.tv_sec) + (after->ru_stime.tv_sec - before->ru_stime.tv_sec);
+    double usec = (after->ru_utime.tv_usec - before->ru_utime.tv_usec) + (after->ru_stime.tv_usec - before->ru_stime.tv_usec);
+    return sec*1e9 + usec*1e3;
+}
+
+void bench_exec(BENCH *bench) {
+    TIMER t;
+    double best = -1, total = 0, cpu = 0;
+    long allocs = 0;
+
+    int rep=0;
+    for(rep=0; rep<BENCH_WARMUP+BENCH_REPS; rep++) {
+        if(bench->setup!=NULL)
+            bench->setup();
+
+        struct rusage usageBefore, usageAfter;
+        long allocsBefore = allocCount;
+        getrusage(RUSAGE_SELF, &usageBefore);
+        timer_start(&t);
+        bench->run(bench->ops);
+        timer_stop(&t);
+        getrusage(RUSAGE_SELF, &usageAfter);
+        long allocsAfter = allocCount;
+
+        if(bench->teardown!=NULL)
+            bench->teardown();
+
+        // Skip warmup repetitions
+        if(rep<BENCH_WARMUP)
+            continue;
+
+        double nsop = timer_timensec(&t)/bench->ops;
+        if(best<0 || nsop<best)
+            best = nsop;
+        total += nsop;
+        allocs += allocsAfter - allocsBefore;
+        cpu += bench_cpuNsec(&usageBefore, &usageAfter)/bench->ops;
+    }
+
+    printf("%-32s %10d %12.1f %12.1f %12.1f %12.2f\n", bench->name, bench->ops, best, total/BENCH_REPS, cpu/BENCH_REPS, (double)allocs/((double)bench->ops*BENCH_REPS));
+}
+
+int bench_compareDouble(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x>y) - (x<y);
+}
+
+void bench_latency(LATENCY_BENCH *bench) {
+    double *samples = malloc(BENCH_RTT_SAMPLES*sizeof(double));
+    TIMER t;
+
+    if(bench->setup!=NULL)
+        bench->setup();
+
+    // Warmup, then one sample per round trip
+    int i=0;
+    for(i=0; i<BENCH_RTT_SAMPLES/10; i++)
+        bench->roundTrip();
+    for(i=0; i<BENCH_RTT_SAMPLES; i++) {
+        timer_start(&t);
+        bench->roundTrip();
+        timer_stop(&t);
+        samples[i] = timer_timensec(&t);
+    }
+
+    if(bench->teardown!=NULL)
+        bench->teardown();
+
+    qsort(samples, BENCH_RTT_SAMPLES, sizeof(double), &bench_compareDouble);
+    printf("%-32s %10d %12.1f %12.1f %12.1f %12.1f\n", bench->name, BENCH_RTT_SAMPLES, samples[BENCH_RTT_SAMPLES/2],
+           samples[BENCH_RTT_SAMPLES*99/100], samples[BENCH_RTT_SAMPLES*999/1000], samples[BENCH_RTT_SAMPLES-1]);
+    free(samples);
+}
+
+int main(int argc, char *argv[]) {
+    BENCH benches[] = {
+        { "connection_push/pop (4 prod)", 20000, &bench_inbox_setup, &bench_inbox_run, &bench_inbox_teardown },
+        { "messenger_msg_encode", 5000000, NULL, &bench_encode_run, NULL },
+        { "messenger_conn_getConnByIP", 200000, &bench_lookup_setup, &bench_lookup_byIP_run, &bench_lookup_teardown },
+        { "messenger_conn_getConnPosByIP", 200000, &bench_lookup_setup, &bench_lookup_posByIP_run, &bench_lookup_teardown },
+        { "messenger_conn_connected2", 200000, &bench_lookup_setup, &bench_lookup_connected2_run, &bench_lookup_teardown },
+        { "messenger_conn_getConnByPos", 5000000, &bench_lookup_setup, &bench_lookup_byPos_run, &bench_lookup_teardown },
+        { "server_add/getNewConnections", 20000, &bench_server_setup, &bench_server_run, &bench_server_teardown },
+        { "lanes_push/pop", 1000000, NULL, &bench_lanes_run, NULL },
+        { "history_add", 100000, NULL, &bench_history_add_run, NULL },
+        { "history_search (1M, all)", 200, &bench_history_setup, &bench_history_search_all_run, NULL },
+        { "history_search (1M, 7 days)", 200, &bench_history_setup, &bench_history_search_week_run, NULL },
+        { "tcp round trip (loopback)", 20000, &bench_tcp_setup, &bench_tcp_run, &bench_tcp_teardown },
+        { "tcp round trip (low latency)", 20000, &bench_tcpll_setup, &bench_tcpll_run, &bench_tcpll_teardown },
+        { "udp round trip (loopback)", 20000, &bench_udp_setup, &bench_udp_run, &bench_udp_teardown },
+        { "filter_validate ascii (scalar)", 20000, &bench_filter_scalar_setup, &bench_filter_validateAscii_run, NULL },
+        { "filter_validate ascii (sse2)", 20000, &bench_filter_sse2_setup, &bench_filter_validateAscii_run, NULL },
+        { "filter_validate ascii (avx2)", 20000, &bench_filter_avx2_setup, &bench_filter_validateAscii_run, NULL },
+        { "filter_validate utf8 (scalar)", 20000, &bench_filter_scalar_setup, &bench_filter_validateUtf8_run, NULL },
+        { "filter_validate utf8 (sse2)", 20000, &bench_filter_sse2_setup, &bench_filter_validateUtf8_run, NULL },
+        { "filter_validate utf8 (avx2)", 20000, &bench_filter_avx2_setup, &bench_filter_validateUtf8_run, NULL },
+        { "filter_match 16 kw (scalar)", 2000, &bench_filter_scalar_setup, &bench_filter_match_run, NULL },
+        { "filter_match 16 kw (sse2)", 20000, &bench_filter_sse2_setup, &bench_filter_match_run, NULL },
+        { "filter_match 16 kw (avx2)", 20000, &bench_filter_avx2_setup, &bench_filter_match_run, NULL },
+    };
+    const int numBenches = sizeof(benches)/sizeof(BENCH);
+
+    LATENCY_BENCH latencies[] = {
+        { "tcp round trip (loopback)", &bench_tcp_setup, &bench_tcp_roundTrip, &bench_tcp_teardown },
+        { "tcp round trip (low latency)", &bench_tcpll_setup, &bench_tcpll_roundTrip, &bench_tcpll_teardown },
+    };
+    const int numLatencies = sizeof(latencies)/sizeof(LATENCY_BENCH);
+
+    // Run only benches matching argv[1], if given
+    char *filter = (argc>1? argv[1] : NULL);
+
+    printf("Warmup: %d, repetitions: %d, contacts: %d, producers: %d\n\n", BENCH_WARMUP, BENCH_REPS, BENCH_CONTACTS, BENCH_PRODUCERS);
+    printf("%-32s %10s %12s %12s %12s %12s\n", "benchmark", "ops", "min ns/op", "avg ns/op", "cpu ns/op", "allocs/op");
+
+    int i=0;
+    for(i=0; i<numBenches; i++) {
+        if(filter!=NULL && strstr(benches[i].name, filter)==NULL)
+            continue;
+        bench_exec(&benches[i]);
+    }
+
+    // SIMD kernels checked against the scalar ones, next to their timings
+    int mismatches = 0, failures = 0;
+    if(filter==NULL || strstr("filter kernels agree", filter)!=NULL) {
+        printf("\n%-32s %10s %12s %12s\n", "kernels", "cases", "validate !=", "match !=");
+        mismatches = bench_kernels();
+    }
+
+    // Tail latency, for the round trips
+    printf("\n%-32s %10s %12s %12s %12s %12s\n", "round trip", "samples", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for(i=0; i<numLatencies; i++) {
+        if(filter!=NULL && strstr(latencies[i].name, filter)==NULL)
+            continue;
+        bench_latency(&latencies[i]);
+    }
+
+    // Spread of one change with bounded frames per round: O(log N) rounds
+    if(filter==NULL || strstr("gossip goodbye (full mesh)", filter)!=NULL) {
+        printf("\n%-32s %10s %12s %12s %12s\n", "gossip", "nodes", "rounds", "frames/node", "bytes/node");
+        for(i=64; i<=1024; i*=4)
+            bench_gossip(i);
+    }
+
+    // History catch-up after a partition: cost follows what is missing, not history size
+    if(filter==NULL || strstr("merkle reconcile", filter)!=NULL) {
+        printf("\n%-32s %10s %12s %12s %12s %12s %12s\n", "merkle", "messages", "missing", "frames", "bytes", "resend bytes", "build+root us");
+        bench_merkle(10000, 1);
+        bench_merkle(10000, 100);
+        bench_merkle(100000, 1);
+        bench_merkle(100000, 100);
+    }
+
+    // Per-peer cost of connected but silent peers (event loop first: later runs reuse freed memory)
+    if(filter==NULL || strstr("idle peers", filter)!=NULL) {
+        printf("\n%-32s %10s %12s %12s %12s %12s %12s\n", "idle", "peers", "threads", "rss B/peer", "acct B/peer", "budget B", "in budget");
+        const int numPeers = bench_idle_peers();
+        failures += bench_idle("idle peers (event loop)", 1, numPeers);
+        failures += bench_idle("idle peers (thread each)", 0, numPeers);
+    }
+
+    return (mismatches>0 || failures>0? 1 : 0);
+}
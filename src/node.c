@@ -0,0 +1,370 @@
+
+#include "node.h"
+#include "timer.h"
+#include "client.h"
+#include "trace.h"
+
+void node_init(NODE *node) {
+    node->numTenants = 0;
+    node->tenants = NULL;
+    node->greeting = 0;
+
+    // Server init
+    server_init(&(node->server));
+
+    // One I/O thread for every tenant's peers (started on start)
+    poller_init(&(node->poller), (POLLER_CALLBACK)&node_poll_readable, (POLLER_SPIN)&node_poll_spin, node);
+
+    // Mutex for thread-safe
+    pthread_mutex_init(&(node->mutex), NULL);
+}
+
+void node_destroy(NODE *node) {
+    // Destroy server
+    server_destroy(&(node->server));
+
+    // Free tenants
+    int i=0;
+    for(i=0; i<node->numTenants; i++) {
+        messenger_destroy(node->tenants[i]);
+        free(node->tenants[i]);
+    }
+    free(node->tenants);
+    node->tenants = NULL;
+    node->numTenants = 0;
+
+    // After the tenants, which take their sockets out of it
+    poller_destroy(&(node->poller));
+
+    pthread_mutex_destroy(&(node->mutex));
+}
+
+int node_start(NODE *node, int port) {
+    // Single listener for all tenants
+    if(server_start(&(node->server), port)==-1)
+        return -1;
+
+    // Low-latency or event-loop mode: tenants added from now on share this I/O thread
+    CONFIG config;
+    config_load(&config);
+    if(config.lowLatency || config.eventLoop) {
+        int retn = poller_start(&(node->poller), (config.lowLatency? config.cpu : -1), (config.lowLatency? 0 : POLLER_WAIT));
+        if(retn==-1)
+            printf(">> %s mode disabled.\n>> Error: %s.\n", (config.lowLatency? "Low-latency" : "Event-loop"), strerror(errno));
+        else if(retn==0)
+            printf(">> Low-latency I/O thread not pinned to CPU %d.\n>> Error: %s.\n", config.cpu, strerror(errno));
+    }
+
+    // Start connection handler thread
+    pthread_create(&(node->thread), NULL, (void*)&node_run, (void*)node);
+
+    return 1;
+}
+
+void node_stop(NODE *node) {
+    // Stop accepting connections
+    server_stop(&(node->server));
+    pthread_cancel(node->thread);
+    pthread_join(node->thread, NULL);
+
+    // Connections still waiting for their first frame give up after NODE_GREET_TIMEOUT
+    while(__sync_fetch_and_add(&(node->greeting), 0)>0)
+        msleep(10);
+
+    // Shared I/O thread before the tenants, it may be waiting for their locks
+    poller_stop(&(node->poller));
+
+    // Stop tenants (saves their snapshots)
+    int i=0;
+    for(i=0; i<node->numTenants; i++) {
+        MESSENGER *tenant = node->tenants[i];
+        pthread_mutex_lock(&(tenant->mutex));
+        messenger_stop(tenant);
+        pthread_mutex_unlock(&(tenant->mutex));
+    }
+}
+
+void node_run(NODE *node) {
+    TIMER t, snapshotTimer;
+    timer_start(&snapshotTimer);
+    trace_threadName("node");
+
+    // Node handler loop
+    while(1) {
+        timer_start(&t);
+
+        // Check new incoming connections, until none are left
+        int socks[8];
+        int n = 0, i=0;
+        while((n = server_getNewConnections(&(node->server), socks, 8))>0) {
+            // Owner is only known after the first frame: read it on its own thread
+            for(i=0; i<n; i++) {
+                PTHREAD_GREET_ARG *args = malloc(sizeof(PTHREAD_GREET_ARG));
+                args->node = node;
+                args->socket = socks[i];
+
+                pthread_t thread;
+                __sync_fetch_and_add(&(node->greeting), 1);
+                if(messenger_startThread(&thread, (void*)&node_greet, (void*)args)!=0) {
+                    client_disconnect(socks[i]);
+                    free(args);
+                    __sync_fetch_and_sub(&(node->greeting), 1);
+                    continue;
+                }
+                pthread_detach(thread);
+            }
+        }
+
+        // Periodic snapshot of every tenant
+        timer_stop(&snapshotTimer);
+        if(timer_timemsec(&snapshotTimer) >= SNAPSHOT_INTERVAL) {
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            pthread_mutex_lock(&(node->mutex));
+            for(i=0; i<node->numTenants; i++) {
+                MESSENGER *tenant = node->tenants[i];
+                messenger_lock(tenant);
+                messenger_snapshot_save(tenant);
+                messenger_unlock(tenant);
+            }
+            pthread_mutex_unlock(&(node->mutex));
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            timer_start(&snapshotTimer);
+        }
+
+        // Presence rounds and shm retries of every tenant
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&(node->mutex));
+        for(i=0; i<node->numTenants; i++) {
+            MESSENGER *tenant = node->tenants[i];
+            messenger_lock(tenant);
+            if(gossip_tick(&(tenant->gossip), timer_nowmsec()))
+                messenger_gossip_round(tenant);
+            messenger_shm_retry(tenant);
+            messenger_unlock(tenant);
+        }
+        pthread_mutex_unlock(&(node->mutex));
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+        // kill -USR1
+        if(trace_dumpRequested())
+            trace_dump(TRACE_FILE);
+
+        timer_stop(&t);
+
+        // Loop time control
+        double rest = THREAD_LOOP_TIME - timer_timemsec(&t);
+        if(rest>0)
+            msleep(rest);
+    }
+}
+
+void node_greet(PTHREAD_GREET_ARG *args) {
+    // Parse args
+    NODE *node = args->node;
+    const int sock = args->socket;
+    free(args);
+
+    // First frame, with a deadline
+    struct timeval timeout;
+    timeout.tv_sec = NODE_GREET_TIMEOUT/1000;
+    timeout.tv_usec = (NODE_GREET_TIMEOUT%1000)*1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char msgType = 0;
+    char recvBuffer[MSG_MAX_SIZE+1];
+    int retn = messenger_msg_recv(sock, &msgType, recvBuffer, MSG_MAX_SIZE);
+
+    timeout.tv_sec = timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Target identity, or the first tenant for peers that don't name one
+    MESSENGER *tenant = NULL;
+    if(retn>0) {
+        pthread_mutex_lock(&(node->mutex));
+        if(msgType==MSGTYPE_TARGET)
+            tenant = node_getTenant(node, recvBuffer);
+        else
+            tenant = node_getTenantByPos(node, 0);
+        pthread_mutex_unlock(&(node->mutex));
+    }
+
+    if(tenant==NULL) {
+        client_disconnect(sock);
+        __sync_fetch_and_sub(&(node->greeting), 1);
+        return;
+    }
+
+    // Hand the connection over to the tenant
+    uint64_t span = trace_begin();
+    messenger_lock(tenant);
+    CONNECTION *conn = messenger_conn_accept(tenant, sock);
+    if(msgType!=MSGTYPE_TARGET) {
+        messenger_conn_account(tenant, conn, retn); // first frame of a new peer, its bucket starts at burst: no pause
+        capture_frame(&(tenant->capture), conn->captureId, CAPTURE_IN, msgType, recvBuffer, retn-1);
+        messenger_conn_dispatch(tenant, conn, msgType, recvBuffer, retn-1);
+    }
+    messenger_conn_start(tenant, conn);
+    messenger_unlock(tenant);
+    trace_end("accept", span);
+
+    __sync_fetch_and_sub(&(node->greeting), 1);
+}
+
+void node_poll_readable(NODE *node, CONNECTION *conn) {
+    // Tenants only register connections they own
+    messenger_poll_readable((MESSENGER*)conn->owner, conn);
+}
+
+void node_poll_spin(NODE *node) {
+    pthread_mutex_lock(&(node->mutex));
+    int i=0;
+    for(i=0; i<node->numTenants; i++)
+        messenger_poll_spin(node->tenants[i]);
+    pthread_mutex_unlock(&(node->mutex));
+}
+
+MESSENGER* node_addTenant(NODE *node, char *username) {
+    // Usernames name the snapshot file too (over 31 characters they would be cut, and could clash)
+    if(username[0]=='\0' || strlen(username)>31 || strchr(username, '/')!=NULL || node_getTenant(node, username)!=NULL)
+        return NULL;
+
+    MESSENGER *tenant = malloc(sizeof(MESSENGER));
+    messenger_init(tenant);
+    if(node->poller.running)
+        tenant->io = &(node->poller);
+    messenger_host(tenant, username);
+
+    pthread_mutex_lock(&(node->mutex));
+
+    // Realloc list
+    node->tenants = realloc(node->tenants, (node->numTenants+1)*sizeof(MESSENGER*));
+
+    // Add element
+    node->tenants[node->numTenants] = tenant;
+
+    // Inc counter
+    (node->numTenants)++;
+
+    pthread_mutex_unlock(&(node->mutex));
+
+    return tenant;
+}
+
+MESSENGER* node_getTenant(NODE *node, char *username) {
+    // Search on tenant list, and return
+    int i;
+    for(i=0; i<node->numTenants; i++)
+        if(strcmp(node->tenants[i]->username, username)==0)
+            return node->tenants[i];
+    return NULL;
+}
+
+MESSENGER* node_getTenantByPos(NODE *node, int pos) {
+    if(pos<0 || pos>=node->numTenants)
+        return NULL;
+    return node->tenants[pos];
+}
+
+void node_menu(NODE *node) {
+    int running = 1;
+
+    // Node menu loop
+    while(running) {
+        __fpurge(stdin);
+        messenger_menu_clear();
+        printf("################# Node menu #################\n");
+        printf("Hosting %d identities.\n\n", node->numTenants);
+        printf("1- Choose identity\n2- Statistics\n3- Quit\n");
+        printf("\nChoose option: ");
+
+        int option = getchar();
+        __fpurge(stdin);
+        if(option!='3')
+            messenger_menu_clear();
+
+        int invalidOption = 0;
+        switch (option) {
+            case '1':
+                node_menu_chooseTenant(node);
+                break;
+            case '2':
+                node_menu_statistics(node);
+                break;
+            case '3':
+                node_stop(node);
+                running = 0;
+                break;
+            default:
+                invalidOption = 1;
+                break;
+        }
+
+        // Identity menu has its own way back
+        if(!invalidOption && option=='2') {
+            printf("\nPress <ENTER> to go back to menu...");
+            getchar();
+        }
+    }
+
+    printf("\nSee you!\n\n");
+}
+
+void node_menu_chooseTenant(NODE *node) {
+    printf("################# Identities #################\n");
+
+    // Show tenants
+    int i;
+    for(i=0; i<node->numTenants; i++)
+        printf("%d- %s\n", i+1, node->tenants[i]->username);
+
+    // Choose tenant
+    int tenant=0;
+    do {
+        __fpurge(stdin);
+        printf("\n>> Choose identity (0 to exit): ");
+        scanf("%d", &tenant);
+        __fpurge(stdin);
+        if(tenant==0)
+            return;
+    } while(tenant<0 || tenant>node->numTenants);
+
+    messenger_menu(node->tenants[tenant-1]);
+}
+
+void node_menu_statistics(NODE *node) {
+    printf("################# Statistics #################\n");
+
+    long framesIn=0, bytesIn=0, framesOut=0, bytesOut=0, memory=0;
+    int contacts=0;
+
+    // Per tenant
+    pthread_mutex_lock(&(node->mutex));
+    int i=0, j=0;
+    for(i=0; i<node->numTenants; i++) {
+        MESSENGER *tenant = node->tenants[i];
+        pthread_mutex_lock(&(tenant->mutex));
+
+        int unread = 0;
+        for(j=0; j<tenant->numConn; j++)
+            unread += connection_numMessages(tenant->conn[j]);
+
+        STATS *stats = &(tenant->stats);
+        long tenantMemory = messenger_memory(tenant);
+        printf("%d- %s: %d contacts, in %ld/%ld, out %ld/%ld (frames/bytes), %d messages in history, %d unread\n", i+1, tenant->username,
+               tenant->numConn, stats->framesIn, stats->bytesIn, stats->framesOut, stats->bytesOut, tenant->history.numEntries, unread);
+        printf("   memory: %ld bytes held for its peers\n", tenantMemory);
+
+        contacts += tenant->numConn;
+        framesIn += stats->framesIn;
+        bytesIn += stats->bytesIn;
+        framesOut += stats->framesOut;
+        bytesOut += stats->bytesOut;
+        memory += tenantMemory;
+
+        pthread_mutex_unlock(&(tenant->mutex));
+    }
+    pthread_mutex_unlock(&(node->mutex));
+
+    // Totals
+    printf("\nTotal: %d identities, %d contacts, in %ld/%ld, out %ld/%ld (frames/bytes), %ld bytes held for peers\n", node->numTenants, contacts, framesIn, bytesIn, framesOut, bytesOut, memory);
+}
@@ -0,0 +1,49 @@
+#ifndef NODE_H
+#define NODE_H
+
+#include "global.h"
+#include "messenger.h"
+
+#define NODE_GREET_TIMEOUT 2000 // ms to wait for the first frame of a new connection
+
+typedef struct {
+    pthread_t thread;
+    SERVER server; // shared by all tenants
+    POLLER poller; // I/O thread shared by all tenants (low-latency and event-loop modes)
+
+    // Hosted identities
+    int numTenants;
+    MESSENGER **tenants;
+
+    int greeting; // accepted connections waiting for their first frame
+
+    pthread_mutex_t mutex;
+} NODE;
+
+typedef struct {
+    NODE *node;
+    int socket;
+} PTHREAD_GREET_ARG;
+
+// Node manipulation and threads
+void node_init(NODE *node);
+void node_destroy(NODE *node);
+int node_start(NODE *node, int port);
+void node_stop(NODE *node);
+
+void node_run(NODE *node);
+void node_greet(PTHREAD_GREET_ARG *args);
+void node_poll_readable(NODE *node, CONNECTION *conn);
+void node_poll_spin(NODE *node);
+
+// Tenants
+MESSENGER* node_addTenant(NODE *node, char *username);
+MESSENGER* node_getTenant(NODE *node, char *username);
+MESSENGER* node_getTenantByPos(NODE *node, int pos);
+
+// Menu
+void node_menu(NODE *node);
+void node_menu_chooseTenant(NODE *node);
+void node_menu_statistics(NODE *node);
+
+#endif // NODE_H
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE // pthread_setaffinity_np, CPU_SET
+
+#include "poller.h"
+#include "trace.h"
+
+#include <sched.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+void poller_init(POLLER *poller, POLLER_CALLBACK onReadable, POLLER_SPIN onSpin, void *arg) {
+    poller->epoll = -1;
+    poller->cpu = -1;
+    poller->wait = 0;
+    poller->running = 0;
+
+    poller->onReadable = onReadable;
+    poller->onSpin = onSpin;
+    poller->arg = arg;
+}
+
+void poller_destroy(POLLER *poller) {
+    poller_stop(poller);
+
+    if(poller->epoll!=-1) {
+        close(poller->epoll);
+        poller->epoll = -1;
+    }
+}
+
+int poller_start(POLLER *poller, int cpu, int wait) {
+    // Returns 1, 0 if running but not pinned, -1 on failure
+    poller->epoll = epoll_create1(0);
+    if(poller->epoll == -1)
+        return -1;
+    poller->wait = wait;
+
+    // Create thread
+    poller->running = 1;
+    if(pthread_create(&(poller->thread), NULL, (void*)&poller_run, (void*)poller)!=0) {
+        poller->running = 0;
+        close(poller->epoll);
+        poller->epoll = -1;
+        return -1;
+    }
+
+    // Pin to its core
+    if(cpu<0)
+        return 1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(cpu<CPU_SETSIZE)
+        CPU_SET(cpu, &set);
+    int retn = pthread_setaffinity_np(poller->thread, sizeof(set), &set);
+    if(retn!=0) {
+        errno = retn;
+        return 0;
+    }
+    poller->cpu = cpu;
+
+    return 1;
+}
+
+void poller_stop(POLLER *poller) {
+    if(!poller->running)
+        return;
+
+    // Thread checks the flag every spin
+    poller->running = 0;
+    pthread_join(poller->thread, NULL);
+}
+
+int poller_add(POLLER *poller, int sock, void *ptr) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP; // level triggered: what is not read is reported again
+    event.data.ptr = ptr;
+    return epoll_ctl(poller->epoll, EPOLL_CTL_ADD, sock, &event);
+}
+
+void poller_remove(POLLER *poller, int sock) {
+    // Events already returned for it may still be delivered: callers re-validate ptr
+    struct epoll_event event;
+    epoll_ctl(poller->epoll, EPOLL_CTL_DEL, sock, &event);
+}
+
+void poller_tuneSocket(int sock) {
+    int on = 1;
+
+    // Small frames leave at once instead of waiting for the previous ACK (Nagle)
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    poller_quickAck(sock);
+
+#ifdef SO_BUSY_POLL
+    // Blocking reads spin on the device queue first (best effort: raising it may need CAP_NET_ADMIN)
+    int usec = POLLER_BUSY_POLL;
+    setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#endif
+}
+
+void poller_quickAck(int sock) {
+    // Not sticky: the kernel goes back to delayed ACKs, so it is set again after every read
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+void poller_prefault(void *buffer, int size) {
+    // Touch every page now: the first write to each one faults
+    volatile char *p = buffer;
+    int i=0;
+    for(i=0; i<size; i+=4096)
+        p[i] = 0;
+    if(size>0)
+        p[size-1] = 0;
+}
+
+void poller_run(POLLER *poller) {
+    struct epoll_event events[POLLER_EVENTS];
+    trace_threadName("io");
+
+    // Stack pages faulted in now, not on the first burst
+    poller_prefaultStack();
+    poller_prefault(events, sizeof(events));
+
+    while(poller->running) {
+        // Spinning never sleeps: a wakeup per frame is the jitter low-latency mode is here to avoid
+        int n = epoll_wait(poller->epoll, events, POLLER_EVENTS, poller->wait);
+        int i=0;
+        for(i=0; i<n; i++)
+            poller->onReadable(poller->arg, events[i].data.ptr);
+
+        if(poller->onSpin!=NULL)
+            poller->onSpin(poller->arg);
+
+        // Nothing ready: let a thread sharing the core run (returns at once on an isolated core)
+        if(n<=0 && poller->wait==0)
+            sched_yield();
+    }
+}
+
+void poller_prefaultStack(void) {
+    // Frames below the caller's, where its callbacks will run
+    char stack[POLLER_STACK_TOUCH];
+    poller_prefault(stack, sizeof(stack));
+}
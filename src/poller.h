@@ -0,0 +1,48 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "global.h"
+
+#define POLLER_EVENTS      64 // ready sockets handled per spin
+#define POLLER_BUSY_POLL   50 // us the kernel may busy-poll the device on a socket read (SO_BUSY_POLL)
+#define POLLER_STACK_TOUCH (64*1024) // stack pre-faulted by the I/O thread
+#define POLLER_WAIT        10 // ms the event-loop I/O thread may sleep between spins
+
+// Called from the I/O thread: a registered socket has data (or was closed)
+typedef void (*POLLER_CALLBACK)(void *arg, void *ptr);
+// Called from the I/O thread once per spin
+typedef void (*POLLER_SPIN)(void *arg);
+
+// One I/O thread for many sockets: optionally pinned and never sleeping (low latency), or sleeping in epoll (event loop)
+typedef struct {
+    pthread_t thread;
+    int epoll;
+    int cpu; // -1 = not pinned
+    int wait; // ms epoll_wait may sleep (0 = spin)
+    int running;
+
+    POLLER_CALLBACK onReadable;
+    POLLER_SPIN onSpin;
+    void *arg;
+} POLLER;
+
+// Poller manipulation
+void poller_init(POLLER *poller, POLLER_CALLBACK onReadable, POLLER_SPIN onSpin, void *arg);
+void poller_destroy(POLLER *poller);
+int poller_start(POLLER *poller, int cpu, int wait);
+void poller_stop(POLLER *poller);
+
+// Sockets (ptr is passed to onReadable)
+int poller_add(POLLER *poller, int sock, void *ptr);
+void poller_remove(POLLER *poller, int sock);
+
+// Tuning
+void poller_tuneSocket(int sock);
+void poller_quickAck(int sock);
+void poller_prefault(void *buffer, int size);
+
+// Internal
+void poller_run(POLLER *poller);
+void poller_prefaultStack(void);
+
+#endif // POLLER_H
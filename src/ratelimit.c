@@ -0,0 +1,30 @@
+
+#include "ratelimit.h"
+#include "timer.h"
+
+void tokenbucket_init(TOKEN_BUCKET *bucket, double rate, double burst) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->last = timer_nowmsec();
+}
+
+double tokenbucket_take(TOKEN_BUCKET *bucket, double tokens) {
+    // Unlimited
+    if(bucket->rate<=0)
+        return 0;
+
+    // Refill
+    double now = timer_nowmsec();
+    bucket->tokens += (now - bucket->last)*bucket->rate/1E3;
+    if(bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last = now;
+
+    // Take, going into debt if needed
+    bucket->tokens -= tokens;
+    if(bucket->tokens >= 0)
+        return 0;
+
+    return -bucket->tokens*1E3/bucket->rate;
+}
@@ -0,0 +1,18 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include "global.h"
+
+typedef struct {
+    double rate; // tokens per second
+    double burst; // bucket size
+    double tokens; // available tokens (negative = debt)
+    double last; // last refill (ms)
+} TOKEN_BUCKET;
+
+void tokenbucket_init(TOKEN_BUCKET *bucket, double rate, double burst);
+
+// Takes tokens, returns time to wait (ms) until the bucket is out of debt. Not thread-safe: callers serialize.
+double tokenbucket_take(TOKEN_BUCKET *bucket, double tokens);
+
+#endif // RATELIMIT_H
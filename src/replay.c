@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include "messenger.h"
+#include "node.h"
+#include "capture.h"
+#include "client.h"
+#include "timer.h"
+
+#define REPLAY_PORT      2021 // loopback port of the replayed node (not MESSENGER_SERVER_PORT: one may be running)
+#define REPLAY_TENANT    "replay"
+#define REPLAY_MAX_CONN  4096 // captured connections replayed at once
+#define REPLAY_MAX_MSGS  1000000 // chat messages timed
+#define REPLAY_DRAIN     2000 // ms to wait for the last messages once everything is sent
+
+// Captured connection, replayed as a loopback client
+typedef struct {
+    int socket; // -1 = not open
+    int index; // in REPLAY.conns, names the client ("replay<index>")
+
+    // Send times of chat messages not delivered yet (FIFO)
+    int numPending;
+    int maxPending;
+    int firstPending;
+    double *pending;
+} REPLAY_CONN;
+
+typedef struct {
+    int numConns;
+    REPLAY_CONN *conns; // by captured id
+    int epoll; // replies from the node, read and dropped
+
+    // Delivery latency of chat messages, us
+    int numSamples;
+    double *samples;
+    long sent; // chat messages sent
+    long delivered;
+    double lastDelivery; // us
+
+    pthread_t drainThread;
+    pthread_mutex_t mutex;
+} REPLAY;
+
+static REPLAY replay;
+
+double replay_nowUsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1e6 + now.tv_nsec/1e3;
+}
+
+REPLAY_CONN* replay_getConn(int id, char *ip, int port) {
+    // Captured id, opened on first use
+    if(id<0 || id>=REPLAY_MAX_CONN)
+        return NULL;
+    if(id>=replay.numConns) {
+        pthread_mutex_lock(&(replay.mutex));
+        replay.conns = realloc(replay.conns, (id+1)*sizeof(REPLAY_CONN));
+        int i=0;
+        for(i=replay.numConns; i<=id; i++) {
+            REPLAY_CONN *conn = &(replay.conns[i]);
+            conn->socket = -1;
+            conn->index = i;
+            conn->numPending = conn->maxPending = conn->firstPending = 0;
+            conn->pending = NULL;
+        }
+        replay.numConns = id+1;
+        pthread_mutex_unlock(&(replay.mutex));
+    }
+
+    REPLAY_CONN *conn = &(replay.conns[id]);
+    if(conn->socket==-1) {
+        conn->socket = client_connect(ip, port);
+        if(conn->socket==-1)
+            return NULL;
+
+        // Unique name, so the node tells the clients apart. Its answer means the connection is up:
+        // accepting is not part of what is timed.
+        char name[32];
+        sprintf(name, "%s%d", REPLAY_TENANT, id);
+        char frame[MSG_HEADER_SIZE+MSG_MAX_SIZE];
+        int size = messenger_msg_encode(MSGTYPE_USERNAME, name, strlen(name), frame);
+        char msgType = 0;
+        if(send(conn->socket, frame, size, MSG_NOSIGNAL)!=size || messenger_msg_recv(conn->socket, &msgType, frame, MSG_MAX_SIZE)<=0) {
+            close(conn->socket);
+            conn->socket = -1;
+            return NULL;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = conn->socket; // not conn: the list is reallocated while the drain thread runs
+        epoll_ctl(replay.epoll, EPOLL_CTL_ADD, conn->socket, &event);
+    }
+    return conn;
+}
+
+void replay_drain(void *arg) {
+    // Node's answers are not part of the workload: read and drop them
+    struct epoll_event events[64];
+    char buffer[64*1024];
+    while(1) {
+        int n = epoll_wait(replay.epoll, events, 64, 100);
+        int i=0;
+        for(i=0; i<n; i++) {
+            int sock = events[i].data.fd;
+            if(recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)==0)
+                epoll_ctl(replay.epoll, EPOLL_CTL_DEL, sock, NULL);
+        }
+    }
+}
+
+int replay_onEvent(void *arg, int event, CONNECTION *conn, char *text) {
+    // Called by the node with its lock: a replayed chat message was delivered
+    int id = -1;
+    if(event!=MESSENGER_EVENT_MSG || sscanf(conn->username, REPLAY_TENANT "%d", &id)!=1)
+        return 0;
+
+    double now = replay_nowUsec();
+    pthread_mutex_lock(&(replay.mutex));
+    if(id>=0 && id<replay.numConns) {
+        REPLAY_CONN *rconn = &(replay.conns[id]);
+        if(rconn->firstPending<rconn->numPending) {
+            double sentAt = rconn->pending[(rconn->firstPending)++];
+            if(replay.numSamples<REPLAY_MAX_MSGS)
+                replay.samples[(replay.numSamples)++] = now - sentAt;
+            (replay.delivered)++;
+            replay.lastDelivery = now;
+        }
+    }
+    pthread_mutex_unlock(&(replay.mutex));
+
+    return 1; // not kept as unread
+}
+
+void replay_pending(REPLAY_CONN *conn, double now) {
+    pthread_mutex_lock(&(replay.mutex));
+
+    // Grow list
+    if(conn->numPending==conn->maxPending) {
+        conn->maxPending = (conn->maxPending==0? 64 : conn->maxPending*2);
+        conn->pending = realloc(conn->pending, conn->maxPending*sizeof(double));
+    }
+    conn->pending[(conn->numPending)++] = now;
+    (replay.sent)++;
+
+    pthread_mutex_unlock(&(replay.mutex));
+}
+
+int replay_compareDouble(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x>y) - (x<y);
+}
+
+int main(int argc, char *argv[]) {
+    // replay [-f] [-p port] capture
+    int fast = 0, port = REPLAY_PORT;
+    char *path = NULL;
+    int i=0;
+    for(i=1; i<argc; i++) {
+        if(strcmp(argv[i], "-f")==0)
+            fast = 1;
+        else if(strcmp(argv[i], "-p")==0 && i+1<argc)
+            port = atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if(path==NULL) {
+        printf("Usage: %s [-f] [-p port] <capture>\n", argv[0]);
+        printf("  Replays the frames a messenger received (MESSENGER_CAPTURE) against a node on 127.0.0.1:port.\n");
+        printf("  -f  as fast as possible (default: original timing)\n");
+        return 1;
+    }
+
+    CAPTURE_READER reader;
+    if(capture_openReader(&reader, path)==-1) {
+        printf(">> Failed to read %s (%s).\n", path, strerror(errno));
+        return 1;
+    }
+
+    // Messenger under test: a node tenant, so the port is ours to pick
+    char snapshot[64];
+    sprintf(snapshot, "messenger-%s.snap", REPLAY_TENANT);
+    unlink(snapshot);
+    NODE node;
+    node_init(&node);
+    if(node_start(&node, port)==-1) {
+        printf(">> Failed to listen on port %d (%s).\n", port, strerror(errno));
+        return 1;
+    }
+    MESSENGER *tenant = node_addTenant(&node, REPLAY_TENANT);
+
+    // Every message must reach the listener to be timed: no filters, and no rate limits when flooding
+    messenger_lock(tenant);
+    tenant->config.filter = 0;
+    filter_init(&(tenant->filter)); // drops MESSENGER_MUTE keywords (filter_match runs regardless of config.filter)
+    if(fast)
+        tenant->config.rateFrames = tenant->config.rateBytes = 0;
+    tenant->listener = &replay_onEvent;
+    messenger_unlock(tenant);
+
+    replay.numConns = 0;
+    replay.conns = NULL;
+    replay.epoll = epoll_create1(0);
+    replay.numSamples = 0;
+    replay.samples = malloc(REPLAY_MAX_MSGS*sizeof(double));
+    replay.sent = replay.delivered = 0;
+    replay.lastDelivery = 0;
+    pthread_mutex_init(&(replay.mutex), NULL);
+    pthread_create(&(replay.drainThread), NULL, (void*)&replay_drain, NULL);
+
+    // Received frames are sent again, on the original schedule unless flooding
+    CAPTURE_RECORD record;
+    char data[MSG_MAX_SIZE], frame[MSG_HEADER_SIZE+MSG_MAX_SIZE];
+    long frames = 0, bytes = 0, framesOut = 0, skipped = 0;
+    double start = replay_nowUsec(), first = -1; // first frame replayed, and its captured time
+    int retn = 0;
+    while((retn = capture_read(&reader, &record, data, MSG_MAX_SIZE))==1) {
+        if(record.kind==CAPTURE_OUT)
+            framesOut++;
+        if(record.kind==CAPTURE_CLOSE && record.conn<replay.numConns && replay.conns[record.conn].socket!=-1)
+            shutdown(replay.conns[record.conn].socket, SHUT_WR);
+        if(record.kind!=CAPTURE_IN)
+            continue;
+
+        // Transports and targets refer to the original hosts: TCP on loopback only
+        if(record.msgType==MSGTYPE_TRANSPORT || record.msgType==MSGTYPE_TARGET || record.size>MSG_MAX_SIZE) {
+            skipped++;
+            continue;
+        }
+
+        REPLAY_CONN *conn = replay_getConn(record.conn, "127.0.0.1", port);
+        if(conn==NULL) {
+            skipped++;
+            continue;
+        }
+
+        if(first<0) {
+            first = record.time;
+            start = replay_nowUsec();
+        }
+        if(!fast) {
+            double wait = start + (record.time - first) - replay_nowUsec();
+            if(wait>0)
+                msleep(wait/1000);
+        }
+
+        // Names would collide: every client keeps its own
+        char *payload = data;
+        int size = record.size;
+        char name[32];
+        if(record.msgType==MSGTYPE_USERNAME || record.msgType==MSGTYPE_USERNAME_ANSWER) {
+            size = sprintf(name, "%s%d", REPLAY_TENANT, conn->index);
+            payload = name;
+        }
+
+        int msgSize = messenger_msg_encode(record.msgType, payload, size, frame);
+        if(record.msgType==MSGTYPE_MSG || record.msgType==MSGTYPE_MSG_SENT)
+            replay_pending(conn, replay_nowUsec());
+        if(send(conn->socket, frame, msgSize, MSG_NOSIGNAL)!=msgSize) {
+            skipped++;
+            continue;
+        }
+        frames++;
+        bytes += msgSize;
+    }
+    double end = replay_nowUsec();
+    if(retn==-1)
+        printf(">> Capture truncated after %ld frames.\n", frames);
+    capture_closeReader(&reader);
+
+    // Last messages in flight
+    TIMER t;
+    timer_start(&t);
+    while(1) {
+        pthread_mutex_lock(&(replay.mutex));
+        int done = (replay.delivered>=replay.sent);
+        pthread_mutex_unlock(&(replay.mutex));
+        timer_stop(&t);
+        if(done || timer_timemsec(&t)>=REPLAY_DRAIN)
+            break;
+        msleep(1);
+    }
+
+    // Report: until the last frame is sent or the last message is handled, whichever is later
+    pthread_mutex_lock(&(replay.mutex));
+    double elapsed = ((replay.lastDelivery>end? replay.lastDelivery : end) - start)/1e6;
+    printf("Replayed %s (%s): %d connections, %ld frames, %ld bytes in %.3f s (%ld not replayable, %ld frames sent by the recorded messenger)\n",
+           path, (fast? "as fast as possible" : "original timing"), replay.numConns, frames, bytes, elapsed, skipped, framesOut);
+    if(elapsed>0)
+        printf("Throughput: %.0f frames/s, %.2f MB/s\n", frames/elapsed, bytes/elapsed/1e6);
+    printf("Messages: %ld of %ld delivered\n", replay.delivered, replay.sent);
+    if(replay.numSamples>0) {
+        int n = replay.numSamples;
+        qsort(replay.samples, n, sizeof(double), &replay_compareDouble);
+        printf("Latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               replay.samples[n/2], replay.samples[(long)n*99/100], replay.samples[(long)n*999/1000], replay.samples[n-1]);
+    }
+    pthread_mutex_unlock(&(replay.mutex));
+
+    // Clients first, so the node sees them go
+    for(i=0; i<replay.numConns; i++)
+        if(replay.conns[i].socket!=-1)
+            shutdown(replay.conns[i].socket, SHUT_RDWR);
+    pthread_cancel(replay.drainThread);
+    pthread_join(replay.drainThread, NULL);
+
+    node_stop(&node);
+    node_destroy(&node);
+    unlink(snapshot);
+
+    for(i=0; i<replay.numConns; i++) {
+        if(replay.conns[i].socket!=-1)
+            close(replay.conns[i].socket);
+        free(replay.conns[i].pending);
+    }
+    free(replay.conns);
+    free(replay.samples);
+    close(replay.epoll);
+
+    return 0;
+}
@@ -31,6 +31,10 @@ int server_start(SERVER *server, int port) {
     if(server->socket == -1)
         return -1;
 
+    // Allow restarting while old connections are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind socket
     struct sockaddr_in serverConf;
     serverConf.sin_family = AF_INET;
@@ -40,7 +44,7 @@ int server_start(SERVER *server, int port) {
         return -1;
 
     // Listen
-    if(listen(server->socket, 3) == -1) // queue of 3 pending connections
+    if(listen(server->socket, SOMAXCONN) == -1) // as many pending connections as the kernel allows (reconnect storms)
         return -1;
 
     // Create thread
@@ -88,11 +92,12 @@ void server_shutdown(SERVER *server) {
 }
 
 void server_addNewConnection(SERVER *server, int sock) {
+    pthread_mutex_lock(&(server->mutex));
+
+    // Under the lock: the list may be taken meanwhile
     const int newListSize = server->newConn + 1;
     const int newPos = server->newConn;
 
-    pthread_mutex_lock(&(server->mutex));
-
     // Realloc list
     server->newConnSockets = realloc(server->newConnSockets, newListSize*sizeof(int));
 
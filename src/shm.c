@@ -0,0 +1,193 @@
+
+#define _GNU_SOURCE // memfd_create
+
+#include "shm.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+void shm_init(SHM_CHANNEL *shm) {
+    shm->rxFd = -1;
+    shm->rx = NULL;
+    shm->tx = NULL;
+}
+
+void shm_close(SHM_CHANNEL *shm) {
+    if(shm->rx!=NULL)
+        munmap(shm->rx, sizeof(SHM_RING));
+    if(shm->tx!=NULL)
+        munmap(shm->tx, sizeof(SHM_RING));
+    if(shm->rxFd!=-1)
+        close(shm->rxFd);
+    shm_init(shm);
+}
+
+int shm_create(SHM_CHANNEL *shm) {
+    // Anonymous file, kept open so the peer can open it through /proc
+    int fd = memfd_create("messenger-shm", MFD_CLOEXEC);
+    if(fd==-1)
+        return -1;
+    if(ftruncate(fd, sizeof(SHM_RING))==-1) {
+        close(fd);
+        return -1;
+    }
+
+    SHM_RING *ring = mmap(NULL, sizeof(SHM_RING), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(ring==MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    // Pages are zeroed by ftruncate
+    ring->magic = SHM_MAGIC;
+
+    shm->rxFd = fd;
+    shm->rx = ring;
+    return 1;
+}
+
+int shm_attach(SHM_CHANNEL *shm, int pid, int fd) {
+    // Fails if the peer is in another pid namespace or owned by another user
+    char path[64];
+    sprintf(path, "/proc/%d/fd/%d", pid, fd);
+    int myFd = open(path, O_RDWR|O_CLOEXEC);
+    if(myFd==-1)
+        return -1;
+
+    struct stat st;
+    if(fstat(myFd, &st)==-1 || st.st_size!=sizeof(SHM_RING)) {
+        close(myFd);
+        return -1;
+    }
+
+    SHM_RING *ring = mmap(NULL, sizeof(SHM_RING), PROT_READ|PROT_WRITE, MAP_SHARED, myFd, 0);
+    close(myFd);
+    if(ring==MAP_FAILED)
+        return -1;
+    if(ring->magic!=SHM_MAGIC) {
+        munmap(ring, sizeof(SHM_RING));
+        return -1;
+    }
+
+    shm->tx = ring;
+    return 1;
+}
+
+int shm_hostId(char dest[40]) {
+    // Changes on every boot, equal for all processes of the host
+    FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if(file==NULL)
+        return -1;
+    int retn = (fscanf(file, "%39s", dest)==1? 1 : -1);
+    fclose(file);
+    return retn;
+}
+
+int shm_isLocalPeer(int socket) {
+    struct sockaddr_storage peer, local;
+    socklen_t peerLen = sizeof(peer), localLen = sizeof(local);
+    if(getpeername(socket, (struct sockaddr*)&peer, &peerLen)==-1 || getsockname(socket, (struct sockaddr*)&local, &localLen)==-1)
+        return 0;
+
+    // Unix socket: same host by construction
+    if(peer.ss_family==AF_UNIX)
+        return 1;
+    if(peer.ss_family!=AF_INET)
+        return 0;
+
+    // Loopback, or our own address (routed through loopback): a remote peer can't complete the handshake
+    struct sockaddr_in *peerIn = (struct sockaddr_in*)&peer, *localIn = (struct sockaddr_in*)&local;
+    return ((ntohl(peerIn->sin_addr.s_addr) >> 24)==127 || peerIn->sin_addr.s_addr==localIn->sin_addr.s_addr);
+}
+
+void shm_copyIn(SHM_RING *ring, uint32_t pos, char *data, int size) {
+    // Copy to ring, wrapping around
+    uint32_t offset = pos % SHM_RING_SIZE;
+    uint32_t first = SHM_RING_SIZE - offset;
+    if(first > size)
+        first = size;
+    memcpy(ring->data+offset, data, first);
+    memcpy(ring->data, data+first, size-first);
+}
+
+void shm_copyOut(SHM_RING *ring, uint32_t pos, char *dest, int size) {
+    // Copy from ring, wrapping around
+    uint32_t offset = pos % SHM_RING_SIZE;
+    uint32_t first = SHM_RING_SIZE - offset;
+    if(first > size)
+        first = size;
+    memcpy(dest, ring->data+offset, first);
+    memcpy(dest+first, ring->data, size-first);
+}
+
+int shm_send(SHM_CHANNEL *shm, char *data, int size) {
+    SHM_RING *ring = shm->tx;
+    if(ring==NULL)
+        return -1;
+
+    // Full: caller retries later
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    uint32_t recordSize = sizeof(uint32_t) + size;
+    if(SHM_RING_SIZE - (head-tail) < recordSize)
+        return -1;
+
+    uint32_t size32 = size;
+    shm_copyIn(ring, head, (char*)&size32, sizeof(size32));
+    shm_copyIn(ring, head+sizeof(size32), data, size);
+    __atomic_store_n(&(ring->head), head+recordSize, __ATOMIC_RELEASE);
+
+    // Wake reader only if it sleeps (pairs with the fence in shm_wait)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(ring->waiting), __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&(ring->futex), 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &(ring->futex), FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+
+    return size;
+}
+
+int shm_recv(SHM_CHANNEL *shm, char dest[], int max) {
+    SHM_RING *ring = shm->rx;
+
+    // Empty
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    if(head==tail)
+        return 0;
+
+    // Record, truncated to max
+    uint32_t size = 0;
+    shm_copyOut(ring, tail, (char*)&size, sizeof(size));
+    if(size > head-tail-sizeof(size)) // corrupted by the peer
+        return -1;
+    int toCopy = (size>max? max : size);
+    shm_copyOut(ring, tail+sizeof(size), dest, toCopy);
+    __atomic_store_n(&(ring->tail), tail+sizeof(size)+size, __ATOMIC_RELEASE);
+
+    return toCopy;
+}
+
+int shm_wait(SHM_CHANNEL *shm, int timeout) {
+    SHM_RING *ring = shm->rx;
+    if(__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE)!=ring->tail)
+        return 1;
+
+    // Announce sleep, then check again so a send in between is not missed
+    uint32_t seq = __atomic_load_n(&(ring->futex), __ATOMIC_ACQUIRE);
+    __atomic_store_n(&(ring->waiting), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE)==ring->tail) {
+        struct timespec ts;
+        ts.tv_sec = timeout/1000;
+        ts.tv_nsec = (timeout%1000)*1000000L;
+        syscall(SYS_futex, &(ring->futex), FUTEX_WAIT, seq, &ts, NULL, 0);
+    }
+    __atomic_store_n(&(ring->waiting), 0, __ATOMIC_RELAXED);
+
+    return (__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE)!=ring->tail);
+}
@@ -0,0 +1,46 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "global.h"
+
+#include <stdint.h>
+
+#define SHM_RING_SIZE (256*1024) // bytes of records per direction
+#define SHM_MAGIC     0x4D48534D // "MSHM"
+#define SHM_WAIT_TIME 100 // ms, max sleep before checking for cancellation
+#define SHM_SEND_TIMEOUT 5000 // ms a ring may stay full before the peer is dropped
+
+// Single-producer single-consumer ring of [size:4][data] records, in a memfd
+typedef struct {
+    uint32_t magic;
+    uint32_t head; // write position (producer)
+    uint32_t tail; // read position (consumer)
+    uint32_t futex; // bumped by the producer to wake the consumer
+    uint32_t waiting; // consumer is sleeping on futex
+    char data[SHM_RING_SIZE];
+} SHM_RING;
+
+typedef struct {
+    pthread_t thread; // reader thread, while rx is set
+
+    int rxFd; // memfd of rx, opened by the peer through /proc
+    SHM_RING *rx; // peer writes, we read
+    SHM_RING *tx; // we write, peer reads (NULL = not attached)
+} SHM_CHANNEL;
+
+// Channel manipulation
+void shm_init(SHM_CHANNEL *shm);
+void shm_close(SHM_CHANNEL *shm);
+int shm_create(SHM_CHANNEL *shm);
+int shm_attach(SHM_CHANNEL *shm, int pid, int fd);
+
+// Same-host detection (kernel boot id, only trusted from loopback peers)
+int shm_hostId(char dest[40]);
+int shm_isLocalPeer(int socket);
+
+// Records
+int shm_send(SHM_CHANNEL *shm, char *data, int size);
+int shm_recv(SHM_CHANNEL *shm, char dest[], int max);
+int shm_wait(SHM_CHANNEL *shm, int timeout);
+
+#endif // SHM_H
@@ -0,0 +1,367 @@
+
+#include "snapshot.h"
+#include "messenger.h"
+
+#include <stdint.h>
+
+#define SNAPSHOT_CHUNK 65536 // bytes buffered before writing to the file on save
+
+typedef struct {
+    unsigned char *data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t pos; // read position
+
+    // Save: body written to file in chunks
+    FILE *file;
+    uint32_t written;
+    uint32_t checksum; // of the written bytes
+    int failed;
+} SNAPSHOT_BUFFER;
+
+void snapshot_init(SNAPSHOT *snapshot) {
+    snapshot->username[0] = '\0';
+    snapshot->numContacts = 0;
+    snapshot->contacts = NULL;
+}
+
+void snapshot_destroy(SNAPSHOT *snapshot) {
+    while(snapshot->numContacts>0)
+        snapshot_removeContact(snapshot, snapshot->numContacts-1);
+}
+
+SNAPSHOT_CONTACT* snapshot_addContact(SNAPSHOT *snapshot, char ip[], char username[]) {
+    const int newSize = snapshot->numContacts + 1;
+    const int pos = snapshot->numContacts;
+
+    // Realloc list
+    snapshot->contacts = realloc(snapshot->contacts, newSize*sizeof(SNAPSHOT_CONTACT));
+
+    // Add element
+    SNAPSHOT_CONTACT *contact = &(snapshot->contacts[pos]);
+    strncpy(contact->ip, ip, 15);
+    contact->ip[15] = '\0';
+    strncpy(contact->username, username, 31);
+    contact->username[31] = '\0';
+    contact->numDelivered = 0;
+    contact->delivered = NULL;
+    contact->numMessages = 0;
+    contact->messages = NULL;
+    contact->messagesTime = NULL;
+    contact->numSpills = 0;
+    contact->spills = NULL;
+
+    // Inc counter
+    (snapshot->numContacts)++;
+
+    return contact;
+}
+
+void snapshot_addMessage(SNAPSHOT_CONTACT *contact, char *msg, time_t time) {
+    const int newSize = contact->numMessages + 1;
+    const int pos = contact->numMessages;
+
+    // Realloc
+    contact->messages = realloc(contact->messages, newSize*sizeof(char*));
+    contact->messagesTime = realloc(contact->messagesTime, newSize*sizeof(time_t));
+
+    // Alloc and copy
+    contact->messages[pos] = calloc(strlen(msg)+1, sizeof(char));
+    strcpy(contact->messages[pos], msg);
+    contact->messagesTime[pos] = time;
+
+    // Inc counter
+    (contact->numMessages)++;
+}
+
+void snapshot_addDelivered(SNAPSHOT_CONTACT *contact, uint64_t *hashes, int num) {
+    if(num<=0)
+        return;
+    contact->delivered = realloc(contact->delivered, (contact->numDelivered+num)*sizeof(uint64_t));
+    memcpy(contact->delivered+contact->numDelivered, hashes, num*sizeof(uint64_t));
+    contact->numDelivered += num;
+}
+
+int snapshot_addSpill(SNAPSHOT_CONTACT *contact, SPILL *spill) {
+    if(spill->numMessages==0)
+        return 1;
+
+    // Records up to writePos never change, so a duplicate descriptor reads them after the lock is gone
+    int fd = -1;
+    if(fflush(spill->file)==EOF || (fd = dup(fileno(spill->file)))==-1)
+        return -1;
+
+    contact->spills = realloc(contact->spills, (contact->numSpills+1)*sizeof(SNAPSHOT_SPILL));
+    SNAPSHOT_SPILL *ref = &(contact->spills[contact->numSpills]);
+    ref->fd = fd;
+    ref->pos = spill->readPos;
+    ref->end = spill->writePos;
+    ref->numMessages = spill->numMessages;
+    (contact->numSpills)++;
+
+    return 1;
+}
+
+int snapshot_getContactPosByIP(SNAPSHOT *snapshot, char ip[]) {
+    // Search on contact list, and return
+    int i;
+    for(i=0; i<snapshot->numContacts; i++)
+        if(strcmp(snapshot->contacts[i].ip, ip)==0)
+            return i;
+    return -1;
+}
+
+void snapshot_removeContact(SNAPSHOT *snapshot, int pos) {
+    // Check pos
+    if(pos<0 || pos>=snapshot->numContacts)
+        return;
+
+    // Free messages
+    SNAPSHOT_CONTACT *contact = &(snapshot->contacts[pos]);
+    int i=0;
+    for(i=0; i<contact->numMessages; i++)
+        free(contact->messages[i]);
+    free(contact->messages);
+    free(contact->messagesTime);
+    free(contact->delivered);
+    for(i=0; i<contact->numSpills; i++)
+        close(contact->spills[i].fd);
+    free(contact->spills);
+
+    // Shift list and realloc
+    int newSize = snapshot->numContacts - 1;
+    for(i=pos; i<newSize; i++)
+        snapshot->contacts[i] = snapshot->contacts[i+1];
+    if(newSize==0) {
+        free(snapshot->contacts);
+        snapshot->contacts = NULL;
+    } else {
+        snapshot->contacts = realloc(snapshot->contacts, newSize*sizeof(SNAPSHOT_CONTACT));
+    }
+
+    // Update counter
+    snapshot->numContacts = newSize;
+}
+
+uint32_t snapshot_checksumUpdate(uint32_t hash, unsigned char *data, uint32_t size) {
+    // FNV-1a
+    uint32_t i=0;
+    for(i=0; i<size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t snapshot_checksum(unsigned char *data, uint32_t size) {
+    return snapshot_checksumUpdate(2166136261u, data, size);
+}
+
+void snapshot_flush(SNAPSHOT_BUFFER *buf) {
+    buf->checksum = snapshot_checksumUpdate(buf->checksum, buf->data, buf->size);
+    if(fwrite(buf->data, 1, buf->size, buf->file)!=buf->size)
+        buf->failed = 1;
+    buf->written += buf->size;
+    buf->size = 0;
+}
+
+void snapshot_write(SNAPSHOT_BUFFER *buf, void *data, uint32_t size) {
+    if(buf->file!=NULL && buf->size+size > SNAPSHOT_CHUNK)
+        snapshot_flush(buf);
+
+    // Grow buffer
+    while(buf->size+size > buf->capacity) {
+        buf->capacity = (buf->capacity==0? 4096 : buf->capacity*2);
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data+buf->size, data, size);
+    buf->size += size;
+}
+
+void snapshot_writeU32(SNAPSHOT_BUFFER *buf, uint32_t value) {
+    snapshot_write(buf, &value, sizeof(value));
+}
+
+void snapshot_writeStr(SNAPSHOT_BUFFER *buf, char *str) {
+    uint32_t len = strlen(str);
+    snapshot_writeU32(buf, len);
+    snapshot_write(buf, str, len);
+}
+
+void snapshot_writeSpill(SNAPSHOT_BUFFER *buf, SNAPSHOT_SPILL *spill) {
+    // Spill records have the same [time:8][size:4][text] layout as snapshot messages: copied as is
+    unsigned char chunk[4096];
+    long pos = spill->pos;
+    while(pos < spill->end) {
+        size_t toRead = (spill->end-pos > sizeof(chunk)? sizeof(chunk) : spill->end-pos);
+        ssize_t n = pread(spill->fd, chunk, toRead, pos);
+        if(n<=0) {
+            buf->failed = 1;
+            return;
+        }
+        snapshot_write(buf, chunk, n);
+        pos += n;
+    }
+}
+
+int snapshot_read(SNAPSHOT_BUFFER *buf, void *data, uint32_t size) {
+    if(buf->pos+size > buf->size)
+        return -1;
+    memcpy(data, buf->data+buf->pos, size);
+    buf->pos += size;
+    return 1;
+}
+
+int snapshot_readStr(SNAPSHOT_BUFFER *buf, char *str, uint32_t max) {
+    uint32_t len=0;
+    if(snapshot_read(buf, &len, sizeof(len))==-1 || len>=max)
+        return -1;
+    if(snapshot_read(buf, str, len)==-1)
+        return -1;
+    str[len] = '\0';
+    return 1;
+}
+
+int snapshot_readMsg(SNAPSHOT_BUFFER *buf, char *str, uint32_t max) {
+    // 1 = read, 0 = longer than max-1 (skipped), -1 = truncated
+    uint32_t len=0;
+    if(snapshot_read(buf, &len, sizeof(len))==-1 || buf->pos+len > buf->size)
+        return -1;
+    if(len>=max) {
+        buf->pos += len;
+        return 0;
+    }
+    if(snapshot_read(buf, str, len)==-1)
+        return -1;
+    str[len] = '\0';
+    return 1;
+}
+
+int snapshot_save(SNAPSHOT *snapshot, char *path) {
+    // Write to temp file and rename, so a crash never leaves a partial snapshot
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *file = fopen(tmpPath, "wb");
+    if(file==NULL)
+        return -1;
+
+    SNAPSHOT_BUFFER buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.file = file;
+    buf.checksum = snapshot_checksum(NULL, 0);
+
+    // Header (checksum and size filled below)
+    uint32_t header[4] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, 0 };
+    int ok = (fwrite(header, sizeof(header), 1, file)==1);
+
+    // Body
+    snapshot_writeStr(&buf, snapshot->username);
+    snapshot_writeU32(&buf, snapshot->numContacts);
+    int i=0, j=0;
+    for(i=0; i<snapshot->numContacts; i++) {
+        SNAPSHOT_CONTACT *contact = &(snapshot->contacts[i]);
+        snapshot_writeStr(&buf, contact->ip);
+        snapshot_writeStr(&buf, contact->username);
+        snapshot_writeU32(&buf, contact->numDelivered);
+        snapshot_write(&buf, contact->delivered, contact->numDelivered*sizeof(uint64_t));
+
+        // Spilled messages first (oldest), then the ones in memory
+        uint32_t numMessages = contact->numMessages;
+        for(j=0; j<contact->numSpills; j++)
+            numMessages += contact->spills[j].numMessages;
+        snapshot_writeU32(&buf, numMessages);
+        for(j=0; j<contact->numSpills; j++)
+            snapshot_writeSpill(&buf, &(contact->spills[j]));
+        for(j=0; j<contact->numMessages; j++) {
+            int64_t time = contact->messagesTime[j];
+            snapshot_write(&buf, &time, sizeof(time));
+            snapshot_writeStr(&buf, contact->messages[j]);
+        }
+    }
+    snapshot_flush(&buf);
+    free(buf.data);
+
+    header[2] = buf.written;
+    header[3] = buf.checksum;
+    ok = ok && !buf.failed
+            && fseek(file, 0, SEEK_SET)!=-1
+            && fwrite(header, sizeof(header), 1, file)==1;
+    ok = (fclose(file)==0) && ok;
+
+    if(!ok || rename(tmpPath, path)==-1) {
+        unlink(tmpPath);
+        return -1;
+    }
+
+    return 1;
+}
+
+int snapshot_load(SNAPSHOT *snapshot, char *path) {
+    FILE *file = fopen(path, "rb");
+    if(file==NULL)
+        return -1;
+
+    // Read whole file
+    SNAPSHOT_BUFFER buf;
+    memset(&buf, 0, sizeof(buf));
+    unsigned char chunk[4096];
+    size_t n=0;
+    while((n=fread(chunk, 1, sizeof(chunk), file)) > 0)
+        snapshot_write(&buf, chunk, n);
+    fclose(file);
+
+    // Check header
+    uint32_t header[4];
+    if(snapshot_read(&buf, header, sizeof(header))==-1
+            || header[0]!=SNAPSHOT_MAGIC || header[1]<1 || header[1]>SNAPSHOT_VERSION
+            || header[2]!=buf.size-sizeof(header)
+            || header[3]!=snapshot_checksum(buf.data+sizeof(header), header[2])) {
+        free(buf.data);
+        return -1;
+    }
+
+    // Body
+    uint32_t numContacts=0;
+    int ok = (snapshot_readStr(&buf, snapshot->username, 32)!=-1);
+    ok = ok && (snapshot_read(&buf, &numContacts, sizeof(numContacts))!=-1);
+
+    uint32_t i=0, j=0;
+    for(i=0; ok && i<numContacts; i++) {
+        char ip[16], username[32];
+        uint32_t numMessages=0, numDelivered=0;
+        int64_t mark=0;
+        ok = (snapshot_readStr(&buf, ip, 16)!=-1)
+                && (snapshot_readStr(&buf, username, 32)!=-1)
+                && (header[1]!=2 || snapshot_read(&buf, &mark, sizeof(mark))!=-1) // version 2 time mark, superseded
+                && (header[1]<3 || snapshot_read(&buf, &numDelivered, sizeof(numDelivered))!=-1)
+                && numDelivered <= (buf.size-buf.pos)/sizeof(uint64_t);
+        if(!ok)
+            break;
+
+        SNAPSHOT_CONTACT *contact = snapshot_addContact(snapshot, ip, username);
+        snapshot_addDelivered(contact, (uint64_t*)(buf.data+buf.pos), numDelivered);
+        buf.pos += numDelivered*sizeof(uint64_t);
+        ok = (snapshot_read(&buf, &numMessages, sizeof(numMessages))!=-1);
+        for(j=0; ok && j<numMessages; j++) {
+            // A bad message is skipped, the rest of the snapshot still loads
+            int64_t time=0;
+            char msg[MSG_MAX_SIZE+1];
+            int retn = -1;
+            ok = (snapshot_read(&buf, &time, sizeof(time))!=-1)
+                    && ((retn = snapshot_readMsg(&buf, msg, sizeof(msg)))!=-1);
+            if(retn==1)
+                snapshot_addMessage(contact, msg, time);
+        }
+    }
+
+    free(buf.data);
+
+    // Discard partially loaded state
+    if(!ok) {
+        snapshot_destroy(snapshot);
+        snapshot_init(snapshot);
+        return -1;
+    }
+
+    return 1;
+}
@@ -0,0 +1,56 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "global.h"
+#include "spill.h"
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC   0x504E534D // "MSNP"
+#define SNAPSHOT_VERSION 3 // 3 adds delivered hashes (older ones still load)
+
+typedef struct {
+    int fd; // duplicate of the spill file, kept open until saved
+    long pos; // oldest record
+    long end; // end of the records (later ones are not part of the snapshot)
+    int numMessages;
+} SNAPSHOT_SPILL;
+
+typedef struct {
+    char ip[16]; // contact's IP address
+    char username[32]; // contact's username
+    int numDelivered;
+    uint64_t *delivered; // hashes of their stamped messages already delivered (a sync peer resends them after a restart)
+
+    int numMessages; // num of messages pending
+    char **messages; // pending messages
+    time_t *messagesTime; // recv time
+
+    int numSpills;
+    SNAPSHOT_SPILL *spills; // spilled messages, older than the pending ones: copied from disk on save
+} SNAPSHOT_CONTACT;
+
+typedef struct {
+    char username[32]; // my username
+
+    int numContacts;
+    SNAPSHOT_CONTACT *contacts;
+} SNAPSHOT;
+
+// Snapshot manipulation
+void snapshot_init(SNAPSHOT *snapshot);
+void snapshot_destroy(SNAPSHOT *snapshot);
+
+// Contents
+SNAPSHOT_CONTACT* snapshot_addContact(SNAPSHOT *snapshot, char ip[], char username[]);
+void snapshot_addMessage(SNAPSHOT_CONTACT *contact, char *msg, time_t time);
+void snapshot_addDelivered(SNAPSHOT_CONTACT *contact, uint64_t *hashes, int num);
+int snapshot_addSpill(SNAPSHOT_CONTACT *contact, SPILL *spill);
+int snapshot_getContactPosByIP(SNAPSHOT *snapshot, char ip[]);
+void snapshot_removeContact(SNAPSHOT *snapshot, int pos);
+
+// Persistence
+int snapshot_save(SNAPSHOT *snapshot, char *path);
+int snapshot_load(SNAPSHOT *snapshot, char *path);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,75 @@
+
+#include "spill.h"
+
+#include <stdint.h>
+
+void spill_init(SPILL *spill) {
+    spill->file = NULL;
+    spill->readPos = 0;
+    spill->writePos = 0;
+    spill->numMessages = 0;
+}
+
+void spill_destroy(SPILL *spill) {
+    // Temp file is deleted on close
+    if(spill->file!=NULL)
+        fclose(spill->file);
+    spill_init(spill);
+}
+
+int spill_push(SPILL *spill, char *msg, time_t time) {
+    if(spill->file==NULL && (spill->file = tmpfile())==NULL)
+        return -1;
+
+    // Append record
+    int64_t time64 = time;
+    uint32_t size = strlen(msg);
+    if(fseek(spill->file, spill->writePos, SEEK_SET)==-1
+            || fwrite(&time64, sizeof(time64), 1, spill->file)!=1
+            || fwrite(&size, sizeof(size), 1, spill->file)!=1
+            || fwrite(msg, 1, size, spill->file)!=size) {
+        return -1;
+    }
+
+    spill->writePos += sizeof(time64) + sizeof(size) + size;
+    (spill->numMessages)++;
+
+    return 1;
+}
+
+int spill_read(SPILL *spill, long *pos, char msg[], int max, time_t *time) {
+    // End of segment
+    if(spill->file==NULL || *pos>=spill->writePos)
+        return -1;
+
+    // Record at pos, text truncated to max-1
+    int64_t time64 = 0;
+    uint32_t size = 0;
+    if(fseek(spill->file, *pos, SEEK_SET)==-1
+            || fread(&time64, sizeof(time64), 1, spill->file)!=1
+            || fread(&size, sizeof(size), 1, spill->file)!=1)
+        return -1;
+    uint32_t toRead = (size>max-1? max-1 : size);
+    if(fread(msg, 1, toRead, spill->file)!=toRead)
+        return -1;
+    msg[toRead] = '\0';
+    *time = time64;
+
+    *pos += sizeof(time64) + sizeof(size) + size;
+
+    return 1;
+}
+
+int spill_pop(SPILL *spill, char msg[], int max, time_t *time) {
+    if(spill->numMessages==0 || spill_read(spill, &(spill->readPos), msg, max, time)==-1)
+        return -1;
+
+    // Drained: give the descriptor back, a later spill opens a new file
+    if(--(spill->numMessages)==0) {
+        fclose(spill->file);
+        spill->file = NULL;
+        spill->readPos = spill->writePos = 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include "global.h"
+
+#include <time.h>
+
+// Sequential on-disk segment of [time:8][size:4][text] records, read back in order
+typedef struct {
+    FILE *file; // unnamed temp file, created on first push
+    long readPos; // oldest record
+    long writePos; // end of segment
+    int numMessages;
+} SPILL;
+
+// Segment manipulation
+void spill_init(SPILL *spill);
+void spill_destroy(SPILL *spill);
+
+// Messages
+int spill_push(SPILL *spill, char *msg, time_t time);
+int spill_pop(SPILL *spill, char msg[], int max, time_t *time);
+int spill_read(SPILL *spill, long *pos, char msg[], int max, time_t *time);
+
+#endif // SPILL_H
@@ -0,0 +1,10 @@
+
+#include "stats.h"
+
+void stats_init(STATS *stats) {
+    memset(stats, 0, sizeof(STATS));
+}
+
+void stats_add(long *counter, long value) {
+    __sync_fetch_and_add(counter, value);
+}
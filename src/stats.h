@@ -0,0 +1,29 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "global.h"
+
+typedef struct {
+    long framesIn; // frames received
+    long bytesIn; // payload bytes received
+    long framesOut; // frames sent
+    long bytesOut; // payload bytes sent
+
+    long throttleEvents; // reads paused by rate limits
+    long throttleTime; // total time paused (us: most pauses are under a ms)
+
+    long udpFallbacks; // UDP frames given up and sent over TCP
+    long udpMalformed; // UDP frames acked but dropped: bad length
+
+    long rejected; // messages dropped: not UTF-8 or with control characters
+    long muted; // messages dropped: muted keyword
+
+    long synced; // messages recovered by history reconciliation
+} STATS;
+
+void stats_init(STATS *stats);
+
+// Thread-safe counter update
+void stats_add(long *counter, long value);
+
+#endif // STATS_H
@@ -2,11 +2,11 @@
 #include "timer.h"
 
 void timer_start(TIMER *timer) {
-    clock_gettime(CLOCK_REALTIME, &(timer->time1));
+    clock_gettime(CLOCK_MONOTONIC, &(timer->time1));
 }
 
 void timer_stop(TIMER *timer) {
-    clock_gettime(CLOCK_REALTIME, &(timer->time2));
+    clock_gettime(CLOCK_MONOTONIC, &(timer->time2));
 }
 
 double timer_timemsec(TIMER *timer) {
@@ -17,6 +17,12 @@ double timer_timensec(TIMER *timer) {
     return (timer->time2.tv_sec*1E9 + timer->time2.tv_nsec) - (timer->time1.tv_sec*1E9 + timer->time1.tv_nsec);
 }
 
+double timer_nowmsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1E3 + now.tv_nsec/1E6;
+}
+
 void msleep(double timems) {
     usleep(timems*1E3);
 }
@@ -12,6 +12,7 @@ void timer_start(TIMER *timer);
 void timer_stop(TIMER *timer);
 double timer_timemsec(TIMER *timer);
 double timer_timensec(TIMER *timer);
+double timer_nowmsec(void);
 
 void msleep(double timems);
 
@@ -0,0 +1,169 @@
+
+#include "trace.h"
+
+#include <time.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+static int traceEnabled = 0;
+static int traceCapacity = 0;
+static volatile sig_atomic_t traceDumpRequest = 0;
+
+// Buffers of all threads that recorded spans
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t traceKey;
+static int numBuffers = 0;
+static TRACE_BUFFER **buffers = NULL;
+
+// This thread's buffer
+static __thread TRACE_BUFFER *threadBuffer = NULL;
+
+void trace_release(TRACE_BUFFER *buffer) {
+    // Thread exit: keep its spans until another thread takes the buffer
+    __atomic_store_n(&(buffer->free), 1, __ATOMIC_RELEASE);
+}
+
+void trace_signal(int sig) {
+    traceDumpRequest = 1;
+}
+
+void trace_createKey(void) {
+    pthread_key_create(&traceKey, (void*)&trace_release);
+}
+
+void trace_enable(int capacity) {
+    if(traceEnabled || capacity<=0)
+        return;
+    traceCapacity = capacity;
+    pthread_once(&traceOnce, &trace_createKey);
+
+    // kill -USR1 <pid> dumps the trace
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &trace_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
+    traceEnabled = 1;
+}
+
+int trace_isEnabled(void) {
+    return traceEnabled;
+}
+
+void trace_threadName(char *name) {
+    // Off: no buffer for threads that will never record
+    if(!traceEnabled)
+        return;
+    TRACE_BUFFER *buffer = trace_getBuffer();
+    if(buffer==NULL)
+        return;
+    strncpy(buffer->threadName, name, 15);
+    buffer->threadName[15] = '\0';
+}
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+uint64_t trace_begin(void) {
+    return (traceEnabled? trace_now() : 0);
+}
+
+void trace_end(const char *name, uint64_t start) {
+    if(!traceEnabled || start==0)
+        return;
+    uint64_t end = trace_now();
+
+    TRACE_BUFFER *buffer = trace_getBuffer();
+    if(buffer==NULL)
+        return;
+
+    // Only this thread writes; publish the slot after filling it
+    TRACE_SPAN *span = &(buffer->spans[buffer->numSpans % traceCapacity]);
+    span->name = name;
+    span->start = start;
+    span->duration = end - start;
+    __atomic_store_n(&(buffer->numSpans), buffer->numSpans+1, __ATOMIC_RELEASE);
+}
+
+TRACE_BUFFER* trace_getBuffer(void) {
+    if(threadBuffer!=NULL || !traceEnabled)
+        return threadBuffer;
+
+    pthread_mutex_lock(&traceMutex);
+
+    // Reuse the buffer of an exited thread, else add one
+    TRACE_BUFFER *buffer = NULL;
+    int i=0;
+    for(i=0; i<numBuffers && buffer==NULL; i++)
+        if(__atomic_load_n(&(buffers[i]->free), __ATOMIC_ACQUIRE))
+            buffer = buffers[i];
+    if(buffer==NULL && (buffer = malloc(sizeof(TRACE_BUFFER) + traceCapacity*sizeof(TRACE_SPAN)))!=NULL) {
+        buffers = realloc(buffers, (numBuffers+1)*sizeof(TRACE_BUFFER*));
+        buffers[numBuffers++] = buffer;
+    }
+    if(buffer!=NULL) {
+        buffer->tid = syscall(SYS_gettid);
+        buffer->threadName[0] = '\0';
+        __atomic_store_n(&(buffer->numSpans), 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&(buffer->free), 0, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&traceMutex);
+
+    threadBuffer = buffer;
+    pthread_setspecific(traceKey, buffer);
+    return buffer;
+}
+
+int trace_dumpRequested(void) {
+    if(!traceDumpRequest)
+        return 0;
+    traceDumpRequest = 0;
+    return 1;
+}
+
+int trace_dump(char *path) {
+    FILE *file = fopen(path, "w");
+    if(file==NULL)
+        return -1;
+
+    const int pid = getpid();
+    int first = 1;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&traceMutex);
+    int i=0;
+    for(i=0; i<numBuffers; i++) {
+        TRACE_BUFFER *buffer = buffers[i];
+
+        if(buffer->threadName[0]!='\0') {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    (first? "" : ",\n"), pid, buffer->tid, buffer->threadName);
+            first = 0;
+        }
+
+        // Newest spans; skip slots the owner overwrote while we read
+        uint64_t end = __atomic_load_n(&(buffer->numSpans), __ATOMIC_ACQUIRE);
+        uint64_t begin = (end>traceCapacity? end-traceCapacity : 0);
+        uint64_t n=0;
+        for(n=begin; n<end; n++) {
+            TRACE_SPAN span = buffer->spans[n % traceCapacity];
+            if(__atomic_load_n(&(buffer->numSpans), __ATOMIC_ACQUIRE) >= n+traceCapacity)
+                continue;
+
+            // Complete events, times in us
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    (first? "" : ",\n"), span.name, pid, buffer->tid, span.start/1000.0, span.duration/1000.0);
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&traceMutex);
+
+    fprintf(file, "\n]}\n");
+    return (fclose(file)==0? 1 : -1);
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "global.h"
+
+#include <stdint.h>
+
+#define TRACE_FILE     "messenger.trace.json"
+
+typedef struct {
+    const char *name; // static string
+    uint64_t start; // ns, CLOCK_MONOTONIC
+    uint64_t duration; // ns
+} TRACE_SPAN;
+
+typedef struct {
+    int tid;
+    char threadName[16];
+    int free; // thread exited, buffer can be reused
+
+    uint64_t numSpans; // total recorded, index = numSpans % capacity
+    TRACE_SPAN spans[]; // capacity set on enable (oldest overwritten)
+} TRACE_BUFFER;
+
+// Tracing control (off until enabled), capacity = spans kept per thread
+void trace_enable(int capacity);
+int trace_isEnabled(void);
+void trace_threadName(char *name);
+
+// Spans: uint64_t start = trace_begin(); ...; trace_end("stage", start);
+uint64_t trace_begin(void);
+void trace_end(const char *name, uint64_t start);
+
+// Chrome trace-event JSON, requested with SIGUSR1
+int trace_dump(char *path);
+int trace_dumpRequested(void);
+
+// Internal
+void trace_createKey(void);
+uint64_t trace_now(void);
+TRACE_BUFFER* trace_getBuffer(void);
+
+#endif // TRACE_H
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+
+#include "udp.h"
+#include "timer.h"
+
+#include <poll.h>
+
+// Sequence comparison, safe on wrap around
+#define UDP_BEFORE(a, b) ((int32_t)((a)-(b)) < 0)
+
+typedef struct {
+    int peerId;
+    char *data;
+    int size;
+} UDP_EVENT;
+
+void udp_init(UDP_TRANSPORT *udp, UDP_CALLBACK onReceive, UDP_CALLBACK onFailure, void *arg) {
+    udp->socket = -1;
+    udp->running = 0;
+
+    udp->nextId = 0;
+    udp->numPeers = 0;
+    udp->peers = NULL;
+    udp->numTx = 0;
+    udp->txBuffer = NULL;
+
+    udp->onReceive = onReceive;
+    udp->onFailure = onFailure;
+    udp->arg = arg;
+
+    udp->datagramsIn = udp->datagramsOut = 0;
+    udp->retransmits = udp->failures = 0;
+    udp->dropped = 0;
+
+    pthread_mutex_init(&(udp->mutex), NULL);
+}
+
+void udp_destroy(UDP_TRANSPORT *udp) {
+    while(udp->numPeers>0)
+        udp_removePeer(udp, udp->peers[0]->id);
+
+    free(udp->txBuffer);
+    udp->txBuffer = NULL;
+
+    pthread_mutex_destroy(&(udp->mutex));
+}
+
+int udp_start(UDP_TRANSPORT *udp, int port) {
+    // Create socket
+    udp->socket = socket(AF_INET, SOCK_DGRAM, 0); // IPV4, UDP
+    if(udp->socket == -1)
+        return -1;
+
+    // Bind socket
+    struct sockaddr_in conf;
+    conf.sin_family = AF_INET;
+    conf.sin_addr.s_addr = INADDR_ANY;
+    conf.sin_port = htons(port);
+    if(bind(udp->socket, (struct sockaddr*)&conf, sizeof(conf)) == -1) {
+        close(udp->socket);
+        udp->socket = -1;
+        return -1;
+    }
+
+    // Unused transports (most tenants of a node) don't pay for the batch
+    if(udp->txBuffer==NULL)
+        udp->txBuffer = malloc(UDP_BATCH*sizeof(*(udp->txBuffer)));
+
+    // Create thread
+    udp->running = 1;
+    pthread_create(&(udp->thread), NULL, (void*)&udp_run, (void*)udp);
+
+    return 1;
+}
+
+void udp_stop(UDP_TRANSPORT *udp) {
+    if(!udp->running)
+        return;
+
+    // Thread checks the flag every UDP_TICK
+    udp->running = 0;
+    pthread_join(udp->thread, NULL);
+
+    close(udp->socket);
+    udp->socket = -1;
+}
+
+int udp_getPort(UDP_TRANSPORT *udp) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if(getsockname(udp->socket, (struct sockaddr*)&addr, &len)==-1)
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
+int udp_addPeer(UDP_TRANSPORT *udp, char ip[], int port) {
+    UDP_PEER *peer = calloc(1, sizeof(UDP_PEER));
+    peer->addr.sin_family = AF_INET;
+    peer->addr.sin_addr.s_addr = inet_addr(ip);
+    peer->addr.sin_port = htons(port);
+
+    pthread_mutex_lock(&(udp->mutex));
+
+    peer->id = (udp->nextId)++;
+
+    // Add to list
+    udp->peers = realloc(udp->peers, (udp->numPeers+1)*sizeof(UDP_PEER*));
+    udp->peers[udp->numPeers] = peer;
+    (udp->numPeers)++;
+
+    pthread_mutex_unlock(&(udp->mutex));
+
+    return peer->id;
+}
+
+void udp_pause(UDP_TRANSPORT *udp, int peerId, double wait) {
+    pthread_mutex_lock(&(udp->mutex));
+
+    // Refuse the peer's data for a while: backpressure through retransmissions
+    UDP_PEER *peer = udp_getPeer(udp, peerId);
+    if(peer!=NULL)
+        peer->pausedUntil = timer_nowmsec() + wait;
+
+    pthread_mutex_unlock(&(udp->mutex));
+}
+
+void udp_removePeer(UDP_TRANSPORT *udp, int peerId) {
+    pthread_mutex_lock(&(udp->mutex));
+
+    int i=0, pos=-1;
+    for(i=0; i<udp->numPeers; i++)
+        if(udp->peers[i]->id==peerId)
+            pos = i;
+    if(pos==-1) {
+        pthread_mutex_unlock(&(udp->mutex));
+        return;
+    }
+
+    // Free pending datagrams
+    UDP_PEER *peer = udp->peers[pos];
+    for(i=0; i<UDP_WINDOW; i++)
+        free(peer->window[i].data);
+    free(peer);
+
+    // Shift list
+    for(i=pos; i<udp->numPeers-1; i++)
+        udp->peers[i] = udp->peers[i+1];
+    (udp->numPeers)--;
+    if(udp->numPeers==0) {
+        free(udp->peers);
+        udp->peers = NULL;
+    }
+
+    pthread_mutex_unlock(&(udp->mutex));
+}
+
+UDP_PEER* udp_getPeer(UDP_TRANSPORT *udp, int peerId) {
+    int i=0;
+    for(i=0; i<udp->numPeers; i++)
+        if(udp->peers[i]->id==peerId)
+            return udp->peers[i];
+    return NULL;
+}
+
+UDP_PEER* udp_getPeerByAddr(UDP_TRANSPORT *udp, struct sockaddr_in *addr) {
+    int i=0;
+    for(i=0; i<udp->numPeers; i++)
+        if(udp->peers[i]->addr.sin_addr.s_addr==addr->sin_addr.s_addr && udp->peers[i]->addr.sin_port==addr->sin_port)
+            return udp->peers[i];
+    return NULL;
+}
+
+int udp_send(UDP_TRANSPORT *udp, int peerId, char *data, int size) {
+    if(size>UDP_MAX_PAYLOAD)
+        return -1;
+
+    pthread_mutex_lock(&(udp->mutex));
+
+    // Unknown peer or window full: caller uses TCP
+    UDP_PEER *peer = udp_getPeer(udp, peerId);
+    if(!udp->running || peer==NULL || peer->nextSeq - peer->base >= UDP_WINDOW) {
+        pthread_mutex_unlock(&(udp->mutex));
+        return -1;
+    }
+
+    // Keep until acked
+    UDP_PENDING *pending = &(peer->window[peer->nextSeq%UDP_WINDOW]);
+    pending->data = malloc(size);
+    memcpy(pending->data, data, size);
+    pending->size = size;
+    pending->seq = peer->nextSeq;
+    pending->retries = 0;
+    pending->sentAt = timer_nowmsec();
+    (peer->nextSeq)++;
+
+    udp_queue(udp, &(peer->addr), UDP_TYPE_DATA, pending->seq, peer->base, data, size);
+
+    pthread_mutex_unlock(&(udp->mutex));
+
+    return 1;
+}
+
+void udp_flush(UDP_TRANSPORT *udp) {
+    pthread_mutex_lock(&(udp->mutex));
+    udp_flushLocked(udp);
+    pthread_mutex_unlock(&(udp->mutex));
+}
+
+void udp_flushLocked(UDP_TRANSPORT *udp) {
+    if(udp->numTx==0)
+        return;
+
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+
+    int i=0;
+    for(i=0; i<udp->numTx; i++) {
+        iov[i].iov_base = udp->txBuffer[i];
+        iov[i].iov_len = udp->txSize[i];
+        msgs[i].msg_hdr.msg_name = &(udp->txAddr[i]);
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &(iov[i]);
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Lost datagrams are retransmitted later
+    int sent = sendmmsg(udp->socket, msgs, udp->numTx, MSG_DONTWAIT);
+    if(sent>0)
+        udp->datagramsOut += sent;
+    udp->numTx = 0;
+}
+
+void udp_queue(UDP_TRANSPORT *udp, struct sockaddr_in *addr, int type, uint32_t field1, uint32_t field2, char *data, int size) {
+    // Batch full: send it
+    if(udp->numTx==UDP_BATCH)
+        udp_flushLocked(udp);
+
+    // Header: type, 3 bytes padding, two 32-bit fields (network order)
+    char *buffer = udp->txBuffer[udp->numTx];
+    uint32_t f1 = htonl(field1), f2 = htonl(field2);
+    memset(buffer, 0, 4);
+    buffer[0] = type;
+    memcpy(buffer+4, &f1, 4);
+    memcpy(buffer+8, &f2, 4);
+    if(size>0)
+        memcpy(buffer+UDP_HEADER_SIZE, data, size);
+
+    udp->txAddr[udp->numTx] = *addr;
+    udp->txSize[udp->numTx] = UDP_HEADER_SIZE+size;
+    (udp->numTx)++;
+}
+
+int udp_accept(UDP_PEER *peer, uint32_t seq, uint32_t senderBase) {
+    peer->ackPending = 1;
+
+    // Sender gave up on everything before its base
+    if(UDP_BEFORE(peer->recvBase, senderBase)) {
+        uint32_t shift = senderBase - peer->recvBase;
+        peer->recvBits = (shift>=64? 0 : peer->recvBits >> shift);
+        peer->recvBase = senderBase;
+        while(peer->recvBits & 1ULL) {
+            peer->recvBits >>= 1;
+            (peer->recvBase)++;
+        }
+    }
+
+    // Duplicate or out of window
+    if(UDP_BEFORE(seq, peer->recvBase))
+        return 0;
+    uint32_t offset = seq - peer->recvBase;
+    if(offset>=64 || (peer->recvBits & (1ULL << offset)))
+        return 0;
+
+    // Mark and slide over the received prefix
+    peer->recvBits |= (1ULL << offset);
+    while(peer->recvBits & 1ULL) {
+        peer->recvBits >>= 1;
+        (peer->recvBase)++;
+    }
+
+    return 1;
+}
+
+void udp_ack(UDP_PEER *peer, uint32_t cumAck, uint32_t bits) {
+    // Free everything before cumAck and everything in the selective bitmap
+    int i=0;
+    for(i=0; i<UDP_WINDOW; i++) {
+        UDP_PENDING *pending = &(peer->window[i]);
+        if(pending->data==NULL)
+            continue;
+
+        int acked = UDP_BEFORE(pending->seq, cumAck);
+        if(!acked && !UDP_BEFORE(pending->seq, cumAck+1)) {
+            uint32_t offset = pending->seq - cumAck - 1;
+            acked = (offset<32 && (bits & (1u << offset)));
+        }
+
+        if(acked) {
+            free(pending->data);
+            pending->data = NULL;
+        }
+    }
+
+    // Window base = oldest still pending
+    while(peer->base!=peer->nextSeq && peer->window[peer->base%UDP_WINDOW].data==NULL)
+        (peer->base)++;
+}
+
+void udp_run(UDP_TRANSPORT *udp) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char buffers[UDP_BATCH][UDP_HEADER_SIZE+UDP_MAX_PAYLOAD];
+
+    UDP_EVENT received[UDP_BATCH];
+    UDP_EVENT *failed = NULL;
+    int maxFailed = 0;
+
+    while(udp->running) {
+        // Wait for datagrams, at most one tick
+        struct pollfd pfd;
+        pfd.fd = udp->socket;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, UDP_TICK);
+
+        // Receive a batch
+        memset(msgs, 0, sizeof(msgs));
+        int i=0, j=0;
+        for(i=0; i<UDP_BATCH; i++) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = sizeof(buffers[i]);
+            msgs[i].msg_hdr.msg_name = &(addrs[i]);
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &(iov[i]);
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(udp->socket, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+
+        pthread_mutex_lock(&(udp->mutex));
+
+        int numReceived = 0;
+        double now = timer_nowmsec();
+        for(i=0; i<n; i++) {
+            (udp->datagramsIn)++;
+
+            // Only known peers
+            UDP_PEER *peer = udp_getPeerByAddr(udp, &(addrs[i]));
+            if(peer==NULL || msgs[i].msg_len<UDP_HEADER_SIZE)
+                continue;
+
+            char *buffer = buffers[i];
+            uint32_t f1, f2;
+            memcpy(&f1, buffer+4, 4);
+            memcpy(&f2, buffer+8, 4);
+
+            if(buffer[0]==UDP_TYPE_DATA) {
+                // Paused peer: not acked, so it is sent again later
+                if(now < peer->pausedUntil)
+                    continue;
+                // Oversized (truncated): not acked, so the sender gives up and falls back to TCP
+                if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                    (udp->dropped)++;
+                    continue;
+                }
+                if(udp_accept(peer, ntohl(f1), ntohl(f2))) {
+                    received[numReceived].peerId = peer->id;
+                    received[numReceived].data = buffer+UDP_HEADER_SIZE;
+                    received[numReceived].size = msgs[i].msg_len-UDP_HEADER_SIZE;
+                    numReceived++;
+                }
+            } else if(buffer[0]==UDP_TYPE_ACK) {
+                udp_ack(peer, ntohl(f1), ntohl(f2));
+            }
+        }
+
+        // Acks (cumulative + selective bitmap) and retransmissions
+        int numFailed = 0;
+        for(i=0; i<udp->numPeers; i++) {
+            UDP_PEER *peer = udp->peers[i];
+            if(peer->ackPending) {
+                udp_queue(udp, &(peer->addr), UDP_TYPE_ACK, peer->recvBase, (uint32_t)(peer->recvBits >> 1), NULL, 0);
+                peer->ackPending = 0;
+            }
+
+            for(j=0; j<UDP_WINDOW; j++) {
+                UDP_PENDING *pending = &(peer->window[j]);
+                if(pending->data==NULL || now - pending->sentAt < UDP_RTO)
+                    continue;
+
+                // Give up: handed to the caller
+                if(pending->retries>=UDP_MAX_RETRIES) {
+                    if(numFailed==maxFailed) {
+                        maxFailed = (maxFailed==0? 16 : maxFailed*2);
+                        failed = realloc(failed, maxFailed*sizeof(UDP_EVENT));
+                    }
+                    failed[numFailed].peerId = peer->id;
+                    failed[numFailed].data = pending->data;
+                    failed[numFailed].size = pending->size;
+                    numFailed++;
+                    pending->data = NULL;
+                    (udp->failures)++;
+                    continue;
+                }
+
+                udp_queue(udp, &(peer->addr), UDP_TYPE_DATA, pending->seq, peer->base, pending->data, pending->size);
+                (pending->retries)++;
+                pending->sentAt = now;
+                (udp->retransmits)++;
+            }
+
+            // Given up datagrams leave the window
+            while(peer->base!=peer->nextSeq && peer->window[peer->base%UDP_WINDOW].data==NULL)
+                (peer->base)++;
+        }
+
+        udp_flushLocked(udp);
+        pthread_mutex_unlock(&(udp->mutex));
+
+        // Handlers run without the transport lock
+        for(i=0; i<numReceived; i++)
+            udp->onReceive(udp->arg, received[i].peerId, received[i].data, received[i].size);
+        for(i=0; i<numFailed; i++) {
+            udp->onFailure(udp->arg, failed[i].peerId, failed[i].data, failed[i].size);
+            free(failed[i].data);
+        }
+    }
+
+    free(failed);
+}
@@ -0,0 +1,102 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include "global.h"
+
+#include <stdint.h>
+
+#define UDP_WINDOW      32 // max unacked datagrams per peer
+#define UDP_RTO         40 // ms, retransmission timeout
+#define UDP_MAX_RETRIES 5 // then the caller falls back to TCP (at-least-once: a lost ack means a duplicate)
+#define UDP_BATCH       32 // datagrams per sendmmsg/recvmmsg
+#define UDP_TICK        10 // ms, retransmission check period
+#define UDP_HEADER_SIZE 12
+#define UDP_MAX_PAYLOAD 1200
+
+#define UDP_TYPE_DATA 0
+#define UDP_TYPE_ACK  1
+
+typedef struct {
+    char *data; // NULL = free slot
+    int size;
+    uint32_t seq;
+    int retries;
+    double sentAt; // ms
+} UDP_PENDING;
+
+typedef struct {
+    int id;
+    struct sockaddr_in addr;
+
+    // Sender: window of unacked datagrams
+    uint32_t nextSeq;
+    uint32_t base; // oldest unacked
+    UDP_PENDING window[UDP_WINDOW];
+
+    // Receiver: bit i = seq recvBase+i received (recvBase itself is missing)
+    uint32_t recvBase;
+    uint64_t recvBits;
+    int ackPending;
+    double pausedUntil; // ms, data is neither accepted nor acked before (sender retransmits)
+} UDP_PEER;
+
+// Called from the UDP thread, without the transport lock
+typedef void (*UDP_CALLBACK)(void *arg, int peerId, char *data, int size);
+
+typedef struct {
+    pthread_t thread;
+    int socket;
+    int running;
+
+    // Peers
+    int nextId;
+    int numPeers;
+    UDP_PEER **peers;
+
+    // Outgoing datagrams, sent with a single sendmmsg
+    int numTx;
+    struct sockaddr_in txAddr[UDP_BATCH];
+    char (*txBuffer)[UDP_HEADER_SIZE+UDP_MAX_PAYLOAD]; // UDP_BATCH, allocated on start
+    int txSize[UDP_BATCH];
+
+    // Delivery and give-up handlers
+    UDP_CALLBACK onReceive;
+    UDP_CALLBACK onFailure;
+    void *arg;
+
+    // Counters
+    long datagramsIn;
+    long datagramsOut;
+    long retransmits;
+    long failures;
+    long dropped; // oversized datagrams, not acked
+
+    pthread_mutex_t mutex;
+} UDP_TRANSPORT;
+
+// Transport manipulation
+void udp_init(UDP_TRANSPORT *udp, UDP_CALLBACK onReceive, UDP_CALLBACK onFailure, void *arg);
+void udp_destroy(UDP_TRANSPORT *udp);
+int udp_start(UDP_TRANSPORT *udp, int port);
+void udp_stop(UDP_TRANSPORT *udp);
+int udp_getPort(UDP_TRANSPORT *udp);
+
+// Peers
+int udp_addPeer(UDP_TRANSPORT *udp, char ip[], int port);
+void udp_removePeer(UDP_TRANSPORT *udp, int peerId);
+void udp_pause(UDP_TRANSPORT *udp, int peerId, double wait);
+
+// Messages (queued until udp_flush)
+int udp_send(UDP_TRANSPORT *udp, int peerId, char *data, int size);
+void udp_flush(UDP_TRANSPORT *udp);
+
+// Internal
+void udp_run(UDP_TRANSPORT *udp);
+UDP_PEER* udp_getPeer(UDP_TRANSPORT *udp, int peerId);
+UDP_PEER* udp_getPeerByAddr(UDP_TRANSPORT *udp, struct sockaddr_in *addr);
+void udp_flushLocked(UDP_TRANSPORT *udp);
+void udp_queue(UDP_TRANSPORT *udp, struct sockaddr_in *addr, int type, uint32_t field1, uint32_t field2, char *data, int size);
+int udp_accept(UDP_PEER *peer, uint32_t seq, uint32_t senderBase);
+void udp_ack(UDP_PEER *peer, uint32_t cumAck, uint32_t bits);
+
+#endif // UDP_H